@@ -0,0 +1,423 @@
+#include <SFML/Graphics.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "alloc_tracker.hpp"
+#include "profiler.hpp"
+#include "tree_builder.hpp"
+#include "parallel_tree_builder.hpp"
+#include "tree_grower.hpp"
+#include "tree_renderer.hpp"
+#include "tree_lod.hpp"
+#include "forest_renderer.hpp"
+#include "soft_rasterizer.hpp"
+#include "recording.hpp"
+#include "spatial_index.hpp"
+#include "leaf_collider.hpp"
+#include "wind.hpp"
+#include "vec2xn.hpp"
+
+
+// Headless benchmark, prints a JSON report
+// Usage: Tree2DBenchmark [--frames N] [--warmup N] [--seed S] [--out file.json] [--compact] [--kinematic] [--simd scalar|sse2|avx2|neon] [--batch] [--threads N] [--offline-frames N] [--record file] [--baked N] [--picking N] [--collisions] [--growth-budget US] [--fail-on-alloc]
+int main(int argc, char** argv)
+{
+	uint32_t frames = 1000;
+	uint32_t warmup = 60;
+	uint64_t seed = 0;
+	std::string out_file;
+	bool fail_on_alloc = false;
+	bool compact = false;
+	// Leaves are compacted and follow their branch analytically
+	bool kinematic = false;
+	// Render data is generated by ForestRenderer on this many threads, 0 for the calling thread
+	uint32_t threads = 0;
+	bool batch = false;
+	// Frames rasterized in software at 1080p after the main loop
+	uint32_t offline_frames = 30;
+	// Measured frames are recorded to this file then played back
+	std::string record_file;
+	// Instances animated by a baked wind loop of the same tree, all generated every frame
+	uint32_t baked_instances = 100;
+	// Copies of the simulated tree queried by SpatialIndex, 64 copies are about a million nodes
+	uint32_t picking_trees = 64;
+	// Leaves collide with each other and with the branches every frame
+	bool collisions = false;
+	// The tree is grown again over frames of this many microseconds by TreeGrower, 0 to skip
+	float growth_budget = 500.0f;
+	for (int i(1); i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--frames") && has_value) {
+			frames = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--warmup") && has_value) {
+			warmup = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--seed") && has_value) {
+			seed = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (!std::strcmp(argv[i], "--out") && has_value) {
+			out_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--threads") && has_value) {
+			threads = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--offline-frames") && has_value) {
+			offline_frames = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--record") && has_value) {
+			record_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--baked") && has_value) {
+			baked_instances = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--picking") && has_value) {
+			picking_trees = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--growth-budget") && has_value) {
+			growth_budget = static_cast<float>(std::atof(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--collisions")) {
+			collisions = true;
+		}
+		else if (!std::strcmp(argv[i], "--batch")) {
+			batch = true;
+		}
+		else if (!std::strcmp(argv[i], "--kinematic")) {
+			kinematic = true;
+		}
+		else if (!std::strcmp(argv[i], "--compact")) {
+			compact = true;
+		}
+		else if (!std::strcmp(argv[i], "--simd") && has_value) {
+			const char* name = argv[++i];
+			bool found = false;
+			for (uint32_t backend(0); backend < simd::BackendsCount; ++backend) {
+				if (!std::strcmp(name, simd::getName(static_cast<simd::Backend>(backend)))) {
+					found = simd::setBackend(static_cast<simd::Backend>(backend));
+				}
+			}
+			if (!found) {
+				std::fprintf(stderr, "SIMD backend %s not available\n", name);
+				return 1;
+			}
+		}
+		else if (!std::strcmp(argv[i], "--fail-on-alloc")) {
+			fail_on_alloc = true;
+		}
+		else {
+			std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	const v2::TreeConf tree_conf{
+		80.0f, // branch_width
+		0.95f, // branch_width_ratio
+		0.75f, // split_width_ratio
+		0.5f, // deviation
+		PI * 0.25f, // split angle
+		0.1f, // branch_split_var;
+		40.0f, // branch_length;
+		0.96f, // branch_length_ratio;
+		0.5f, // branch_split_proba;
+		0.0f, // double split
+		Vec2(0.0f, -0.5f), // Attraction
+		8
+	};
+
+	const float world_width = 1920.0f;
+	const float dt = 0.016f;
+	std::vector<Wind> wind{
+		Wind(100.0f, 3.f, 700.0f),
+		Wind(300.0f, 2.f, 1050.0f),
+		Wind(400.0f, 3.f, 1208.0f),
+		Wind(500.0f, 4.f, 1400.0f),
+	};
+
+	prof::Profiler& profiler = prof::Profiler::get();
+	const int64_t build_start = profiler.now();
+	v2::Tree tree = v2::TreeBuilder::build(Vec2(world_width * 0.5f, 1080.0f), tree_conf, seed);
+	// Background trees use a reduced level, taken before the leaves are compacted as the archetype reads regular leaves
+	// Its generation is left out of the build time
+	const int64_t archetype_start = profiler.now();
+	const v2::TreeArchetype::Ptr archetype = baked_instances ? v2::TreeArchetype::create(v2::LodBuilder::generate(tree, 3).levels.back().tree) : nullptr;
+	const int64_t archetype_time = profiler.now() - archetype_start;
+	if (((compact || kinematic) && !tree.compactLeaves()) || !tree.setKinematicLeaves(kinematic)) {
+		std::fprintf(stderr, "Tree too large for compact leaves\n");
+		return 1;
+	}
+	const double build_ms = (profiler.now() - build_start - archetype_time) * 0.000001;
+	const alloc::Counters builder_allocs = alloc::AllocTracker::getTotal(alloc::Builder);
+
+	std::vector<sf::VertexArray> branches_va;
+	LeafVertexGenerator leaves_generator;
+	std::unique_ptr<swrm::Swarm> swarm(threads ? new swrm::Swarm(threads) : nullptr);
+	batch = batch || swarm;
+	// The same tree built again on the swarm, only its time is kept
+	double parallel_build_ms = 0.0;
+	if (swarm) {
+		const int64_t parallel_start = profiler.now();
+		v2::ParallelTreeBuilder::build(Vec2(world_width * 0.5f, 1080.0f), tree_conf, seed, *swarm);
+		parallel_build_ms = (profiler.now() - parallel_start) * 0.000001;
+	}
+	ForestRenderer forest_renderer(swarm.get());
+	forest_renderer.addTree(tree);
+	uint32_t draw_calls = 0;
+	uint64_t vertices = 0;
+	rec::Recorder recorder;
+	if (!record_file.empty() && !recorder.open(record_file, {&tree}, dt)) {
+		std::fprintf(stderr, "Cannot record to %s\n", record_file.c_str());
+		return 1;
+	}
+	LeafCollider collider(collisions ? static_cast<uint32_t>(tree.getLeavesCount()) : 0);
+	RNGf::setSeed(seed);
+	uint32_t frames_with_allocations = 0;
+	uint64_t max_physics_allocs = 0;
+	uint64_t max_render_allocs = 0;
+	alloc::AllocTracker::nextFrame();
+	for (uint32_t frame(0); frame < warmup + frames; ++frame) {
+		{
+			ALLOC_SCOPE(alloc::Physics);
+			for (Wind& w : wind) {
+				w.update(dt, world_width);
+			}
+			tree.applyWind(wind);
+			tree.updateFused(dt);
+			if (collisions) {
+				collider.clear();
+				collider.addTree(tree);
+				collider.solve(swarm.get());
+			}
+		}
+		{
+			ALLOC_SCOPE(alloc::Render);
+			if (batch) {
+				forest_renderer.update(BoundingBox::infinite());
+			}
+			else {
+				TreeRenderer::generateRenderData(tree, branches_va, leaves_generator, BoundingBox::infinite());
+			}
+		}
+		if (frame >= warmup) {
+			recorder.recordFrame();
+		}
+		alloc::AllocTracker::nextFrame();
+		profiler.collect();
+
+		if (frame >= warmup) {
+			const uint64_t physics_allocs = alloc::AllocTracker::getLastFrame(alloc::Physics).count;
+			const uint64_t render_allocs = alloc::AllocTracker::getLastFrame(alloc::Render).count;
+			frames_with_allocations += (physics_allocs + render_allocs) ? 1 : 0;
+			max_physics_allocs = std::max(max_physics_allocs, physics_allocs);
+			max_render_allocs = std::max(max_render_allocs, render_allocs);
+		}
+	}
+
+	// Calls the last frame's data needs
+	if (batch) {
+		draw_calls = (forest_renderer.getBranchesVertexCount() ? 1 : 0) + (forest_renderer.getLeavesVertexCount() ? 1 : 0);
+		vertices = forest_renderer.getVertexCount();
+	}
+	else {
+		for (const sf::VertexArray& va : branches_va) {
+			draw_calls += va.getVertexCount() ? 1 : 0;
+			vertices += va.getVertexCount();
+		}
+		draw_calls += 1;
+		vertices += leaves_generator.getVertexCount();
+	}
+
+	// Read before the offline frames record their own render data update
+	const prof::ZoneStats update_stats = profiler.getStats("Tree::updateFused");
+	const prof::ZoneStats wind_stats = profiler.getStats("Tree::applyWind");
+	const prof::ZoneStats render_data_stats = profiler.getStats("TreeRenderer::generateRenderData");
+
+	// Decodes the whole recording once
+	recorder.close();
+	rec::Player player;
+	const bool replayed = recorder.getFramesCount() && player.open(record_file);
+	if (replayed) {
+		while (player.next()) {
+			profiler.collect();
+		}
+		profiler.collect();
+	}
+
+	// Baked loop replayed by instances with different phases, every instance is generated
+	v2::BakedWind::Ptr baked;
+	uint64_t baked_vertices = 0;
+	double bake_ms = 0.0;
+	if (baked_instances) {
+		const int64_t bake_start = profiler.now();
+		baked = v2::BakedWind::bake(archetype, v2::PeriodicWind());
+		bake_ms = (profiler.now() - bake_start) * 0.000001;
+		std::vector<v2::BakedInstance> instances;
+		for (uint32_t i(0); i < baked_instances; ++i) {
+			instances.emplace_back(Vec2(world_width * i, 1080.0f), 0.37f * i);
+		}
+		sf::VertexArray baked_branches;
+		sf::VertexArray baked_leaves;
+		for (uint32_t frame(0); frame < 60; ++frame) {
+			TreeRenderer::generateRenderData(*baked, instances, frame * dt, baked_branches, baked_leaves, BoundingBox::infinite());
+			profiler.collect();
+		}
+		baked_vertices = (baked_branches.getVertexCount() + baked_leaves.getVertexCount()) / baked_instances;
+	}
+
+	// Interaction queries over a forest of copies of the last simulated state, hierarchies are refit every 100 queries
+	std::vector<v2::Tree> picking_forest;
+	uint64_t picking_nodes = 0;
+	uint64_t picking_memory = 0;
+	if (picking_trees) {
+		picking_forest.assign(picking_trees, tree);
+		SpatialIndex index;
+		for (uint32_t i(0); i < picking_trees; ++i) {
+			v2::Tree& copy = picking_forest[i];
+			for (v2::Branch& b : copy.branches) {
+				b.translateTo(b.root.position + Vec2(world_width * i, 0.0f));
+			}
+			copy.translateLeaves();
+			copy.mergeBoundingBoxes();
+			picking_nodes += copy.getNodesCount();
+			index.addTree(copy);
+		}
+		std::vector<SpatialIndex::SegmentHit> segments;
+		std::vector<SpatialIndex::LeafHit> leaves;
+		SpatialIndex::SegmentHit hit;
+		for (uint32_t query(0); query < 10000; ++query) {
+			if (query % 100 == 0) {
+				index.invalidate();
+				index.refit();
+			}
+			const Vec2 point(RNGf::getUnder(world_width * picking_trees), RNGf::getUnder(1080.0f));
+			index.findNearestSegment(point, 50.0f, hit);
+			index.queryRadius(point, 20.0f, segments, leaves);
+			const float angle = RNGf::getUnder(2.0f * PI);
+			index.raycast(point, Vec2(std::cos(angle), std::sin(angle)), 500.0f, hit);
+			index.applyForce(point, 20.0f, Vec2(10.0f, 0.0f));
+			if (query % 100 == 99) {
+				profiler.collect();
+			}
+		}
+		picking_memory = index.getMemory();
+	}
+
+	// Same tree grown over frames and simulated meanwhile
+	uint32_t growth_frames = 0;
+	uint64_t grown_nodes = 0;
+	if (growth_budget > 0.0f) {
+		v2::TreeGrower grower;
+		v2::Tree grown = grower.start(Vec2(world_width * 0.5f, 1080.0f), tree_conf, seed);
+		while (!grower.advance(grown, growth_budget)) {
+			grown.updateFused(dt);
+			++growth_frames;
+			profiler.collect();
+		}
+		profiler.collect();
+		++growth_frames;
+		grown_nodes = grown.getNodesCount();
+	}
+
+	// Offline renderer throughput on the last simulated state, the swarm is used if there is one
+	SoftRasterizer rasterizer(1920, 1080);
+	LeafAtlas atlas;
+	const bool textured = atlas.addFromFile("res/leaf.png") && atlas.build(false);
+	if (textured) {
+		forest_renderer.setAtlas(&atlas);
+		rasterizer.setTexture(atlas.getImage());
+	}
+	if (offline_frames) {
+		forest_renderer.update(BoundingBox(Vec2(0.0f, 0.0f), Vec2(world_width, 1080.0f)));
+	}
+	for (uint32_t frame(0); frame < offline_frames; ++frame) {
+		rasterizer.render(forest_renderer.getData(), swarm.get());
+		profiler.collect();
+	}
+
+	std::FILE* out = out_file.empty() ? stdout : std::fopen(out_file.c_str(), "w");
+	if (!out) {
+		std::fprintf(stderr, "Cannot open %s\n", out_file.c_str());
+		return 1;
+	}
+	const auto print_stats = [out](const char* label, const prof::ZoneStats& stats, bool last) {
+		std::fprintf(out, "  \"%s\": {\"p50\": %.2f, \"p95\": %.2f, \"p99\": %.2f, \"max\": %.2f}%s\n", label, stats.p50, stats.p95, stats.p99, stats.max, last ? "" : ",");
+	};
+	const v2::MemoryFootprint footprint = tree.memoryFootprint();
+	std::fprintf(out, "{\n");
+	std::fprintf(out, "  \"seed\": %llu,\n", static_cast<unsigned long long>(seed));
+	std::fprintf(out, "  \"frames\": %u,\n", frames);
+	std::fprintf(out, "  \"simd\": \"%s\",\n", simd::getName(simd::getBackend()));
+	std::fprintf(out, "  \"render\": {\"batched\": %s, \"threads\": %u, \"draw_calls\": %u, \"vertices\": %llu},\n",
+		batch ? "true" : "false", threads, draw_calls, static_cast<unsigned long long>(vertices));
+	const uint64_t leaves_count = tree.getLeavesCount();
+	std::fprintf(out, "  \"tree\": {\"branches\": %u, \"nodes\": %u, \"leaves\": %u, \"compact_leaves\": %s, \"kinematic_leaves\": %s},\n",
+		static_cast<uint32_t>(tree.branches.size()), static_cast<uint32_t>(tree.getNodesCount()), static_cast<uint32_t>(leaves_count),
+		tree.compact ? "true" : "false", tree.hasKinematicLeaves() ? "true" : "false");
+	std::fprintf(out, "  \"build_ms\": %.3f,\n", build_ms);
+	if (swarm) {
+		std::fprintf(out, "  \"parallel_build_ms\": %.3f,\n", parallel_build_ms);
+	}
+	print_stats("update_us", update_stats, false);
+	print_stats("wind_us", wind_stats, false);
+	print_stats("render_data_us", render_data_stats, false);
+	if (offline_frames) {
+		const prof::ZoneStats offline_stats = profiler.getStats("SoftRasterizer::render");
+		std::fprintf(out, "  \"offline\": {\"width\": %u, \"height\": %u, \"frames\": %u, \"textured\": %s, \"frame_us\": {\"p50\": %.2f, \"p95\": %.2f, \"max\": %.2f}, \"fps\": %.2f},\n",
+			rasterizer.getWidth(), rasterizer.getHeight(), offline_frames, textured ? "true" : "false",
+			offline_stats.p50, offline_stats.p95, offline_stats.max, offline_stats.p50 > 0.0f ? 1000000.0 / offline_stats.p50 : 0.0);
+	}
+	if (recorder.getFramesCount()) {
+		const prof::ZoneStats encode_stats = profiler.getStats("Recorder::recordFrame");
+		const prof::ZoneStats decode_stats = profiler.getStats("Player::decodeChunk");
+		const prof::ZoneStats apply_stats = profiler.getStats("Player::apply");
+		std::fprintf(out, "  \"recording\": {\"frames\": %u, \"bytes\": %llu, \"bytes_per_frame\": %.1f, \"replayed\": %s, \"encode_us_p50\": %.2f, \"decode_us_p50\": %.2f, \"apply_us_p50\": %.2f},\n",
+			recorder.getFramesCount(), static_cast<unsigned long long>(recorder.getBytesWritten()),
+			double(recorder.getBytesWritten()) / double(recorder.getFramesCount()), replayed ? "true" : "false",
+			encode_stats.p50, decode_stats.p50, apply_stats.p50);
+	}
+	if (baked) {
+		const prof::ZoneStats baked_stats = profiler.getStats("TreeRenderer::generateBaked");
+		std::fprintf(out, "  \"baked\": {\"instances\": %u, \"loop_frames\": %u, \"vertices_per_instance\": %llu, \"memory\": %llu, \"bake_ms\": %.1f, \"frame_us\": {\"p50\": %.2f, \"max\": %.2f}, \"per_instance_us\": %.2f},\n",
+			baked_instances, baked->frames_count, static_cast<unsigned long long>(baked_vertices), static_cast<unsigned long long>(baked->getMemory()), bake_ms,
+			baked_stats.p50, baked_stats.max, baked_stats.p50 / baked_instances);
+	}
+	if (collisions) {
+		const prof::ZoneStats solve_stats = profiler.getStats("LeafCollider::solve");
+		std::fprintf(out, "  \"collisions\": {\"leaves\": %u, \"contacts\": %u, \"memory\": %llu, \"solve_us\": {\"p50\": %.2f, \"p99\": %.2f}},\n",
+			collider.getBodiesCount(), collider.getContactsCount(), static_cast<unsigned long long>(collider.getMemory()), solve_stats.p50, solve_stats.p99);
+	}
+	if (picking_trees) {
+		const prof::ZoneStats nearest_stats = profiler.getStats("SpatialIndex::findNearestSegment");
+		const prof::ZoneStats radius_stats = profiler.getStats("SpatialIndex::queryRadius");
+		const prof::ZoneStats ray_stats = profiler.getStats("SpatialIndex::raycast");
+		const prof::ZoneStats force_stats = profiler.getStats("SpatialIndex::applyForce");
+		const prof::ZoneStats refit_stats = profiler.getStats("SegmentBvh::refit");
+		std::fprintf(out, "  \"picking\": {\"trees\": %u, \"nodes\": %llu, \"memory\": %llu, \"nearest_us\": {\"p50\": %.2f, \"p99\": %.2f}, \"radius_us\": {\"p50\": %.2f, \"p99\": %.2f}, \"ray_us\": {\"p50\": %.2f, \"p99\": %.2f}, \"force_us\": {\"p50\": %.2f, \"p99\": %.2f}, \"refit_us\": {\"p50\": %.2f, \"p99\": %.2f}},\n",
+			picking_trees, static_cast<unsigned long long>(picking_nodes), static_cast<unsigned long long>(picking_memory),
+			nearest_stats.p50, nearest_stats.p99, radius_stats.p50, radius_stats.p99, ray_stats.p50, ray_stats.p99,
+			force_stats.p50, force_stats.p99, refit_stats.p50, refit_stats.p99);
+	}
+	if (growth_budget > 0.0f) {
+		const prof::ZoneStats advance_stats = profiler.getStats("TreeGrower::advance");
+		std::fprintf(out, "  \"growth\": {\"budget_us\": %.0f, \"frames\": %u, \"nodes\": %llu, \"advance_us\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}},\n",
+			growth_budget, growth_frames, static_cast<unsigned long long>(grown_nodes), advance_stats.p50, advance_stats.p99, advance_stats.max);
+	}
+	std::fprintf(out, "  \"allocations\": {\"tracked\": %s, \"steady_state_frames_with_allocations\": %u, \"max_physics_per_frame\": %llu, \"max_render_per_frame\": %llu, \"builder_count\": %llu, \"builder_bytes\": %llu},\n",
+		alloc::AllocTracker::isEnabled() ? "true" : "false", frames_with_allocations,
+		static_cast<unsigned long long>(max_physics_allocs), static_cast<unsigned long long>(max_render_allocs),
+		static_cast<unsigned long long>(builder_allocs.count), static_cast<unsigned long long>(builder_allocs.bytes));
+	std::fprintf(out, "  \"memory\": {\"branches\": %llu, \"nodes\": %llu, \"leaves\": %llu, \"bytes_per_leaf\": %.1f, \"scaffold\": %llu, \"total\": %llu}\n",
+		static_cast<unsigned long long>(footprint.branches), static_cast<unsigned long long>(footprint.nodes),
+		static_cast<unsigned long long>(footprint.leaves), leaves_count ? double(footprint.leaves) / double(leaves_count) : 0.0,
+		static_cast<unsigned long long>(footprint.scaffold), static_cast<unsigned long long>(footprint.getTotal()));
+	std::fprintf(out, "}\n");
+	if (out != stdout) {
+		std::fclose(out);
+	}
+
+	return (fail_on_alloc && frames_with_allocations) ? 2 : 0;
+}
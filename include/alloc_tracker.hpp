@@ -0,0 +1,237 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+// Global operator new/delete are only replaced when TREE2D_TRACK_ALLOCATIONS is defined,
+// this header must then be included in a single translation unit
+#ifdef TREE2D_TRACK_ALLOCATIONS
+	#define ALLOC_CONCAT_IMPL(a, b) a##b
+	#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_IMPL(a, b)
+	#define ALLOC_SCOPE(subsystem) alloc::SubsystemScope ALLOC_CONCAT(alloc_scope_, __LINE__)(subsystem)
+	// Inlined in the replaced operators, GCC sees the header's negative offset from the user pointer as out of bounds
+	#if defined(__GNUC__) || defined(__clang__)
+		#define ALLOC_NOINLINE __attribute__((noinline))
+	#elif defined(_MSC_VER)
+		#define ALLOC_NOINLINE __declspec(noinline)
+	#else
+		#define ALLOC_NOINLINE
+	#endif
+#else
+	#define ALLOC_SCOPE(subsystem)
+#endif
+
+
+namespace alloc
+{
+	enum Subsystem : uint32_t
+	{
+		Other,
+		Physics,
+		Render,
+		Builder,
+		Streaming,
+		Overlay,
+		SubsystemsCount
+	};
+
+	struct Counters
+	{
+		uint64_t count;
+		uint64_t bytes;
+	};
+
+	// Zero initialized before any dynamic initialization, so usable from operator new at any time
+	template<typename T = void>
+	struct TrackerData
+	{
+		static std::atomic<uint64_t> count[SubsystemsCount];
+		static std::atomic<uint64_t> bytes[SubsystemsCount];
+		static std::atomic<uint64_t> live_bytes;
+		static Counters frame_start[SubsystemsCount];
+		static Counters last_frame[SubsystemsCount];
+	};
+
+	template<typename T> std::atomic<uint64_t> TrackerData<T>::count[SubsystemsCount];
+	template<typename T> std::atomic<uint64_t> TrackerData<T>::bytes[SubsystemsCount];
+	template<typename T> std::atomic<uint64_t> TrackerData<T>::live_bytes;
+	template<typename T> Counters TrackerData<T>::frame_start[SubsystemsCount];
+	template<typename T> Counters TrackerData<T>::last_frame[SubsystemsCount];
+
+	struct AllocTracker
+	{
+		using Data = TrackerData<>;
+
+		static bool isEnabled()
+		{
+#ifdef TREE2D_TRACK_ALLOCATIONS
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		static Subsystem& current()
+		{
+			static thread_local Subsystem subsystem = Other;
+			return subsystem;
+		}
+
+		static const char* getName(Subsystem subsystem)
+		{
+			static const char* names[SubsystemsCount] = {"other", "physics", "render", "builder", "streaming", "overlay"};
+			return names[subsystem];
+		}
+
+		static void onAllocation(uint64_t size)
+		{
+			const Subsystem subsystem = current();
+			Data::count[subsystem].fetch_add(1, std::memory_order_relaxed);
+			Data::bytes[subsystem].fetch_add(size, std::memory_order_relaxed);
+			Data::live_bytes.fetch_add(size, std::memory_order_relaxed);
+		}
+
+		static void onDeallocation(uint64_t size)
+		{
+			Data::live_bytes.fetch_sub(size, std::memory_order_relaxed);
+		}
+
+		// Closes the current frame, its counters are then available through getLastFrame
+		static void nextFrame()
+		{
+			for (uint32_t i(0); i < SubsystemsCount; ++i) {
+				const Counters total = getTotal(static_cast<Subsystem>(i));
+				Data::last_frame[i].count = total.count - Data::frame_start[i].count;
+				Data::last_frame[i].bytes = total.bytes - Data::frame_start[i].bytes;
+				Data::frame_start[i] = total;
+			}
+		}
+
+		static Counters getLastFrame(Subsystem subsystem)
+		{
+			return Data::last_frame[subsystem];
+		}
+
+		static Counters getLastFrame()
+		{
+			Counters result = {0, 0};
+			for (uint32_t i(0); i < SubsystemsCount; ++i) {
+				result.count += Data::last_frame[i].count;
+				result.bytes += Data::last_frame[i].bytes;
+			}
+			return result;
+		}
+
+		static Counters getTotal(Subsystem subsystem)
+		{
+			return {Data::count[subsystem].load(std::memory_order_relaxed), Data::bytes[subsystem].load(std::memory_order_relaxed)};
+		}
+
+		static uint64_t getLiveBytes()
+		{
+			return Data::live_bytes.load(std::memory_order_relaxed);
+		}
+	};
+
+	struct SubsystemScope
+	{
+		const Subsystem previous;
+
+		SubsystemScope(Subsystem subsystem)
+			: previous(AllocTracker::current())
+		{
+			AllocTracker::current() = subsystem;
+		}
+
+		~SubsystemScope()
+		{
+			AllocTracker::current() = previous;
+		}
+	};
+}
+
+
+#ifdef TREE2D_TRACK_ALLOCATIONS
+namespace alloc
+{
+	// The size is stored in front of the block, the header keeps the default new alignment
+	constexpr std::size_t HeaderSize = 16;
+
+	ALLOC_NOINLINE void* allocate(std::size_t size)
+	{
+		char* block = static_cast<char*>(std::malloc(size + HeaderSize));
+		if (!block) {
+			return nullptr;
+		}
+		*reinterpret_cast<std::size_t*>(block) = size;
+		AllocTracker::onAllocation(size);
+		return block + HeaderSize;
+	}
+
+	ALLOC_NOINLINE void deallocate(void* ptr)
+	{
+		if (!ptr) {
+			return;
+		}
+		char* block = static_cast<char*>(ptr) - HeaderSize;
+		AllocTracker::onDeallocation(*reinterpret_cast<std::size_t*>(block));
+		std::free(block);
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	void* ptr = alloc::allocate(size);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return alloc::allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return alloc::allocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	alloc::deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	alloc::deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	alloc::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+	alloc::deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	alloc::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	alloc::deallocate(ptr);
+}
+#endif
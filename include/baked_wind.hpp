@@ -0,0 +1,225 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "tree_instance.hpp"
+#include "profiler.hpp"
+
+
+namespace v2
+{
+	// Horizontal force oscillating around a mean, the same on the whole tree
+	struct PeriodicWind
+	{
+		float strength;
+		float gust;
+		// In seconds, also the duration of the baked loop
+		float period;
+
+		PeriodicWind(float mean = 1.5f, float gust_strength = 1.5f, float loop_period = 2.0f)
+			: strength(mean)
+			, gust(gust_strength)
+			, period(loop_period)
+		{}
+
+		Vec2 getForce(float time) const
+		{
+			return Vec2(strength + gust * std::sin(2.0f * PI * time / period), 0.0f);
+		}
+	};
+
+	// One loop of an archetype's motion under a periodic wind, replayed by any number of instances
+	// Every frame stores each branch's rotation and origin and each leaf's direction
+	struct BakedWind
+	{
+		using Ptr = std::shared_ptr<const BakedWind>;
+
+		struct BranchFrame
+		{
+			// Relative to the tree's root
+			Vec2 origin;
+			// Rotation from the rest pose, scaled by 32767
+			int16_t cosa;
+			int16_t sina;
+		};
+
+		struct LeafFrame
+		{
+			// Unit direction scaled by 127
+			int8_t x;
+			int8_t y;
+		};
+
+		TreeArchetype::Ptr archetype;
+		float dt;
+		uint32_t frames_count;
+		// [frame * branches_count + branch_id]
+		std::vector<BranchFrame> branches;
+		// [frame * leaves_count + leaf_id]
+		std::vector<LeafFrame> leaves;
+		// Covers the branches over the whole loop, relative to the root
+		BoundingBox bounds;
+		float max_leaf_size;
+
+		uint32_t getFrame(float time) const
+		{
+			const int64_t frame = static_cast<int64_t>(std::floor(time / dt)) % frames_count;
+			return static_cast<uint32_t>(frame < 0 ? frame + frames_count : frame);
+		}
+
+		const BranchFrame* getBranches(uint32_t frame) const
+		{
+			return &branches[uint64_t(frame) * archetype->branches.size()];
+		}
+
+		const LeafFrame* getLeaves(uint32_t frame) const
+		{
+			return &leaves[uint64_t(frame) * archetype->leaves.size()];
+		}
+
+		uint64_t getMemory() const
+		{
+			return sizeof(BakedWind) + branches.capacity() * sizeof(BranchFrame) + leaves.capacity() * sizeof(LeafFrame);
+		}
+
+		// Simulates an instance until its motion settles then records one period
+		// What remains of the drift between the loop's end and start is spread over the loop so that it wraps seamlessly
+		static Ptr bake(TreeArchetype::Ptr archetype, const PeriodicWind& wind, float dt = 0.016f, uint32_t settle_loops = 4)
+		{
+			PROFILE_SCOPE("BakedWind::bake");
+			std::shared_ptr<BakedWind> baked = std::make_shared<BakedWind>();
+			baked->archetype = archetype;
+			baked->frames_count = std::max(1U, static_cast<uint32_t>(std::round(wind.period / dt)));
+			// The loop is made of a whole number of steps
+			baked->dt = wind.period / baked->frames_count;
+			const float step_dt = baked->dt;
+			const uint32_t frames_count = baked->frames_count;
+			const uint64_t branches_count = archetype->branches.size();
+			const uint64_t leaves_count = archetype->leaves.size();
+
+			TreeInstance instance(archetype, Vec2());
+			uint64_t step(0);
+			const auto simulate = [&]() {
+				const Vec2 force = wind.getForce(step * step_dt);
+				for (BranchState& b : instance.branches) {
+					b.moving_point.applyForce(force);
+				}
+				for (Particule& p : instance.leaves) {
+					p.applyForce(force);
+				}
+				instance.update(step_dt);
+				++step;
+			};
+			for (uint64_t i(0); i < uint64_t(settle_loops) * frames_count; ++i) {
+				simulate();
+			}
+
+			// One extra frame, the first of the next loop, measures the drift
+			const uint64_t values_count = 3 * branches_count + leaves_count;
+			std::vector<float> values((frames_count + 1) * values_count);
+			for (uint32_t frame(0); frame <= frames_count; ++frame) {
+				float* out = &values[frame * values_count];
+				for (uint64_t i(0); i < branches_count; ++i) {
+					const BranchState& state = instance.branches[i];
+					*out++ = state.attach_point.x;
+					*out++ = state.attach_point.y;
+					*out++ = state.last_angle - archetype->branches[i].rest_angle;
+				}
+				for (uint64_t i(0); i < branches_count; ++i) {
+					const RotMat2 mat = instance.getRotation(static_cast<uint32_t>(i));
+					const uint32_t leaves_end = archetype->leaves_offsets[i + 1];
+					for (uint32_t k(archetype->leaves_offsets[i]); k < leaves_end; ++k) {
+						const Vec2 attach = instance.getNodePosition(static_cast<uint32_t>(i), archetype->leaves[k].node_id, mat);
+						*out++ = (instance.leaves[k].position - attach).getAngle();
+					}
+				}
+				simulate();
+			}
+
+			// Angles are unwrapped from one frame to the next before measuring the drift
+			for (uint64_t v(0); v < values_count; ++v) {
+				const bool is_angle = v >= 3 * branches_count || v % 3 == 2;
+				float previous = values[v];
+				float drift = 0.0f;
+				for (uint32_t frame(1); frame <= frames_count; ++frame) {
+					const float value = values[frame * values_count + v];
+					drift += is_angle ? wrapAngle(value - previous) : value - previous;
+					previous = value;
+				}
+				for (uint32_t frame(1); frame < frames_count; ++frame) {
+					values[frame * values_count + v] -= drift * frame / frames_count;
+				}
+			}
+
+			baked->branches.resize(uint64_t(frames_count) * branches_count);
+			baked->leaves.resize(uint64_t(frames_count) * leaves_count);
+			baked->max_leaf_size = 0.0f;
+			for (const TreeArchetype::LeafInfo& info : archetype->leaves) {
+				baked->max_leaf_size = std::max(baked->max_leaf_size, info.size);
+			}
+			for (uint32_t frame(0); frame < frames_count; ++frame) {
+				const float* in = &values[frame * values_count];
+				BranchFrame* branches_out = &baked->branches[uint64_t(frame) * branches_count];
+				for (uint64_t i(0); i < branches_count; ++i) {
+					BranchFrame& out = branches_out[i];
+					out.origin = Vec2(in[0], in[1]);
+					out.cosa = static_cast<int16_t>(std::round(std::cos(in[2]) * 32767.0f));
+					out.sina = static_cast<int16_t>(std::round(std::sin(in[2]) * 32767.0f));
+					in += 3;
+					const TreeArchetype::BranchInfo& info = archetype->branches[i];
+					const RotMat2 mat = getRotation(out);
+					for (uint32_t k(0); k < info.nodes_count; ++k) {
+						Vec2 position = archetype->getNode(static_cast<uint32_t>(i), k);
+						position.rotate(mat);
+						baked->bounds.add(out.origin + position);
+					}
+				}
+				LeafFrame* leaves_out = &baked->leaves[uint64_t(frame) * leaves_count];
+				for (uint64_t k(0); k < leaves_count; ++k) {
+					leaves_out[k].x = static_cast<int8_t>(std::round(std::cos(in[k]) * 127.0f));
+					leaves_out[k].y = static_cast<int8_t>(std::round(std::sin(in[k]) * 127.0f));
+				}
+			}
+			return baked;
+		}
+
+		static RotMat2 getRotation(const BranchFrame& frame)
+		{
+			RotMat2 mat(0.0f);
+			mat.cosa = frame.cosa * (1.0f / 32767.0f);
+			mat.sina = frame.sina * (1.0f / 32767.0f);
+			return mat;
+		}
+
+		static Vec2 getDirection(const LeafFrame& frame)
+		{
+			return Vec2(frame.x * (1.0f / 127.0f), frame.y * (1.0f / 127.0f));
+		}
+
+	private:
+		static float wrapAngle(float angle)
+		{
+			while (angle > PI) {
+				angle -= 2.0f * PI;
+			}
+			while (angle < -PI) {
+				angle += 2.0f * PI;
+			}
+			return angle;
+		}
+	};
+
+	// A tree that only replays a baked loop, it has no simulation state
+	struct BakedInstance
+	{
+		Vec2 position;
+		// In seconds, desynchronizes instances sharing a loop
+		float phase;
+
+		BakedInstance(Vec2 pos, float time_offset = 0.0f)
+			: position(pos)
+			, phase(time_offset)
+		{}
+	};
+}
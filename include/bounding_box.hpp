@@ -0,0 +1,67 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include "vec2.hpp"
+
+
+struct BoundingBox
+{
+	Vec2 min;
+	Vec2 max;
+
+	BoundingBox()
+		: min(FLT_MAX, FLT_MAX)
+		, max(-FLT_MAX, -FLT_MAX)
+	{}
+
+	BoundingBox(Vec2 min_, Vec2 max_)
+		: min(min_)
+		, max(max_)
+	{}
+
+	void reset()
+	{
+		min = Vec2(FLT_MAX, FLT_MAX);
+		max = Vec2(-FLT_MAX, -FLT_MAX);
+	}
+
+	void add(const Vec2& p)
+	{
+		min.x = std::min(min.x, p.x);
+		min.y = std::min(min.y, p.y);
+		max.x = std::max(max.x, p.x);
+		max.y = std::max(max.y, p.y);
+	}
+
+	void merge(const BoundingBox& bbox)
+	{
+		add(bbox.min);
+		add(bbox.max);
+	}
+
+	void translate(const Vec2& v)
+	{
+		min += v;
+		max += v;
+	}
+
+	BoundingBox getInflated(float margin) const
+	{
+		return BoundingBox(Vec2(min.x - margin, min.y - margin), Vec2(max.x + margin, max.y + margin));
+	}
+
+	bool intersects(const BoundingBox& bbox) const
+	{
+		return min.x <= bbox.max.x && max.x >= bbox.min.x && min.y <= bbox.max.y && max.y >= bbox.min.y;
+	}
+
+	bool contains(const Vec2& p) const
+	{
+		return p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y;
+	}
+
+	static BoundingBox infinite()
+	{
+		return BoundingBox(Vec2(-FLT_MAX, -FLT_MAX), Vec2(FLT_MAX, FLT_MAX));
+	}
+};
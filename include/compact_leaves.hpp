@@ -0,0 +1,379 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "vec2.hpp"
+#include "vec2xn.hpp"
+#include "wind.hpp"
+
+
+namespace v2
+{
+	// Structure of arrays leaf storage, 24 bytes of state per leaf
+	// Positions are relative to the attach node so leaves follow their branch without being moved
+	struct CompactLeaves
+	{
+		static constexpr uint32_t NodeBits = 12;
+		static constexpr uint32_t NodeMask = (1 << NodeBits) - 1;
+		static constexpr uint32_t MaxBranches = 1 << (32 - NodeBits);
+		// Target directions are at most 4 units long
+		static constexpr float TargetScale = 4.0f / 127.0f;
+		static constexpr float SizeScale = 1.0f / 32.0f;
+		// Kinematic mode, the flutter's phase and frequency are hashed among FlutterVariants
+		static constexpr uint32_t FlutterVariants = 32;
+		static constexpr float FlutterAmplitude = 0.03f;
+		static constexpr float FlutterFrequency = 7.0f;
+		// Seconds of the branch's angular velocity the leaves trail by
+		static constexpr float LagGain = 0.3f;
+		static constexpr float Damping = 3.0f;
+		static constexpr float MaxAngle = 1.5f;
+
+		std::vector<float> x;
+		std::vector<float> y;
+		std::vector<float> old_x;
+		std::vector<float> old_y;
+		// Branch id in the high bits, node id in the low NodeBits
+		std::vector<uint32_t> attach;
+		std::vector<int8_t> target_x;
+		std::vector<int8_t> target_y;
+		// Green channel, leaves are colored (255, hue, 0)
+		std::vector<uint8_t> hue;
+		std::vector<uint8_t> size;
+		// Wind is applied as a velocity change, using the step of the last update
+		float last_dt;
+		// Kinematic leaves aren't integrated, each one swings around its target direction with a damped spring
+		// driven by its branch's angular velocity, plus a flutter. old_x and old_y are released
+		bool kinematic;
+		// Offset to the target direction and its derivative, kinematic mode only
+		std::vector<float> angle;
+		std::vector<float> angular_velocity;
+		// Written by the tree before each update of kinematic leaves, indexed by branch id, in radians per second
+		std::vector<float> branch_angular_velocity;
+		float flutter_time;
+		// Flutter angle of the current step, leaf i uses variant i % FlutterVariants
+		float flutter[2 * FlutterVariants];
+
+		CompactLeaves()
+			: last_dt(0.016f)
+			, kinematic(false)
+			, flutter_time(0.0f)
+			, flutter{}
+		{}
+
+		static bool canPack(uint64_t branch_id, uint64_t node_id)
+		{
+			return branch_id < MaxBranches && node_id <= NodeMask;
+		}
+
+		void add(Vec2 position, Vec2 old_position, uint32_t branch_id, uint32_t node_id, Vec2 target, uint8_t leaf_hue, float leaf_size)
+		{
+			x.push_back(position.x);
+			y.push_back(position.y);
+			if (kinematic) {
+				angle.push_back(0.0f);
+				angular_velocity.push_back(0.0f);
+			}
+			else {
+				old_x.push_back(old_position.x);
+				old_y.push_back(old_position.y);
+			}
+			attach.push_back((branch_id << NodeBits) | node_id);
+			target_x.push_back(quantize(target.x / TargetScale, -127.0f, 127.0f));
+			target_y.push_back(quantize(target.y / TargetScale, -127.0f, 127.0f));
+			hue.push_back(leaf_hue);
+			size.push_back(static_cast<uint8_t>(quantize(leaf_size / SizeScale, 1.0f, 255.0f)));
+		}
+
+		void clear()
+		{
+			x.clear();
+			y.clear();
+			old_x.clear();
+			old_y.clear();
+			angle.clear();
+			angular_velocity.clear();
+			branch_angular_velocity.clear();
+			attach.clear();
+			target_x.clear();
+			target_y.clear();
+			hue.clear();
+			size.clear();
+		}
+
+		void shrinkToFit()
+		{
+			x.shrink_to_fit();
+			y.shrink_to_fit();
+			old_x.shrink_to_fit();
+			old_y.shrink_to_fit();
+			angle.shrink_to_fit();
+			angular_velocity.shrink_to_fit();
+			attach.shrink_to_fit();
+			target_x.shrink_to_fit();
+			target_y.shrink_to_fit();
+			hue.shrink_to_fit();
+			size.shrink_to_fit();
+		}
+
+		uint64_t getCount() const
+		{
+			return x.size();
+		}
+
+		bool empty() const
+		{
+			return x.empty();
+		}
+
+		uint32_t getBranchId(uint64_t i) const
+		{
+			return attach[i] >> NodeBits;
+		}
+
+		uint32_t getNodeId(uint64_t i) const
+		{
+			return attach[i] & NodeMask;
+		}
+
+		Vec2 getDir(uint64_t i) const
+		{
+			return Vec2(x[i], y[i]);
+		}
+
+		float getSize(uint64_t i) const
+		{
+			return size[i] * SizeScale;
+		}
+
+		uint64_t getMemory() const
+		{
+			return (x.capacity() + y.capacity() + old_x.capacity() + old_y.capacity() + angle.capacity() + angular_velocity.capacity() + branch_angular_velocity.capacity()) * sizeof(float)
+				+ attach.capacity() * sizeof(uint32_t)
+				+ target_x.capacity() + target_y.capacity() + hue.capacity() + size.capacity();
+		}
+
+		// Leaves are independent from each other, the widest backend available is used
+		// Kinematic leaves need branch_angular_velocity to be filled beforehand
+		void update(uint64_t first, uint64_t last, float dt)
+		{
+			if (kinematic) {
+				updateKinematic(first, last, dt);
+				return;
+			}
+			uint64_t i(first);
+			switch (simd::getBackend()) {
+#ifdef TREE2D_SIMD_X86
+			case simd::AVX2:
+				i = updateAvx2(first, last, dt);
+				break;
+			case simd::SSE2:
+				i = updatePacked<simd::Sse2Backend>(first, last, dt);
+				break;
+#endif
+#ifdef TREE2D_SIMD_NEON
+			case simd::NEON:
+				i = updatePacked<simd::NeonBackend>(first, last, dt);
+				break;
+#endif
+			default:
+				break;
+			}
+			// Remaining leaves
+			updatePacked<simd::ScalarBackend>(i, last, dt);
+			last_dt = dt;
+		}
+
+		// Same integration as Leaf::update, in the attach node's frame, returns the first leaf not updated
+		template<typename B>
+		uint64_t updatePacked(uint64_t first, uint64_t last, float dt)
+		{
+			using Float = typename B::Float;
+			using Vec = simd::Vec2xN<B>;
+			const Float one = B::set1(1.0f);
+			const Float air_friction = B::set1(0.5f);
+			const Float target_scale = B::set1(TargetScale);
+			const Float step = B::set1(dt);
+			uint64_t i(first);
+			for (; i + B::Width <= last; i += B::Width) {
+				Vec position = Vec::load(&x[i], &y[i]);
+				// Attach constraint, the target length is 1
+				const Float length = position.getLength();
+				position = position + position * B::div(B::sub(one, length), length);
+
+				const Vec velocity = position - Vec::load(&old_x[i], &old_y[i]);
+				const Vec target(B::loadInt8(&target_x[i]), B::loadInt8(&target_y[i]));
+				const Vec acceleration = target * target_scale - velocity * air_friction;
+				position.store(&old_x[i], &old_y[i]);
+				(position + (velocity + acceleration * step)).store(&x[i], &y[i]);
+			}
+			return i;
+		}
+
+		// Each leaf is a damped spring around its target direction, pulled as hard as Leaf::update's integration does
+		// Its rest angle trails its branch's rotation and flutters
+		template<typename B>
+		uint64_t updateKinematicPacked(uint64_t first, uint64_t last, float dt)
+		{
+			using Float = typename B::Float;
+			using Vec = simd::Vec2xN<B>;
+			const Float target_scale = B::set1(TargetScale);
+			const Float epsilon = B::set1(0.0001f);
+			const Float step = B::set1(dt);
+			const Float inv_dt = B::set1(1.0f / dt);
+			const Float damping = B::set1(Damping);
+			const Float min_angle = B::set1(-MaxAngle);
+			const Float max_angle = B::set1(MaxAngle);
+			const Float one = B::set1(1.0f);
+			const Float sin_3 = B::set1(1.0f / 6.0f);
+			const Float sin_5 = B::set1(1.0f / 120.0f);
+			const Float cos_2 = B::set1(0.5f);
+			const Float cos_4 = B::set1(1.0f / 24.0f);
+			const Float cos_6 = B::set1(1.0f / 720.0f);
+			float rest_angle[B::Width];
+			uint64_t i(first);
+			for (; i + B::Width <= last; i += B::Width) {
+				for (uint32_t k(0); k < B::Width; ++k) {
+					rest_angle[k] = -LagGain * branch_angular_velocity[getBranchId(i + k)];
+				}
+				// The flutter drives the spring, which also keeps it from decaying to denormals when the branch is still
+				const Float rest = B::add(B::min(max_angle, B::max(min_angle, B::load(rest_angle))), B::load(&flutter[i % FlutterVariants]));
+				const Vec target = Vec(B::loadInt8(&target_x[i]), B::loadInt8(&target_y[i])) * target_scale;
+				// Divided by the square root rather than rsqrt's estimate, every backend then gives the same directions
+				const Float length2 = target.getLength2();
+				const Float inv_length = B::div(one, B::sqrt(B::add(length2, epsilon)));
+				const Float stiffness = B::mul(B::mul(length2, inv_length), inv_dt);
+				// Semi-implicit Euler
+				Float a = B::load(&angle[i]);
+				Float w = B::load(&angular_velocity[i]);
+				w = B::add(w, B::mul(B::sub(B::mul(stiffness, B::sub(rest, a)), B::mul(damping, w)), step));
+				a = B::min(max_angle, B::max(min_angle, B::add(a, B::mul(w, step))));
+				B::store(&angle[i], a);
+				B::store(&angular_velocity[i], w);
+				// Angles are small, series are enough
+				const Float phi2 = B::mul(a, a);
+				const Float sina = B::mul(a, B::sub(one, B::mul(phi2, B::sub(sin_3, B::mul(phi2, sin_5)))));
+				const Float cosa = B::sub(one, B::mul(phi2, B::sub(cos_2, B::mul(phi2, B::sub(cos_4, B::mul(phi2, cos_6))))));
+				const Vec dir = target * inv_length;
+				B::store(&x[i], B::sub(B::mul(dir.x, cosa), B::mul(dir.y, sina)));
+				B::store(&y[i], B::add(B::mul(dir.x, sina), B::mul(dir.y, cosa)));
+			}
+			return i;
+		}
+
+		// attach_x is the world x coordinate of leaf i's attach node
+		void applyWind(uint64_t i, float attach_x, const Wind& wind)
+		{
+			if (!wind.isOver(Vec2(attach_x + x[i], 0.0f))) {
+				return;
+			}
+			applyForce(i, Vec2(wind.strength, RNGf::getRange(1.0f) * wind.strength));
+		}
+
+		// Same velocity change as a force on a regular leaf's free particle
+		void applyForce(uint64_t i, Vec2 force)
+		{
+			if (kinematic) {
+				// Seen as a rotation around the attach node
+				angular_velocity[i] += x[i] * force.y - y[i] * force.x;
+				return;
+			}
+			old_x[i] -= force.x * last_dt;
+			old_y[i] -= force.y * last_dt;
+		}
+
+		// Switching keeps the leaves' directions, velocities are lost
+		void setKinematic(bool enabled)
+		{
+			if (enabled == kinematic) {
+				return;
+			}
+			const uint64_t count = getCount();
+			if (enabled) {
+				angle.resize(count);
+				angular_velocity.assign(count, 0.0f);
+				for (uint64_t i(0); i < count; ++i) {
+					const Vec2 rest = getRestDir(i);
+					const float offset = std::atan2(rest.x * y[i] - rest.y * x[i], rest.x * x[i] + rest.y * y[i]);
+					angle[i] = std::min(MaxAngle, std::max(-MaxAngle, offset));
+				}
+				old_x = std::vector<float>();
+				old_y = std::vector<float>();
+			}
+			else {
+				old_x = x;
+				old_y = y;
+				angle = std::vector<float>();
+				angular_velocity = std::vector<float>();
+				branch_angular_velocity = std::vector<float>();
+			}
+			kinematic = enabled;
+		}
+
+	private:
+#ifdef TREE2D_SIMD_X86
+		SIMD_TARGET_AVX2 SIMD_FLATTEN uint64_t updateAvx2(uint64_t first, uint64_t last, float dt)
+		{
+			return updatePacked<simd::Avx2Backend>(first, last, dt);
+		}
+
+		SIMD_TARGET_AVX2 SIMD_FLATTEN uint64_t updateKinematicAvx2(uint64_t first, uint64_t last, float dt)
+		{
+			return updateKinematicPacked<simd::Avx2Backend>(first, last, dt);
+		}
+#endif
+
+		void updateKinematic(uint64_t first, uint64_t last, float dt)
+		{
+			// Every variant's frequency is a multiple of a quarter of FlutterFrequency, time wraps on their common period
+			const float period = 8.0f * PI / FlutterFrequency;
+			flutter_time = std::fmod(flutter_time + dt, period);
+			for (uint32_t v(0); v < FlutterVariants; ++v) {
+				const uint32_t hash = hashIndex(v);
+				const float phase = 2.0f * PI * (hash & 7) / 8.0f;
+				const float frequency = FlutterFrequency * (4 + (hash >> 3)) * 0.25f;
+				flutter[v] = FlutterAmplitude * std::sin(phase + frequency * flutter_time);
+				// Repeated so that any FlutterVariants consecutive leaves read them contiguously
+				flutter[v + FlutterVariants] = flutter[v];
+			}
+
+			uint64_t i(first);
+			switch (simd::getBackend()) {
+#ifdef TREE2D_SIMD_X86
+			case simd::AVX2:
+				i = updateKinematicAvx2(first, last, dt);
+				break;
+			case simd::SSE2:
+				i = updateKinematicPacked<simd::Sse2Backend>(first, last, dt);
+				break;
+#endif
+#ifdef TREE2D_SIMD_NEON
+			case simd::NEON:
+				i = updateKinematicPacked<simd::NeonBackend>(first, last, dt);
+				break;
+#endif
+			default:
+				break;
+			}
+			updateKinematicPacked<simd::ScalarBackend>(i, last, dt);
+			last_dt = dt;
+		}
+
+		Vec2 getRestDir(uint64_t i) const
+		{
+			const Vec2 target(target_x[i], target_y[i]);
+			return target.x || target.y ? target.getNormalized() : Vec2(0.0f, 1.0f);
+		}
+
+		// Mixes the variants' index bits, 5 bits for FlutterVariants
+		static uint32_t hashIndex(uint32_t i)
+		{
+			return (i * 2654435761U) >> (32 - 5);
+		}
+
+		static int32_t quantize(float value, float min_value, float max_value)
+		{
+			return static_cast<int32_t>(std::round(std::min(max_value, std::max(min_value, value))));
+		}
+	};
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include "tree_builder.hpp"
+
+
+// Reads the tree configuration from a text file each time it is saved, for live tuning
+// One parameter per line, "name value" with the names of TreeConf's fields, attraction takes two values
+// Lines starting with # are comments, missing parameters keep their current value
+class TreeConfWatcher
+{
+public:
+	// Reloads are also reported there if not null
+	std::FILE* log;
+
+	TreeConfWatcher(const std::string& filename, float period = 0.5f)
+		: log(nullptr)
+		, m_filename(filename)
+		, m_period(period)
+		, m_time(period)
+		, m_modified(0)
+		, m_size(0)
+	{}
+
+	// Checks the file every period seconds, returns true if it changed and conf has been updated
+	bool poll(v2::TreeConf& conf, float dt = 0.0f)
+	{
+		m_time += dt;
+		if (m_time < m_period) {
+			return false;
+		}
+		m_time = 0.0f;
+
+		struct stat info;
+		if (stat(m_filename.c_str(), &info)) {
+			return false;
+		}
+		const int64_t modified = static_cast<int64_t>(info.st_mtime);
+		const int64_t size = static_cast<int64_t>(info.st_size);
+		if (modified == m_modified && size == m_size) {
+			return false;
+		}
+		m_modified = modified;
+		m_size = size;
+		// A file that is half written is read again once its size or date changes
+		v2::TreeConf new_conf = conf;
+		if (!read(new_conf)) {
+			return false;
+		}
+		if (!std::memcmp(&new_conf, &conf, sizeof(v2::TreeConf))) {
+			return false;
+		}
+		conf = new_conf;
+		if (log) {
+			std::fprintf(log, "[TreeConfWatcher] %s reloaded\n", m_filename.c_str());
+			std::fflush(log);
+		}
+		return true;
+	}
+
+	const std::string& getFilename() const
+	{
+		return m_filename;
+	}
+
+	// Reads the file once, returns false if it can't be opened or has invalid lines, the valid ones are applied either way
+	bool read(v2::TreeConf& conf) const
+	{
+		std::FILE* file = std::fopen(m_filename.c_str(), "r");
+		if (!file) {
+			return false;
+		}
+		bool valid = true;
+		char line[256];
+		while (std::fgets(line, sizeof(line), file)) {
+			char name[64];
+			float values[2];
+			const int32_t count = std::sscanf(line, "%63s %f %f", name, &values[0], &values[1]);
+			if (count < 1 || name[0] == '#') {
+				continue;
+			}
+			if (count < 2 || !set(conf, name, values, count - 1)) {
+				valid = false;
+				if (log) {
+					std::fprintf(log, "[TreeConfWatcher] %s: invalid line \"%s\"\n", m_filename.c_str(), name);
+				}
+			}
+		}
+		std::fclose(file);
+		return valid;
+	}
+
+	// Returns false if no parameter has this name or takes this many values
+	static bool set(v2::TreeConf& conf, const char* name, const float* values, int32_t count)
+	{
+		struct Field
+		{
+			const char* name;
+			float* value;
+		};
+		const Field fields[] = {
+			{"branch_width", &conf.branch_width},
+			{"branch_width_ratio", &conf.branch_width_ratio},
+			{"split_width_ratio", &conf.split_width_ratio},
+			{"branch_deviation", &conf.branch_deviation},
+			{"branch_split_angle", &conf.branch_split_angle},
+			{"branch_split_var", &conf.branch_split_var},
+			{"branch_length", &conf.branch_length},
+			{"branch_length_ratio", &conf.branch_length_ratio},
+			{"branch_split_proba", &conf.branch_split_proba},
+			{"double_split_proba", &conf.double_split_proba},
+		};
+		for (const Field& field : fields) {
+			if (!std::strcmp(name, field.name)) {
+				*field.value = values[0];
+				return true;
+			}
+		}
+		if (!std::strcmp(name, "attraction") && count == 2) {
+			conf.attraction = Vec2(values[0], values[1]);
+			return true;
+		}
+		if (!std::strcmp(name, "max_level") && values[0] >= 0.0f) {
+			conf.max_level = static_cast<uint32_t>(values[0]);
+			return true;
+		}
+		return false;
+	}
+
+private:
+	const std::string m_filename;
+	const float m_period;
+	float m_time;
+	int64_t m_modified;
+	int64_t m_size;
+};
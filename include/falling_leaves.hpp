@@ -0,0 +1,233 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <cmath>
+#include <vector>
+#include "tree.hpp"
+#include "leaf_atlas.hpp"
+#include "leaf_vertex_generator.hpp"
+#include "profiler.hpp"
+
+
+// Leaves torn off the trees, falling and tumbling until they have rested on the ground for a while
+// The pool has a fixed capacity, a leaf that doesn't fit stays on its tree, and recycled slots are filled by the last leaf
+class FallingLeaves
+{
+public:
+	// In pixels and seconds
+	static constexpr float Gravity = 400.0f;
+	// Air drag across and along the leaf, the difference makes it glide and tumble
+	static constexpr float NormalDrag = 5.0f;
+	static constexpr float TangentDrag = 0.4f;
+	// Torque turning the leaf's broad side against its motion, and its damping
+	static constexpr float Torque = 0.004f;
+	static constexpr float AngularDamping = 4.0f;
+	// Wind strengths are velocity changes per frame, at 60 frames per second
+	static constexpr float WindScale = 60.0f;
+	// Time spent on the ground, fading out during the last second, and in the air before a leaf is recycled
+	static constexpr float RestDuration = 4.0f;
+	static constexpr float MaxAirTime = 30.0f;
+
+	struct Leaf
+	{
+		Vec2 position;
+		Vec2 velocity;
+		Vec2 acceleration;
+		float angle;
+		float angular_velocity;
+		float size;
+		// Negative while falling
+		float rest_time;
+		float air_time;
+		sf::Color color;
+		// Index of the leaf in its tree, gives its atlas variant
+		uint32_t variant;
+	};
+
+	FallingLeaves(uint32_t capacity, float ground_y)
+		: m_leaves(capacity)
+		, m_vertices(4 * static_cast<uint64_t>(capacity))
+		, m_count(0)
+		, m_vertices_count(0)
+		, m_ground_y(ground_y)
+		, m_atlas(nullptr)
+		, m_recycled(0)
+	{}
+
+	// Leaves are textured with the atlas' variants, it has to outlive the pool
+	void setAtlas(const LeafAtlas* atlas)
+	{
+		m_atlas = atlas && atlas->getVariantsCount() ? atlas : nullptr;
+	}
+
+	// Moves the leaves torn off the tree since last call in the pool, those that don't fit are put back on their node
+	void collect(v2::Tree& tree, float dt)
+	{
+		for (uint32_t k : tree.torn_leaves) {
+			v2::Leaf& l = tree.leaves[k];
+			if (m_count == m_leaves.size()) {
+				l.reattach();
+				continue;
+			}
+			const Particule& p = l.free_particule;
+			const Vec2 dir = l.getDir().getNormalized();
+			Leaf& leaf = m_leaves[m_count++];
+			// Centered on the quad it had on the tree
+			leaf.position = l.getPosition() + dir * (0.5f * LeafVertexGenerator::LeafLength * l.size);
+			leaf.velocity = (p.position - p.old_position) / dt;
+			leaf.acceleration = Vec2();
+			leaf.angle = dir.getAngle();
+			leaf.angular_velocity = RNGf::getRange(4.0f);
+			leaf.size = l.size;
+			leaf.rest_time = -1.0f;
+			leaf.air_time = 0.0f;
+			leaf.color = l.color;
+			leaf.variant = k;
+		}
+		tree.torn_leaves.clear();
+	}
+
+	void applyWind(const std::vector<Wind>& wind)
+	{
+		for (const Wind& w : wind) {
+			for (uint32_t i(0); i < m_count; ++i) {
+				Leaf& leaf = m_leaves[i];
+				if (leaf.rest_time < 0.0f && w.isOver(leaf.position)) {
+					leaf.acceleration += Vec2(1.0f, RNGf::getRange(1.0f)) * (w.strength * WindScale);
+				}
+			}
+		}
+	}
+
+	void update(float dt)
+	{
+		PROFILE_SCOPE("FallingLeaves::update");
+		uint32_t i(0);
+		while (i < m_count) {
+			Leaf& leaf = m_leaves[i];
+			if (leaf.rest_time >= RestDuration || leaf.air_time >= MaxAirTime) {
+				// Swap remove, the order of the leaves doesn't matter
+				leaf = m_leaves[--m_count];
+				++m_recycled;
+				continue;
+			}
+			if (leaf.rest_time >= 0.0f) {
+				leaf.rest_time += dt;
+				++i;
+				continue;
+			}
+
+			const Vec2 tangent(std::cos(leaf.angle), std::sin(leaf.angle));
+			const Vec2 normal = tangent.getNormal();
+			const float v_n = leaf.velocity.dot(normal);
+			const float v_t = leaf.velocity.dot(tangent);
+			const Vec2 drag = normal * (-NormalDrag * v_n) - tangent * (TangentDrag * v_t);
+			leaf.velocity += (leaf.acceleration + drag + Vec2(0.0f, Gravity)) * dt;
+			leaf.acceleration = Vec2();
+			leaf.angular_velocity += (-Torque * v_n * v_t - AngularDamping * leaf.angular_velocity) * dt;
+			leaf.angle += leaf.angular_velocity * dt;
+			leaf.position += leaf.velocity * dt;
+			leaf.air_time += dt;
+
+			if (leaf.position.y >= m_ground_y) {
+				// Lies flat where it lands
+				leaf.position.y = m_ground_y;
+				leaf.velocity = Vec2();
+				leaf.angular_velocity = 0.0f;
+				leaf.angle = std::cos(leaf.angle) < 0.0f ? PI : 0.0f;
+				leaf.rest_time = 0.0f;
+			}
+			++i;
+		}
+	}
+
+	// Quads of the leaves in view, to be drawn as sf::Quads
+	void generateRenderData(const BoundingBox& view)
+	{
+		PROFILE_SCOPE("FallingLeaves::generateRenderData");
+		const LeafAtlas::Rect full{sf::Vector2f(0.0f, 0.0f), sf::Vector2f(LeafVertexGenerator::TextureSize, LeafVertexGenerator::TextureSize)};
+		const BoundingBox bounds = view.getInflated(LeafVertexGenerator::LeafLength);
+		m_vertices_count = 0;
+		for (uint32_t i(0); i < m_count; ++i) {
+			const Leaf& leaf = m_leaves[i];
+			if (!bounds.contains(leaf.position)) {
+				continue;
+			}
+			const Vec2 tangent(std::cos(leaf.angle), std::sin(leaf.angle));
+			const Vec2 dir = tangent * (0.5f * LeafVertexGenerator::LeafLength * leaf.size);
+			const Vec2 nrm = tangent.getNormal() * (0.5f * LeafVertexGenerator::LeafWidth * leaf.size);
+			const Vec2 pts[4] = {leaf.position - dir + nrm, leaf.position + dir + nrm, leaf.position + dir - nrm, leaf.position - dir - nrm};
+			const LeafAtlas::Rect& rect = m_atlas ? m_atlas->getLeafRect(leaf.variant) : full;
+			const sf::Vector2f tex[4] = {rect.min, sf::Vector2f(rect.max.x, rect.min.y), rect.max, sf::Vector2f(rect.min.x, rect.max.y)};
+			sf::Color color = leaf.color;
+			if (leaf.rest_time > RestDuration - 1.0f) {
+				color.a = static_cast<uint8_t>(255.0f * std::max(0.0f, RestDuration - leaf.rest_time));
+			}
+			sf::Vertex* quad = &m_vertices[m_vertices_count];
+			for (uint32_t corner(0); corner < 4; ++corner) {
+				quad[corner] = sf::Vertex(sf::Vector2f(pts[corner].x, pts[corner].y), color, tex[corner]);
+			}
+			m_vertices_count += 4;
+		}
+	}
+
+	void draw(sf::RenderTarget& target) const
+	{
+		if (!m_vertices_count) {
+			return;
+		}
+		sf::RenderStates states;
+		states.texture = m_atlas ? &m_atlas->getTexture() : nullptr;
+		target.draw(m_vertices.data(), m_vertices_count, sf::Quads, states);
+	}
+
+	void clear()
+	{
+		m_count = 0;
+		m_vertices_count = 0;
+	}
+
+	uint32_t getCount() const
+	{
+		return m_count;
+	}
+
+	uint32_t getCapacity() const
+	{
+		return static_cast<uint32_t>(m_leaves.size());
+	}
+
+	// Leaves that went through the pool since it was created
+	uint64_t getRecycledCount() const
+	{
+		return m_recycled;
+	}
+
+	const Leaf& getLeaf(uint32_t i) const
+	{
+		return m_leaves[i];
+	}
+
+	const sf::Vertex* getVertices() const
+	{
+		return m_vertices.data();
+	}
+
+	uint64_t getVertexCount() const
+	{
+		return m_vertices_count;
+	}
+
+	uint64_t getMemory() const
+	{
+		return m_leaves.capacity() * sizeof(Leaf) + m_vertices.capacity() * sizeof(sf::Vertex);
+	}
+
+private:
+	std::vector<Leaf> m_leaves;
+	std::vector<sf::Vertex> m_vertices;
+	uint32_t m_count;
+	uint64_t m_vertices_count;
+	float m_ground_y;
+	const LeafAtlas* m_atlas;
+	uint64_t m_recycled;
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include "tree.hpp"
+#include "leaf_atlas.hpp"
+
+
+// Vertices of many trees in two shared buffers, filled by TreeRenderer::generateRenderData
+struct ForestRenderData
+{
+	// Consecutive branches of a tree and their leaves, generated by a single thread
+	struct Task
+	{
+		uint32_t tree_id;
+		uint32_t branches_first;
+		uint32_t branches_last;
+		// Index of the first branch's flags in visibility
+		uint64_t visibility_offset;
+		// Slices of the shared buffers written by this task
+		uint64_t branches_offset;
+		uint64_t leaves_offset;
+	};
+
+	enum Visibility : uint8_t
+	{
+		BranchVisible = 1,
+		LeavesVisible = 2
+	};
+
+	// Branches as sf::Triangles, white
+	std::vector<sf::Vertex> branches;
+	// Leaves as sf::Quads
+	std::vector<sf::Vertex> leaves;
+	std::vector<Task> tasks;
+	std::vector<uint8_t> visibility;
+	// Leaves texture coordinates, the whole leaf texture is used if nullptr
+	const LeafAtlas* atlas;
+	// Vertices in use, the buffers can be larger
+	uint64_t branches_vertices_count;
+	uint64_t leaves_vertices_count;
+
+	ForestRenderData()
+		: atlas(nullptr)
+		, branches_vertices_count(0)
+		, leaves_vertices_count(0)
+	{}
+
+	// Branch vertices as triangles, the strip of a branch's first n - 1 nodes is split in quads
+	static uint64_t getBranchVerticesCount(const v2::Branch& b)
+	{
+		return b.nodes.size() > 2 ? 6 * (b.nodes.size() - 2) : 0;
+	}
+
+	// Storage only grows so that it is reused from one frame to the next
+	void reserve()
+	{
+		if (branches.size() < branches_vertices_count) {
+			branches.resize(branches_vertices_count);
+		}
+		if (leaves.size() < leaves_vertices_count) {
+			leaves.resize(leaves_vertices_count);
+		}
+	}
+};
@@ -0,0 +1,156 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include "tree_renderer.hpp"
+
+
+// Every visible tree of a forest in two persistent buffers, drawn with one call for the branches and one for the leaves
+// Distant trees have their own buffers, that can be refreshed less often
+class ForestRenderer
+{
+public:
+	// Render data is generated on the swarm's threads if one is provided
+	ForestRenderer(swrm::Swarm* swarm = nullptr)
+		: m_swarm(swarm)
+		, m_atlas(nullptr)
+		, m_draw_calls(0)
+		, m_distant_period(1)
+		, m_updates(0)
+		, m_distant_update(0)
+		, m_distant_valid(false)
+	{}
+
+	// Leaves are textured with the atlas' variants, it has to outlive the renderer
+	void setAtlas(const LeafAtlas* atlas)
+	{
+		m_atlas = atlas && atlas->getVariantsCount() ? atlas : nullptr;
+		m_data.atlas = m_atlas;
+		m_distant_data.atlas = m_atlas;
+		m_distant_valid = false;
+	}
+
+	void clear()
+	{
+		m_trees.clear();
+		m_distant_trees.clear();
+	}
+
+	void addTree(const v2::Tree& tree, bool distant = false)
+	{
+		(distant ? m_distant_trees : m_trees).push_back(&tree);
+	}
+
+	// Distant trees are generated once every period updates, or sooner if they changed or the view went past their area
+	void setDistantRefreshPeriod(uint32_t period)
+	{
+		m_distant_period = std::max(1U, period);
+	}
+
+	// Generates the vertices of the added trees that intersect the view
+	void update(const BoundingBox& view)
+	{
+		generate(m_trees, m_data, view);
+		if (m_distant_trees.empty()) {
+			m_distant_data.branches_vertices_count = 0;
+			m_distant_data.leaves_vertices_count = 0;
+			m_distant_valid = false;
+			++m_updates;
+			return;
+		}
+		const bool view_covered = m_distant_view.contains(view.min) && m_distant_view.contains(view.max);
+		if (!m_distant_valid || !view_covered || m_distant_trees != m_distant_generated || m_updates - m_distant_update >= m_distant_period) {
+			// Kept data has to cover the view as it scrolls
+			m_distant_view = m_distant_period > 1 ? view.getInflated(0.25f * (view.max.x - view.min.x)) : view;
+			generate(m_distant_trees, m_distant_data, m_distant_view);
+			m_distant_generated = m_distant_trees;
+			m_distant_update = m_updates;
+			m_distant_valid = true;
+		}
+		++m_updates;
+	}
+
+	void draw(sf::RenderTarget& target, bool draw_branches = true, bool draw_leaves = true)
+	{
+		m_draw_calls = 0;
+		drawData(target, m_distant_data, draw_branches, draw_leaves);
+		drawData(target, m_data, draw_branches, draw_leaves);
+	}
+
+	// Draw calls issued by the last draw
+	uint32_t getDrawCalls() const
+	{
+		return m_draw_calls;
+	}
+
+	// Vertices generated by the last update, with those kept for distant trees
+	uint64_t getVertexCount() const
+	{
+		return getBranchesVertexCount() + getLeavesVertexCount();
+	}
+
+	uint64_t getBranchesVertexCount() const
+	{
+		return m_data.branches_vertices_count + m_distant_data.branches_vertices_count;
+	}
+
+	uint64_t getLeavesVertexCount() const
+	{
+		return m_data.leaves_vertices_count + m_distant_data.leaves_vertices_count;
+	}
+
+	// Vertices of the last update, for renderers that don't go through an sf::RenderTarget
+	const ForestRenderData& getData() const
+	{
+		return m_data;
+	}
+
+	const ForestRenderData& getDistantData() const
+	{
+		return m_distant_data;
+	}
+
+	uint32_t getTreesCount() const
+	{
+		return static_cast<uint32_t>(m_trees.size() + m_distant_trees.size());
+	}
+
+private:
+	swrm::Swarm* m_swarm;
+	const LeafAtlas* m_atlas;
+	std::vector<const v2::Tree*> m_trees;
+	ForestRenderData m_data;
+	uint32_t m_draw_calls;
+	// Distant trees and the ones their data was generated from
+	std::vector<const v2::Tree*> m_distant_trees;
+	std::vector<const v2::Tree*> m_distant_generated;
+	ForestRenderData m_distant_data;
+	BoundingBox m_distant_view;
+	uint32_t m_distant_period;
+	uint64_t m_updates;
+	uint64_t m_distant_update;
+	bool m_distant_valid;
+
+	void generate(const std::vector<const v2::Tree*>& trees, ForestRenderData& data, const BoundingBox& view)
+	{
+		if (m_swarm) {
+			TreeRenderer::generateRenderData(trees, data, view, *m_swarm);
+		}
+		else {
+			TreeRenderer::generateRenderData(trees, data, view);
+		}
+	}
+
+	void drawData(sf::RenderTarget& target, const ForestRenderData& data, bool draw_branches, bool draw_leaves)
+	{
+		if (draw_branches && data.branches_vertices_count) {
+			target.draw(data.branches.data(), data.branches_vertices_count, sf::Triangles);
+			++m_draw_calls;
+		}
+		if (draw_leaves && data.leaves_vertices_count) {
+			sf::RenderStates states;
+			states.texture = m_atlas ? &m_atlas->getTexture() : nullptr;
+			target.draw(data.leaves.data(), data.leaves_vertices_count, sf::Quads, states);
+			++m_draw_calls;
+		}
+	}
+};
@@ -0,0 +1,228 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "tree.hpp"
+
+
+// Lowers the simulation and rendering fidelity when frames go over budget and restores it once there is room again
+// Knobs are lowered one step at a time in priority order and restored in reverse order
+struct FrameGovernor
+{
+	enum Knob : uint8_t
+	{
+		LeavesPeriod,
+		BranchSubsteps,
+		DistantRenderPeriod,
+		ActiveLeaves,
+		KnobsCount
+	};
+
+	enum Stage : uint8_t
+	{
+		Streaming,
+		Physics,
+		Render,
+		StagesCount
+	};
+
+	struct Decision
+	{
+		uint64_t frame;
+		Knob knob;
+		float from;
+		float to;
+		// Smoothed frame time that triggered the change, in milliseconds
+		float frame_time;
+	};
+
+	static constexpr uint32_t HistorySize = 64;
+
+	// Milliseconds of work per frame
+	float budget;
+	// Fidelity is restored once frames take less than this fraction of the budget
+	float restore_ratio;
+	// Weight of the last frame in the smoothed frame time
+	float smoothing;
+	// Frames after a change during which nothing is lowered, restoring waits restore_delay frames
+	uint32_t cooldown;
+	uint32_t restore_delay;
+	// Bounds of the knobs, the other ends are full fidelity
+	uint32_t max_leaves_period;
+	// Substeps at full fidelity, 1 like an ungoverned tree. Higher values opt in to extra substeps, dropped first under load
+	uint32_t max_branch_substeps;
+	uint32_t max_distant_render_period;
+	float min_active_leaves;
+	// Trees at this level of detail or a coarser one are distant
+	uint32_t distant_lod;
+	// Decisions are also written there if not null
+	std::FILE* log;
+
+	// Current fidelity
+	uint32_t leaves_period;
+	uint32_t branch_substeps;
+	uint32_t distant_render_period;
+	float active_leaves;
+
+	// Of the current frame, in milliseconds
+	float stage_times[StagesCount];
+	float frame_time;
+	uint64_t frame;
+	uint64_t last_change;
+	// Last HistorySize decisions, decisions_count % HistorySize is the next slot
+	std::vector<Decision> decisions;
+	uint64_t decisions_count;
+
+	FrameGovernor(float budget_ms = 16.0f)
+		: budget(budget_ms)
+		, restore_ratio(0.7f)
+		, smoothing(0.1f)
+		, cooldown(20)
+		, restore_delay(120)
+		, max_leaves_period(4)
+		, max_branch_substeps(1)
+		, max_distant_render_period(8)
+		, min_active_leaves(0.25f)
+		, distant_lod(2)
+		, log(nullptr)
+		, decisions(HistorySize)
+	{
+		reset();
+	}
+
+	// Back to full fidelity
+	void reset()
+	{
+		leaves_period = 1;
+		branch_substeps = max_branch_substeps;
+		distant_render_period = 1;
+		active_leaves = 1.0f;
+		std::fill(stage_times, stage_times + StagesCount, 0.0f);
+		frame_time = 0.0f;
+		frame = 0;
+		last_change = 0;
+		decisions_count = 0;
+	}
+
+	void setStageTime(Stage stage, float milliseconds)
+	{
+		stage_times[stage] = milliseconds;
+	}
+
+	// Once per frame, after the stages' times have been set
+	void update()
+	{
+		float total = 0.0f;
+		for (float t : stage_times) {
+			total += t;
+		}
+		frame_time = frame ? frame_time + smoothing * (total - frame_time) : total;
+		++frame;
+
+		const uint64_t since_change = frame - last_change;
+		if (frame_time > budget && since_change >= cooldown) {
+			for (uint32_t knob(0); knob < KnobsCount; ++knob) {
+				if (step(static_cast<Knob>(knob), true)) {
+					break;
+				}
+			}
+		}
+		else if (frame_time < budget * restore_ratio && since_change >= restore_delay) {
+			for (uint32_t knob(KnobsCount); knob--;) {
+				if (step(static_cast<Knob>(knob), false)) {
+					break;
+				}
+			}
+		}
+	}
+
+	void apply(v2::Tree& tree) const
+	{
+		tree.leaves_period = leaves_period;
+		tree.branch_substeps = branch_substeps;
+		tree.active_leaves = active_leaves;
+	}
+
+	bool isFullFidelity() const
+	{
+		return leaves_period == 1 && branch_substeps == max_branch_substeps && distant_render_period == 1 && active_leaves >= 1.0f;
+	}
+
+	float getValue(Knob knob) const
+	{
+		switch (knob) {
+		case LeavesPeriod:
+			return float(leaves_period);
+		case BranchSubsteps:
+			return float(branch_substeps);
+		case DistantRenderPeriod:
+			return float(distant_render_period);
+		case ActiveLeaves:
+			return active_leaves;
+		default:
+			return 0.0f;
+		}
+	}
+
+	// Most recent first, i < getDecisionsCount()
+	const Decision& getDecision(uint64_t i) const
+	{
+		return decisions[(decisions_count - 1 - i) % HistorySize];
+	}
+
+	uint64_t getDecisionsCount() const
+	{
+		return std::min<uint64_t>(decisions_count, HistorySize);
+	}
+
+	static const char* getName(Knob knob)
+	{
+		static const char* names[] = {"leaves period", "branch substeps", "distant render period", "active leaves"};
+		return knob < KnobsCount ? names[knob] : "";
+	}
+
+	static const char* getName(Stage stage)
+	{
+		static const char* names[] = {"streaming", "physics", "render"};
+		return stage < StagesCount ? names[stage] : "";
+	}
+
+private:
+	// Moves a knob one step towards lower fidelity or back, returns false if it is already at its bound
+	bool step(Knob knob, bool lower)
+	{
+		const float from = getValue(knob);
+		switch (knob) {
+		case LeavesPeriod:
+			leaves_period = lower ? std::min(leaves_period + 1, max_leaves_period) : std::max(leaves_period - 1, 1U);
+			break;
+		case BranchSubsteps:
+			branch_substeps = lower ? std::max(branch_substeps - 1, 1U) : std::min(branch_substeps + 1, max_branch_substeps);
+			break;
+		case DistantRenderPeriod:
+			distant_render_period = lower ? std::min(2 * distant_render_period, max_distant_render_period) : std::max(distant_render_period / 2, 1U);
+			break;
+		case ActiveLeaves:
+			active_leaves = lower ? std::max(active_leaves - 0.25f, min_active_leaves) : std::min(active_leaves + 0.25f, 1.0f);
+			break;
+		default:
+			break;
+		}
+		const float to = getValue(knob);
+		if (to == from) {
+			return false;
+		}
+
+		last_change = frame;
+		decisions[decisions_count % HistorySize] = Decision{frame, knob, from, to, frame_time};
+		++decisions_count;
+		if (log) {
+			std::fprintf(log, "[FrameGovernor] frame %llu: %.2f ms %s %.2f ms (streaming %.2f, physics %.2f, render %.2f), %s %g -> %g\n",
+				static_cast<unsigned long long>(frame), frame_time, lower ? ">" : "<", lower ? budget : budget * restore_ratio,
+				stage_times[Streaming], stage_times[Physics], stage_times[Render], getName(knob), from, to);
+			std::fflush(log);
+		}
+		return true;
+	}
+};
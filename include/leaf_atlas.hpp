@@ -0,0 +1,103 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+
+// Leaf textures packed in a single texture so that leaves of any variant are drawn together
+// Every image gets a cell of the size of the largest one, cells are laid out in a square grid
+class LeafAtlas
+{
+public:
+	// Texture coordinates of a variant, in pixels as expected by sf::Vertex
+	struct Rect
+	{
+		sf::Vector2f min;
+		sf::Vector2f max;
+	};
+
+	bool addFromFile(const std::string& filename)
+	{
+		sf::Image image;
+		if (!image.loadFromFile(filename)) {
+			return false;
+		}
+		addFromImage(image);
+		return true;
+	}
+
+	void addFromImage(const sf::Image& image)
+	{
+		m_images.push_back(image);
+	}
+
+	// Packs the added images, the texture is not needed by headless renderers and requires a graphics context
+	bool build(bool create_texture = true)
+	{
+		if (m_images.empty()) {
+			return false;
+		}
+		sf::Vector2u cell(0, 0);
+		for (const sf::Image& image : m_images) {
+			cell.x = std::max(cell.x, image.getSize().x);
+			cell.y = std::max(cell.y, image.getSize().y);
+		}
+		const uint32_t count = static_cast<uint32_t>(m_images.size());
+		const uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(count))));
+		const uint32_t rows = (count + columns - 1) / columns;
+
+		m_atlas.create(columns * cell.x, rows * cell.y, sf::Color::Transparent);
+		m_rects.clear();
+		for (uint32_t i(0); i < count; ++i) {
+			const sf::Vector2u origin((i % columns) * cell.x, (i / columns) * cell.y);
+			const sf::Vector2u size = m_images[i].getSize();
+			m_atlas.copy(m_images[i], origin.x, origin.y);
+			m_rects.push_back({sf::Vector2f(float(origin.x), float(origin.y)), sf::Vector2f(float(origin.x + size.x), float(origin.y + size.y))});
+		}
+		m_images.clear();
+		if (!create_texture) {
+			return true;
+		}
+		if (!m_texture.loadFromImage(m_atlas)) {
+			m_rects.clear();
+			return false;
+		}
+		m_texture.setSmooth(true);
+		return true;
+	}
+
+	const sf::Texture& getTexture() const
+	{
+		return m_texture;
+	}
+
+	const sf::Image& getImage() const
+	{
+		return m_atlas;
+	}
+
+	uint32_t getVariantsCount() const
+	{
+		return static_cast<uint32_t>(m_rects.size());
+	}
+
+	const Rect& getRect(uint32_t variant) const
+	{
+		return m_rects[variant];
+	}
+
+	// Stable variant of a leaf, it does not change from one frame to the next
+	const Rect& getLeafRect(uint32_t leaf_id) const
+	{
+		const uint32_t hash = leaf_id * 2654435761U;
+		return m_rects[(hash >> 16) % m_rects.size()];
+	}
+
+private:
+	std::vector<sf::Image> m_images;
+	std::vector<Rect> m_rects;
+	sf::Image m_atlas;
+	sf::Texture m_texture;
+};
@@ -0,0 +1,396 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+#include "tree.hpp"
+#include "leaf_vertex_generator.hpp"
+#include "profiler.hpp"
+#include "swarm.hpp"
+
+
+// Collisions between the leaves of a forest, and between leaves and branches
+// Leaves are discs centered on their quad, branches are chains of discs on their nodes, which are a few pixels apart,
+// they are heavy and only push the leaves
+// The broadphase is a spatial hash rebuilt every frame with a counting sort, the narrowphase
+// runs over chunks of buckets and each leaf only writes its own correction so no lock is needed
+class LeafCollider
+{
+public:
+	// Buckets per task of the narrowphase
+	static constexpr uint32_t TaskBuckets = 256;
+	static constexpr uint32_t MinBuckets = 4096;
+
+	struct Body
+	{
+		Vec2 center;
+		Vec2 attach;
+		float radius;
+		uint32_t tree_id;
+		uint32_t leaf_id;
+	};
+
+	// What the narrowphase reads, kept small
+	struct Disc
+	{
+		Vec2 center;
+		float radius;
+		// Index of the leaf's body, unused for nodes
+		uint32_t body;
+	};
+
+	// Collision radius as a fraction of the leaf's half width, leaves in a canopy overlap a lot at full size
+	float radius_scale;
+	// Fraction of the overlap removed per solve
+	float stiffness;
+	// Leaves and branch nodes tested per leaf, bound the cost of the densest cells
+	uint32_t max_leaf_tests;
+	uint32_t max_branch_tests;
+	bool collide_branches;
+
+	// Leaves beyond capacity are not collided
+	LeafCollider(uint32_t capacity)
+		: radius_scale(0.5f)
+		, stiffness(0.5f)
+		, max_leaf_tests(16)
+		, max_branch_tests(16)
+		, collide_branches(true)
+		, m_bodies(capacity)
+		, m_leaves(capacity)
+		, m_sorted_leaves(capacity)
+		, m_leaves_keys(capacity)
+		, m_corrections(capacity)
+		, m_count(0)
+		, m_cell_size(1.0f)
+		, m_inv_cell_size(1.0f)
+		, m_max_radius(0.0f)
+		, m_mask(0)
+		, m_contacts(0)
+		, m_next_task(0)
+	{
+		m_leaves_starts.resize(getBucketsCount(capacity) + 1);
+		m_nodes_starts.resize(getBucketsCount(capacity) + 1);
+	}
+
+	void clear()
+	{
+		m_trees.clear();
+		m_count = 0;
+	}
+
+	// Compact leaves have no free particle and are ignored
+	void addTree(v2::Tree& tree)
+	{
+		if (tree.compact) {
+			return;
+		}
+		const uint32_t tree_id = static_cast<uint32_t>(m_trees.size());
+		m_trees.push_back(&tree);
+		const uint32_t leaves_count = static_cast<uint32_t>(tree.leaves.size());
+		for (uint32_t k(0); k < leaves_count && m_count < m_bodies.size(); ++k) {
+			const v2::Leaf& l = tree.leaves[k];
+			if (l.detached) {
+				continue;
+			}
+			const float half_length = 0.5f * LeafVertexGenerator::LeafLength * l.size;
+			m_bodies[m_count] = Body{l.getPosition() + l.getDir().getNormalized() * half_length, l.getPosition(),
+				radius_scale * 0.5f * LeafVertexGenerator::LeafWidth * l.size, tree_id, k};
+			++m_count;
+		}
+	}
+
+	void solve(swrm::Swarm* swarm = nullptr)
+	{
+		PROFILE_SCOPE("LeafCollider::solve");
+		m_contacts = 0;
+		if (!m_count) {
+			return;
+		}
+		buildLeaves();
+		buildNodes();
+		m_next_task = 0;
+		if (swarm) {
+			swarm->execute([this](uint32_t, uint32_t) {
+				runTasks();
+			}).waitExecutionDone();
+		}
+		else {
+			runTasks();
+		}
+		apply();
+	}
+
+	uint32_t getBodiesCount() const
+	{
+		return m_count;
+	}
+
+	uint32_t getCapacity() const
+	{
+		return static_cast<uint32_t>(m_bodies.size());
+	}
+
+	// Leaves pushed by the last solve
+	uint32_t getContactsCount() const
+	{
+		return m_contacts;
+	}
+
+	uint64_t getMemory() const
+	{
+		return m_bodies.capacity() * sizeof(Body) + m_corrections.capacity() * sizeof(Vec2)
+			+ (m_leaves_keys.capacity() + m_leaves_starts.capacity() + m_nodes_keys.capacity() + m_nodes_starts.capacity()) * sizeof(uint32_t)
+			+ (m_leaves.capacity() + m_sorted_leaves.capacity() + m_unsorted_nodes.capacity() + m_nodes.capacity()) * sizeof(Disc);
+	}
+
+private:
+	std::vector<v2::Tree*> m_trees;
+	std::vector<Body> m_bodies;
+	// Leaves sorted by bucket, bucket i holds [m_leaves_starts[i], m_leaves_starts[i + 1])
+	std::vector<Disc> m_leaves;
+	std::vector<Disc> m_sorted_leaves;
+	std::vector<uint32_t> m_leaves_keys;
+	std::vector<uint32_t> m_leaves_starts;
+	std::vector<Vec2> m_corrections;
+	// Same for the branches' nodes, a node can be in several buckets
+	std::vector<Disc> m_unsorted_nodes;
+	std::vector<uint32_t> m_nodes_keys;
+	std::vector<Disc> m_nodes;
+	std::vector<uint32_t> m_nodes_starts;
+	uint32_t m_count;
+	float m_cell_size;
+	float m_inv_cell_size;
+	float m_max_radius;
+	// Buckets count minus one, the table is sized for the leaves of the frame
+	uint32_t m_mask;
+	std::atomic<uint32_t> m_contacts;
+	std::atomic<uint32_t> m_next_task;
+
+	// Floor without the library call
+	int32_t getCell(float x) const
+	{
+		const float cell = x * m_inv_cell_size;
+		const int32_t truncated = static_cast<int32_t>(cell);
+		return truncated - (cell < static_cast<float>(truncated) ? 1 : 0);
+	}
+
+	// Cells of a row are consecutive buckets from an offset that spreads the rows over the table
+	// Offsets of consecutive rows are about 0.6 of the table apart so the 3 rows around a cell never share a bucket
+	uint32_t getBucket(int32_t cell_x, int32_t cell_y) const
+	{
+		return (static_cast<uint32_t>(cell_x) + static_cast<uint32_t>(cell_y) * 0x9E3779B1U) & m_mask;
+	}
+
+	// About two buckets per leaf
+	static uint32_t getBucketsCount(uint32_t leaves_count)
+	{
+		uint32_t buckets(MinBuckets);
+		while (buckets < 2 * leaves_count) {
+			buckets *= 2;
+		}
+		return buckets;
+	}
+
+	// Leaves are hashed by their center, cells are as large as the largest contact distance
+	void buildLeaves()
+	{
+		m_max_radius = 0.0f;
+		for (uint32_t i(0); i < m_count; ++i) {
+			m_max_radius = std::max(m_max_radius, m_bodies[i].radius);
+		}
+		m_cell_size = std::max(1.0f, 2.0f * m_max_radius);
+		m_inv_cell_size = 1.0f / m_cell_size;
+		m_mask = getBucketsCount(m_count) - 1;
+
+		for (uint32_t i(0); i < m_count; ++i) {
+			const Body& body = m_bodies[i];
+			m_leaves[i] = Disc{body.center, body.radius, i};
+			m_leaves_keys[i] = getBucket(getCell(body.center.x), getCell(body.center.y));
+		}
+		countingSort(m_leaves_keys, m_leaves, m_count, m_leaves_starts, m_sorted_leaves);
+	}
+
+	// Nodes are hashed by their center like leaves, those larger than a cell are also put in the cells around
+	// so that the 3x3 cells around a leaf hold all the nodes it can touch
+	void buildNodes()
+	{
+		std::fill(m_nodes_starts.begin(), m_nodes_starts.begin() + m_mask + 2, 0);
+		if (!collide_branches) {
+			return;
+		}
+		m_unsorted_nodes.clear();
+		m_nodes_keys.clear();
+		for (const v2::Tree* tree : m_trees) {
+			for (const v2::Branch& b : tree->branches) {
+				for (const v2::Node& n : b.nodes) {
+					addNode(Disc{n.position, 0.5f * n.width, 0});
+				}
+			}
+		}
+		if (m_nodes.size() < m_unsorted_nodes.size()) {
+			m_nodes.resize(m_unsorted_nodes.size());
+		}
+		countingSort(m_nodes_keys, m_unsorted_nodes, m_unsorted_nodes.size(), m_nodes_starts, m_nodes);
+	}
+
+	void addNode(const Disc& disc)
+	{
+		const float margin = disc.radius + m_max_radius - m_cell_size;
+		if (margin <= 0.0f) {
+			m_nodes_keys.push_back(getBucket(getCell(disc.center.x), getCell(disc.center.y)));
+			m_unsorted_nodes.push_back(disc);
+			return;
+		}
+		const int32_t x_min = getCell(disc.center.x - margin);
+		const int32_t x_max = getCell(disc.center.x + margin);
+		const int32_t y_min = getCell(disc.center.y - margin);
+		const int32_t y_max = getCell(disc.center.y + margin);
+		for (int32_t x(x_min); x <= x_max; ++x) {
+			for (int32_t y(y_min); y <= y_max; ++y) {
+				m_nodes_keys.push_back(getBucket(x, y));
+				m_unsorted_nodes.push_back(disc);
+			}
+		}
+	}
+
+	// Bucket k holds sorted[starts[k], starts[k + 1]) once done
+	template<typename T>
+	void countingSort(const std::vector<uint32_t>& keys, const std::vector<T>& items, uint64_t count, std::vector<uint32_t>& starts, std::vector<T>& sorted) const
+	{
+		const uint32_t buckets_count = m_mask + 1;
+		std::fill(starts.begin(), starts.begin() + buckets_count + 1, 0);
+		for (uint64_t i(0); i < count; ++i) {
+			++starts[keys[i] + 1];
+		}
+		for (uint32_t i(1); i <= buckets_count; ++i) {
+			starts[i] += starts[i - 1];
+		}
+		// Bucket starts are used as write cursors, each one ends up on the next bucket's start
+		for (uint64_t i(0); i < count; ++i) {
+			sorted[starts[keys[i]]++] = items[i];
+		}
+		for (uint32_t i(buckets_count); i > 0; --i) {
+			starts[i] = starts[i - 1];
+		}
+		starts[0] = 0;
+	}
+
+	void runTasks()
+	{
+		PROFILE_SCOPE("LeafCollider::narrowphase");
+		const uint32_t buckets_count = m_mask + 1;
+		const uint32_t tasks_count = (buckets_count + TaskBuckets - 1) / TaskBuckets;
+		uint32_t contacts(0);
+		for (uint32_t task(m_next_task++); task < tasks_count; task = m_next_task++) {
+			const uint32_t last = std::min(buckets_count, (task + 1) * TaskBuckets);
+			for (uint32_t bucket(task * TaskBuckets); bucket < last; ++bucket) {
+				const uint32_t end = m_leaves_starts[bucket + 1];
+				for (uint32_t i(m_leaves_starts[bucket]); i < end; ++i) {
+					contacts += solveBody(i) ? 1 : 0;
+				}
+			}
+		}
+		m_contacts += contacts;
+	}
+
+	// Only writes the correction of the i-th sorted leaf
+	bool solveBody(uint32_t i)
+	{
+		const Disc& body = m_sorted_leaves[i];
+		const int32_t cell_x = getCell(body.center.x);
+		const int32_t cell_y = getCell(body.center.y);
+		// Cells x - 1 to x + 1 of a row are consecutive buckets unless the row wraps around the table
+		uint32_t ranges[18];
+		uint32_t ranges_count(0);
+		for (int32_t dy(-1); dy <= 1; ++dy) {
+			const uint32_t first = getBucket(cell_x - 1, cell_y + dy);
+			if (first + 2 <= m_mask) {
+				ranges[ranges_count++] = first;
+				ranges[ranges_count++] = first + 3;
+			}
+			else {
+				for (uint32_t dx(0); dx < 3; ++dx) {
+					ranges[ranges_count++] = (first + dx) & m_mask;
+					ranges[ranges_count++] = ((first + dx) & m_mask) + 1;
+				}
+			}
+		}
+
+		// Each leaf takes half of the overlap, averaged so that crowded leaves don't overshoot
+		Vec2 push;
+		uint32_t leaf_contacts(0);
+		uint32_t tests(0);
+		for (uint32_t k(0); k < ranges_count; k += 2) {
+			const uint32_t end = m_leaves_starts[ranges[k + 1]];
+			for (uint32_t j(m_leaves_starts[ranges[k]]); j < end && tests < max_leaf_tests; ++j) {
+				if (j == i) {
+					continue;
+				}
+				++tests;
+				const Disc& other = m_sorted_leaves[j];
+				const Vec2 delta = body.center - other.center;
+				const float min_distance = body.radius + other.radius;
+				const float distance_sq = delta.x * delta.x + delta.y * delta.y;
+				if (distance_sq < min_distance * min_distance && distance_sq > 0.0f) {
+					const float distance = std::sqrt(distance_sq);
+					push += delta * (0.5f * (min_distance - distance) / distance);
+					++leaf_contacts;
+				}
+			}
+		}
+		Vec2 correction = leaf_contacts ? push * (stiffness / leaf_contacts) : Vec2();
+
+		// Deepest branch node, nodes holding the leaf are skipped
+		const Vec2 attach = m_bodies[body.body].attach;
+		float deepest = 0.0f;
+		Vec2 branch_push;
+		tests = 0;
+		for (uint32_t k(0); k < ranges_count; k += 2) {
+			const uint32_t end = m_nodes_starts[ranges[k + 1]];
+			for (uint32_t n(m_nodes_starts[ranges[k]]); n < end && tests < max_branch_tests; ++n) {
+				++tests;
+				const Disc& node = m_nodes[n];
+				const Vec2 delta = body.center - node.center;
+				const float min_distance = body.radius + node.radius;
+				const float distance_sq = delta.x * delta.x + delta.y * delta.y;
+				if (distance_sq >= min_distance * min_distance || distance_sq <= 0.0f) {
+					continue;
+				}
+				const Vec2 to_attach = attach - node.center;
+				if (to_attach.x * to_attach.x + to_attach.y * to_attach.y <= (node.radius + 1.0f) * (node.radius + 1.0f)) {
+					continue;
+				}
+				const float distance = std::sqrt(distance_sq);
+				if (min_distance - distance > deepest) {
+					deepest = min_distance - distance;
+					branch_push = delta * (deepest / distance);
+				}
+			}
+		}
+		correction += branch_push * stiffness;
+
+		m_corrections[body.body] = correction;
+		return leaf_contacts || deepest > 0.0f;
+	}
+
+	// Leaves turn around their attach point towards their corrected center, the stem keeps its length
+	// and both positions are moved so collisions don't add energy
+	void apply()
+	{
+		for (uint32_t i(0); i < m_count; ++i) {
+			const Vec2 correction = m_corrections[i];
+			if (correction.x == 0.0f && correction.y == 0.0f) {
+				continue;
+			}
+			const Body& body = m_bodies[i];
+			v2::Leaf& leaf = m_trees[body.tree_id]->leaves[body.leaf_id];
+			Particule& p = leaf.free_particule;
+			const float stem = (p.position - body.attach).getLength();
+			const Vec2 dir = (body.center + correction - body.attach).getNormalized();
+			const Vec2 delta = body.attach + dir * stem - p.position;
+			p.position += delta;
+			p.old_position += delta;
+		}
+	}
+};
@@ -0,0 +1,304 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include "tree.hpp"
+#include "vec2xn.hpp"
+#include "leaf_atlas.hpp"
+
+
+// Leaf quads of a tree in a contiguous buffer, leaf i uses vertices [4i, 4i + 4)
+// Texture coordinates and colors never change, only positions are written every frame
+class LeafVertexGenerator
+{
+public:
+	static constexpr float LeafLength = 30.0f;
+	static constexpr float LeafWidth = 30.0f;
+	// Side of the leaf texture, in pixels
+	static constexpr float TextureSize = 1024.0f;
+
+	LeafVertexGenerator()
+		: m_source(nullptr)
+		, m_source_leaves(nullptr)
+		, m_draw_first(0)
+		, m_draw_last(0)
+	{}
+
+	// Distance up to which leaves extend around the branches' bounding boxes
+	static float getMargin(const v2::Tree& tree)
+	{
+		return (LeafLength + 0.5f * LeafWidth) * tree.max_leaf_size;
+	}
+
+	// Writes the static attributes, only does something when the tree's leaves changed
+	void initialize(const v2::Tree& tree)
+	{
+		const uint64_t leaves_count = tree.getLeavesCount();
+		const void* leaves_data = tree.compact ? static_cast<const void*>(tree.compact_leaves.hue.data()) : static_cast<const void*>(tree.leaves.data());
+		if (m_source == &tree && m_source_leaves == leaves_data && m_vertices.size() == 4 * leaves_count) {
+			return;
+		}
+		m_source = &tree;
+		m_source_leaves = leaves_data;
+		m_vertices.resize(4 * leaves_count);
+		writeStatic(tree, 0, static_cast<uint32_t>(leaves_count), m_vertices.data());
+	}
+
+	// Flags the branches whose leaves can be visible and restricts the drawn range to their active leaves, returns false if none is
+	bool cull(const v2::Tree& tree, const BoundingBox& view)
+	{
+		const float margin = getMargin(tree);
+		m_draw_first = 0;
+		m_draw_last = 0;
+		if (!tree.bbox.getInflated(margin).intersects(view)) {
+			return false;
+		}
+
+		const uint64_t branches_count = tree.branches.size();
+		m_visible.resize(branches_count);
+		bool first_found = false;
+		for (uint64_t i(0); i < branches_count; ++i) {
+			const bool visible = tree.branches[i].bbox.getInflated(margin).intersects(view);
+			m_visible[i] = visible;
+			const uint32_t active_end = tree.getActiveLeavesEnd(i);
+			if (visible && tree.leaves_offsets[i] != active_end) {
+				if (!first_found) {
+					m_draw_first = tree.leaves_offsets[i];
+					first_found = true;
+				}
+				m_draw_last = active_end;
+			}
+		}
+		return true;
+	}
+
+	void generate(const v2::Tree& tree)
+	{
+		generate(tree, m_draw_first, m_draw_last);
+	}
+
+	// Positions of leaves [first, last), disjoint ranges can be generated from different threads
+	// Leaves past their branch's active end are collapsed, see Tree::active_leaves
+	void generate(const v2::Tree& tree, uint32_t first, uint32_t last)
+	{
+		if (first >= last) {
+			return;
+		}
+		if (tree.active_leaves >= 1.0f) {
+			writePositions(tree, first, last, &m_vertices[4 * first], m_visible.data());
+			return;
+		}
+		const std::vector<uint32_t>& offsets = tree.leaves_offsets;
+		uint64_t branch_id = std::upper_bound(offsets.begin(), offsets.end(), first) - offsets.begin() - 1;
+		for (; branch_id + 1 < offsets.size() && offsets[branch_id] < last; ++branch_id) {
+			const uint32_t branch_first = std::max(first, offsets[branch_id]);
+			const uint32_t branch_last = std::min(last, offsets[branch_id + 1]);
+			const uint32_t active_last = std::max(branch_first, std::min(branch_last, tree.getActiveLeavesEnd(branch_id)));
+			if (branch_first < active_last) {
+				writePositions(tree, branch_first, active_last, &m_vertices[4 * branch_first], m_visible.data());
+			}
+			for (uint32_t k(active_last); k < branch_last; ++k) {
+				collapseQuad(&m_vertices[4 * k], getAttach(tree, k));
+			}
+		}
+	}
+
+	uint32_t getDrawFirst() const
+	{
+		return m_draw_first;
+	}
+
+	uint32_t getDrawLast() const
+	{
+		return m_draw_last;
+	}
+
+	// Vertices of the drawn range, to be drawn as sf::Quads
+	const sf::Vertex* getVertices() const
+	{
+		return m_vertices.data() + 4 * m_draw_first;
+	}
+
+	uint64_t getVertexCount() const
+	{
+		return 4 * static_cast<uint64_t>(m_draw_last - m_draw_first);
+	}
+
+	void clear()
+	{
+		m_draw_first = 0;
+		m_draw_last = 0;
+	}
+
+	// Texture coordinates and colors of leaves [first, last), out is the first leaf's quad
+	// Without atlas the whole leaf texture is used
+	static void writeStatic(const v2::Tree& tree, uint32_t first, uint32_t last, sf::Vertex* out, const LeafAtlas* atlas = nullptr)
+	{
+		const LeafAtlas::Rect full{sf::Vector2f(0.0f, 0.0f), sf::Vector2f(TextureSize, TextureSize)};
+		for (uint32_t k(first); k < last; ++k) {
+			const sf::Color color = tree.compact ? sf::Color(255, tree.compact_leaves.hue[k], 0) : tree.leaves[k].color;
+			const LeafAtlas::Rect& rect = atlas ? atlas->getLeafRect(k) : full;
+			sf::Vertex* quad = out + 4 * (k - first);
+			quad[0].texCoords = sf::Vector2f(rect.min.x, rect.min.y);
+			quad[1].texCoords = sf::Vector2f(rect.max.x, rect.min.y);
+			quad[2].texCoords = sf::Vector2f(rect.max.x, rect.max.y);
+			quad[3].texCoords = sf::Vector2f(rect.min.x, rect.max.y);
+			for (uint32_t corner(0); corner < 4; ++corner) {
+				quad[corner].color = color;
+			}
+		}
+	}
+
+	// Positions of leaves [first, last), out is the first leaf's quad
+	// visible holds a flag per branch, leaves of hidden branches are collapsed on their attach point, nullptr if all are visible
+	// Detached leaves are collapsed as well
+	static void writePositions(const v2::Tree& tree, uint32_t first, uint32_t last, sf::Vertex* out, const uint8_t* visible)
+	{
+		if (!tree.compact) {
+			generateLeaves(tree, first, last, out, visible);
+			return;
+		}
+
+		uint32_t k(first);
+		switch (simd::getBackend()) {
+#ifdef TREE2D_SIMD_X86
+		case simd::AVX2:
+			k = generateAvx2(tree, first, last, out, visible);
+			break;
+		case simd::SSE2:
+			k = generatePacked<simd::Sse2Backend>(tree, first, last, out, visible);
+			break;
+#endif
+#ifdef TREE2D_SIMD_NEON
+		case simd::NEON:
+			k = generatePacked<simd::NeonBackend>(tree, first, last, out, visible);
+			break;
+#endif
+		default:
+			break;
+		}
+		// Remaining leaves
+		generatePacked<simd::ScalarBackend>(tree, k, last, out + 4 * (k - first), visible);
+	}
+
+private:
+	std::vector<sf::Vertex> m_vertices;
+	// One flag per branch, not a vector<bool> so that threads can read it without contention
+	std::vector<uint8_t> m_visible;
+	const v2::Tree* m_source;
+	const void* m_source_leaves;
+	uint32_t m_draw_first;
+	uint32_t m_draw_last;
+
+	static void writeQuad(sf::Vertex* quad, const float* pts_x, const float* pts_y)
+	{
+		for (uint32_t corner(0); corner < 4; ++corner) {
+			quad[corner].position = sf::Vector2f(pts_x[corner], pts_y[corner]);
+		}
+	}
+
+	static Vec2 getAttach(const v2::Tree& tree, uint32_t k)
+	{
+		if (tree.compact) {
+			return tree.branches[tree.compact_leaves.getBranchId(k)].nodes[tree.compact_leaves.getNodeId(k)].position;
+		}
+		return tree.leaves[k].getPosition();
+	}
+
+	static void collapseQuad(sf::Vertex* quad, Vec2 attach)
+	{
+		for (uint32_t corner(0); corner < 4; ++corner) {
+			quad[corner].position = sf::Vector2f(attach.x, attach.y);
+		}
+	}
+
+	static void generateLeaves(const v2::Tree& tree, uint32_t first, uint32_t last, sf::Vertex* out, const uint8_t* visible)
+	{
+		for (uint32_t k(first); k < last; ++k) {
+			const v2::Leaf& l = tree.leaves[k];
+			const Vec2 attach = l.getPosition();
+			sf::Vertex* quad = out + 4 * (k - first);
+			if (l.detached || (visible && !visible[l.attach.branch_id])) {
+				collapseQuad(quad, attach);
+				continue;
+			}
+			const Vec2 leaf_dir = l.getDir().getNormalized();
+			const Vec2 dir = leaf_dir * LeafLength * l.size;
+			const Vec2 nrm = leaf_dir.getNormal() * (0.5f * LeafWidth * l.size);
+			const float pts_x[4] = {attach.x + nrm.x, attach.x + nrm.x + dir.x, attach.x - nrm.x + dir.x, attach.x - nrm.x};
+			const float pts_y[4] = {attach.y + nrm.y, attach.y + nrm.y + dir.y, attach.y - nrm.y + dir.y, attach.y - nrm.y};
+			writeQuad(quad, pts_x, pts_y);
+		}
+	}
+
+	// Compact leaves by groups of B::Width, returns the first leaf not generated
+	template<typename B>
+	static uint32_t generatePacked(const v2::Tree& tree, uint32_t first, uint32_t last, sf::Vertex* out, const uint8_t* visible)
+	{
+		using Float = typename B::Float;
+		using Vec = simd::Vec2xN<B>;
+		const v2::CompactLeaves& leaves = tree.compact_leaves;
+		const Float length_scale = B::set1(LeafLength * v2::CompactLeaves::SizeScale);
+		const Float width_scale = B::set1(0.5f * LeafWidth * v2::CompactLeaves::SizeScale);
+		float attach_x[B::Width];
+		float attach_y[B::Width];
+		// 1 for lanes of visible branches, 0 for the others
+		float lane_visible[B::Width];
+		float pts_x[B::Width][4];
+		float pts_y[B::Width][4];
+		uint32_t k(first);
+		for (; k + B::Width <= last; k += B::Width) {
+			sf::Vertex* quads = out + 4 * (k - first);
+			// Gather attach points
+			bool packet_visible = !visible;
+			for (uint32_t lane(0); lane < B::Width; ++lane) {
+				const uint32_t branch_id = leaves.getBranchId(k + lane);
+				const Vec2& attach = tree.branches[branch_id].nodes[leaves.getNodeId(k + lane)].position;
+				attach_x[lane] = attach.x;
+				attach_y[lane] = attach.y;
+				lane_visible[lane] = !visible || visible[branch_id] ? 1.0f : 0.0f;
+				packet_visible = packet_visible || visible[branch_id];
+			}
+			if (!packet_visible) {
+				for (uint32_t lane(0); lane < B::Width; ++lane) {
+					collapseQuad(quads + 4 * lane, Vec2(attach_x[lane], attach_y[lane]));
+				}
+				continue;
+			}
+
+			// Hidden lanes get a size of 0, their quads collapse on their attach points
+			const Float size = visible ? B::mul(B::loadUint8(&leaves.size[k]), B::load(lane_visible)) : B::loadUint8(&leaves.size[k]);
+			const Vec leaf_dir = Vec::load(&leaves.x[k], &leaves.y[k]).getNormalizedFast();
+			const Vec dir = leaf_dir * B::mul(size, length_scale);
+			const Vec nrm = leaf_dir.getNormal() * B::mul(size, width_scale);
+			const Vec attach = Vec::load(attach_x, attach_y);
+			storeCorner<B>(attach + nrm, 0, pts_x, pts_y);
+			storeCorner<B>(attach + nrm + dir, 1, pts_x, pts_y);
+			storeCorner<B>(attach - nrm + dir, 2, pts_x, pts_y);
+			storeCorner<B>(attach - nrm, 3, pts_x, pts_y);
+			for (uint32_t lane(0); lane < B::Width; ++lane) {
+				writeQuad(quads + 4 * lane, pts_x[lane], pts_y[lane]);
+			}
+		}
+		return k;
+	}
+
+	// Transposes a corner of every lane into the per leaf arrays
+	template<typename B>
+	static void storeCorner(const simd::Vec2xN<B>& corner, uint32_t corner_id, float pts_x[][4], float pts_y[][4])
+	{
+		float xs[B::Width];
+		float ys[B::Width];
+		corner.store(xs, ys);
+		for (uint32_t lane(0); lane < B::Width; ++lane) {
+			pts_x[lane][corner_id] = xs[lane];
+			pts_y[lane][corner_id] = ys[lane];
+		}
+	}
+
+#ifdef TREE2D_SIMD_X86
+	SIMD_TARGET_AVX2 SIMD_FLATTEN static uint32_t generateAvx2(const v2::Tree& tree, uint32_t first, uint32_t last, sf::Vertex* out, const uint8_t* visible)
+	{
+		return generatePacked<simd::Avx2Backend>(tree, first, last, out, visible);
+	}
+#endif
+};
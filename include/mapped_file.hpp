@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+
+// Read only view of a whole file, pages are loaded by the OS when first accessed
+class MappedFile
+{
+public:
+	MappedFile()
+		: m_data(nullptr)
+		, m_size(0)
+	{}
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& filename)
+	{
+		close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || !size.QuadPart) {
+			CloseHandle(file);
+			return false;
+		}
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (!mapping) {
+			return false;
+		}
+		void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		// The view keeps the mapping alive
+		CloseHandle(mapping);
+		if (!data) {
+			return false;
+		}
+		m_size = static_cast<uint64_t>(size.QuadPart);
+#else
+		const int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) || !info.st_size) {
+			::close(fd);
+			return false;
+		}
+		void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// The mapping keeps the file alive
+		::close(fd);
+		if (data == MAP_FAILED) {
+			return false;
+		}
+		m_size = static_cast<uint64_t>(info.st_size);
+#endif
+		m_data = static_cast<const uint8_t*>(data);
+		return true;
+	}
+
+	void close()
+	{
+		if (!m_data) {
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+#else
+		munmap(const_cast<uint8_t*>(m_data), static_cast<size_t>(m_size));
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+
+	const uint8_t* getData() const
+	{
+		return m_data;
+	}
+
+	uint64_t getSize() const
+	{
+		return m_size;
+	}
+
+private:
+	const uint8_t* m_data;
+	uint64_t m_size;
+};
@@ -1,14 +1,72 @@
 #pragma once
+#include <cstdint>
 #include <random>
 
 
+// Stateless mix used to derive seeds, see splitmix64
+uint64_t hashSeed(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+uint64_t hashSeed(uint64_t seed, uint64_t value)
+{
+	return hashSeed(seed ^ hashSeed(value));
+}
+
+
+// splitmix64, reseeding is free so that each branch of a tree can have its own draws
+class SplitMix64
+{
+public:
+	using result_type = uint64_t;
+
+	explicit SplitMix64(uint64_t seed = 0)
+		: m_state(seed)
+	{}
+
+	void seed(uint64_t seed)
+	{
+		m_state = seed;
+	}
+
+	uint64_t getState() const
+	{
+		return m_state;
+	}
+
+	result_type operator()()
+	{
+		const uint64_t x = m_state;
+		m_state += 0x9E3779B97F4A7C15ULL;
+		return hashSeed(x);
+	}
+
+	static constexpr result_type min()
+	{
+		return 0;
+	}
+
+	static constexpr result_type max()
+	{
+		return 0xFFFFFFFFFFFFFFFFULL;
+	}
+
+private:
+	uint64_t m_state;
+};
+
+
 template<typename T>
 class NumberGenerator
 {
 private:
 	std::random_device rd;
 	std::uniform_real_distribution<T> dis;
-	std::mt19937 gen;
+	SplitMix64 gen;
 
 public:
 	NumberGenerator()
@@ -26,6 +84,22 @@ public:
 
 	{}
 
+	void setSeed(uint64_t seed)
+	{
+		gen.seed(seed);
+	}
+
+	// The whole state, setState(getState()) resumes the sequence where it was
+	uint64_t getState() const
+	{
+		return gen.getState();
+	}
+
+	void setState(uint64_t state)
+	{
+		gen.seed(state);
+	}
+
 	float get()
 	{
 		return dis(gen);
@@ -52,9 +126,25 @@ template<typename T>
 class RNG
 {
 private:
-	static NumberGenerator<T> gen;
+	// One generator per thread so that trees can be built concurrently
+	static thread_local NumberGenerator<T> gen;
 
 public:
+	static void setSeed(uint64_t seed)
+	{
+		gen.setSeed(seed);
+	}
+
+	static uint64_t getState()
+	{
+		return gen.getState();
+	}
+
+	static void setState(uint64_t state)
+	{
+		gen.setState(state);
+	}
+
 	static T get()
 	{
 		return gen.get();
@@ -84,4 +174,4 @@ public:
 using RNGf = RNG<float>;
 
 template<typename T>
-NumberGenerator<T> RNG<T>::gen = NumberGenerator<T>();
+thread_local NumberGenerator<T> RNG<T>::gen = NumberGenerator<T>();
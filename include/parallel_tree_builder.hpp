@@ -0,0 +1,145 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <atomic>
+#include "swarm.hpp"
+#include "tree_builder.hpp"
+
+
+namespace v2
+{
+	// Builds a single tree on the swarm's threads, the result is the one TreeBuilder::build returns for the same seed
+	// The first levels are grown on the calling thread until there are enough subtrees, each of them is then grown
+	// by a worker in its own buffers, which are stitched level by level so that branches stay sorted by level
+	struct ParallelTreeBuilder
+	{
+		// Serial levels are grown until there are this many subtrees
+		static constexpr uint64_t MinSubtrees = 64;
+
+		struct Subtree
+		{
+			Tree tree;
+			TreeGrowth growth;
+		};
+
+		static Tree build(Vec2 position, const TreeConf& conf, uint64_t seed, swrm::Swarm& swarm)
+		{
+			TreeGrowth growth;
+			return build(position, conf, seed, growth, swarm);
+		}
+
+		static Tree build(Vec2 position, const TreeConf& conf, uint64_t seed, TreeGrowth& growth, swrm::Swarm& swarm)
+		{
+			PROFILE_SCOPE("ParallelTreeBuilder::build");
+			ALLOC_SCOPE(alloc::Builder);
+			TreeBuilder::plant(growth, position, conf, seed);
+			Tree tree;
+			// Serial levels, the branches of the next one are queued in [serial_count, growth.branches.size())
+			uint64_t scaffold_memory = 0;
+			while (tree.branches.size() < growth.branches.size() && growth.branches.size() - tree.branches.size() < MinSubtrees) {
+				TreeBuilder::grow(tree, growth, conf, growth.branches.size());
+				scaffold_memory = std::max(scaffold_memory, tree.scaffold_memory);
+			}
+			tree.scaffold_memory = scaffold_memory;
+			const uint64_t serial_count = tree.branches.size();
+			std::vector<Subtree> subtrees(growth.branches.size() - serial_count);
+			for (uint64_t i(0); i < subtrees.size(); ++i) {
+				subtrees[i].growth.conf = conf;
+				subtrees[i].growth.seed = seed;
+				subtrees[i].growth.branches.assign(1, growth.branches[serial_count + i]);
+			}
+			growSubtrees(subtrees, conf, swarm);
+
+			for (uint64_t i(0); i < serial_count; ++i) {
+				tree.branches[i].initializePhysics();
+				tree.branches[i].computeBoundingBox();
+			}
+			stitch(tree, growth, subtrees);
+			// Leaves are cheap next to the branches, adding them once here saves copying them out of the subtrees
+			TreeBuilder::addLeaves(tree, growth, 0);
+			tree.indexLeaves();
+			tree.mergeBoundingBoxes();
+			return tree;
+		}
+
+	private:
+		// Subtrees are picked in order by idle workers, the first ones are the largest as they split lower on the trunk
+		static void growSubtrees(std::vector<Subtree>& subtrees, const TreeConf& conf, swrm::Swarm& swarm)
+		{
+			struct Context
+			{
+				std::vector<Subtree>& subtrees;
+				const TreeConf& conf;
+				std::atomic<uint32_t> next_subtree;
+			};
+			Context context{subtrees, conf, {0}};
+			// A single capture keeps the job in std::function's local storage
+			swarm.execute([&context](uint32_t, uint32_t) {
+				PROFILE_SCOPE("ParallelTreeBuilder::growSubtrees");
+				ALLOC_SCOPE(alloc::Builder);
+				const uint32_t subtrees_count = static_cast<uint32_t>(context.subtrees.size());
+				for (uint32_t i(context.next_subtree++); i < subtrees_count; i = context.next_subtree++) {
+					Subtree& subtree = context.subtrees[i];
+					// Branch ids are local, the subtree's root keeps its parent in the serial levels
+					TreeBuilder::grow(subtree.tree, subtree.growth, context.conf);
+					for (Branch& b : subtree.tree.branches) {
+						b.initializePhysics();
+						b.computeBoundingBox();
+					}
+				}
+			}).waitExecutionDone();
+		}
+
+		// Level by level, the branches of each subtree come after those of the previous ones like they would in a single pass
+		static void stitch(Tree& tree, TreeGrowth& growth, std::vector<Subtree>& subtrees)
+		{
+			PROFILE_SCOPE("ParallelTreeBuilder::stitch");
+			const uint64_t serial_count = tree.branches.size();
+			const uint64_t subtrees_count = subtrees.size();
+			// Global id of each subtree's branches, and the subtree and local id of each global branch
+			std::vector<std::vector<uint32_t>> global_ids(subtrees_count);
+			std::vector<uint32_t> source_subtrees;
+			std::vector<uint32_t> source_branches;
+			std::vector<uint32_t> cursors(subtrees_count, 0);
+			uint64_t total = serial_count;
+			for (uint64_t i(0); i < subtrees_count; ++i) {
+				global_ids[i].resize(subtrees[i].tree.branches.size());
+				total += global_ids[i].size();
+			}
+			source_subtrees.reserve(total - serial_count);
+			source_branches.reserve(total - serial_count);
+			uint32_t next_id = static_cast<uint32_t>(serial_count);
+			for (uint32_t level(subtrees_count ? subtrees.front().tree.branches.front().level : 0); next_id < total; ++level) {
+				for (uint32_t i(0); i < subtrees_count; ++i) {
+					const std::vector<Branch>& branches = subtrees[i].tree.branches;
+					uint32_t& cursor = cursors[i];
+					while (cursor < branches.size() && branches[cursor].level == level) {
+						global_ids[i][cursor] = next_id++;
+						source_subtrees.push_back(i);
+						source_branches.push_back(cursor);
+						++cursor;
+					}
+				}
+			}
+
+			// Moved in their final order, the queued roots are replaced by their subtrees
+			tree.branches.reserve(total);
+			growth.branches.resize(serial_count);
+			growth.branches.reserve(total);
+			for (uint64_t i(0); i < total - serial_count; ++i) {
+				const uint32_t subtree_id = source_subtrees[i];
+				const uint32_t local_id = source_branches[i];
+				Subtree& subtree = subtrees[subtree_id];
+				tree.branches.push_back(std::move(subtree.tree.branches[local_id]));
+				growth.branches.push_back(subtree.growth.branches[local_id]);
+				if (local_id) {
+					const uint32_t parent_id = global_ids[subtree_id][tree.branches.back().root.branch_id];
+					tree.branches.back().root.branch_id = parent_id;
+					growth.branches.back().root.branch_id = parent_id;
+				}
+			}
+			for (const Subtree& subtree : subtrees) {
+				tree.scaffold_memory = std::max(tree.scaffold_memory, subtree.tree.scaffold_memory);
+			}
+		}
+	};
+}
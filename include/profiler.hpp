@@ -0,0 +1,280 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Zones compile to nothing unless TREE2D_PROFILER is defined
+#ifdef TREE2D_PROFILER
+	#define PROFILER_CONCAT_IMPL(a, b) a##b
+	#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_IMPL(a, b)
+	#define PROFILE_SCOPE(name) \
+		static const uint32_t PROFILER_CONCAT(profiler_zone_, __LINE__) = prof::Profiler::get().registerZone(name); \
+		prof::ScopedZone PROFILER_CONCAT(profiler_scope_, __LINE__)(PROFILER_CONCAT(profiler_zone_, __LINE__))
+#else
+	#define PROFILE_SCOPE(name)
+#endif
+
+
+namespace prof
+{
+	struct Event
+	{
+		uint32_t zone;
+		int64_t start;
+		int64_t end;
+	};
+
+	// Written by a single thread, read by the collector
+	struct ThreadBuffer
+	{
+		static constexpr uint32_t Capacity = 1 << 14;
+
+		uint32_t thread_id;
+		std::vector<Event> events;
+		std::atomic<uint64_t> head;
+		uint64_t collected;
+
+		ThreadBuffer(uint32_t id)
+			: thread_id(id)
+			, events(Capacity)
+			, head(0)
+			, collected(0)
+		{}
+
+		void push(const Event& e)
+		{
+			const uint64_t h = head.load(std::memory_order_relaxed);
+			events[h % Capacity] = e;
+			head.store(h + 1, std::memory_order_release);
+		}
+	};
+
+	struct ZoneStats
+	{
+		float p50;
+		float p95;
+		float p99;
+		float max;
+		uint64_t count;
+
+		ZoneStats()
+			: p50(0.0f)
+			, p95(0.0f)
+			, p99(0.0f)
+			, max(0.0f)
+			, count(0)
+		{}
+	};
+
+	class Profiler
+	{
+	public:
+		// Durations, in microseconds, used for the rolling statistics
+		static constexpr uint32_t WindowSize = 512;
+
+		static Profiler& get()
+		{
+			static Profiler profiler;
+			return profiler;
+		}
+
+		uint32_t registerZone(const std::string& name)
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			for (uint32_t i(0); i < m_zones.size(); ++i) {
+				if (m_zones[i].name == name) {
+					return i;
+				}
+			}
+			m_zones.emplace_back(name);
+			return static_cast<uint32_t>(m_zones.size() - 1);
+		}
+
+		int64_t now() const
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+		}
+
+		void record(uint32_t zone, int64_t start, int64_t end)
+		{
+			thread_local BufferHandle handle;
+			if (!handle.buffer) {
+				handle.buffer = acquireBuffer();
+			}
+			handle.buffer->push({zone, start, end});
+		}
+
+		// Feeds the rolling windows with the events recorded since last call, typically once per frame
+		void collect()
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			for (const std::unique_ptr<ThreadBuffer>& buffer : m_buffers) {
+				const uint64_t head = buffer->head.load(std::memory_order_acquire);
+				uint64_t first = buffer->collected;
+				if (head - first > ThreadBuffer::Capacity) {
+					first = head - ThreadBuffer::Capacity;
+				}
+				for (uint64_t i(first); i < head; ++i) {
+					const Event& e = buffer->events[i % ThreadBuffer::Capacity];
+					// Slots being overwritten can be torn
+					if (e.zone >= m_zones.size()) {
+						continue;
+					}
+					m_zones[e.zone].add(static_cast<float>(e.end - e.start) * 0.001f);
+				}
+				buffer->collected = head;
+			}
+		}
+
+		ZoneStats getStats(const std::string& name)
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			for (const Zone& zone : m_zones) {
+				if (zone.name == name) {
+					return zone.getStats(m_samples);
+				}
+			}
+			return ZoneStats();
+		}
+
+		// Last events of every thread in the Chrome trace event format (chrome://tracing, Perfetto)
+		bool exportChromeTrace(const std::string& filename)
+		{
+			std::FILE* file = std::fopen(filename.c_str(), "w");
+			if (!file) {
+				return false;
+			}
+
+			std::lock_guard<std::mutex> lg(m_mutex);
+			std::fprintf(file, "{\"traceEvents\":[");
+			bool first_event = true;
+			for (const std::unique_ptr<ThreadBuffer>& buffer : m_buffers) {
+				const uint64_t head = buffer->head.load(std::memory_order_acquire);
+				const uint64_t first = head > ThreadBuffer::Capacity ? head - ThreadBuffer::Capacity : 0;
+				for (uint64_t i(first); i < head; ++i) {
+					const Event& e = buffer->events[i % ThreadBuffer::Capacity];
+					if (e.zone >= m_zones.size()) {
+						continue;
+					}
+					std::fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u}",
+						first_event ? "" : ",", m_zones[e.zone].name.c_str(), e.start * 0.001, (e.end - e.start) * 0.001, buffer->thread_id);
+					first_event = false;
+				}
+			}
+			std::fprintf(file, "\n]}\n");
+			std::fclose(file);
+			return true;
+		}
+
+	private:
+		struct Zone
+		{
+			std::string name;
+			std::vector<float> window;
+			uint64_t count;
+
+			Zone(const std::string& zone_name)
+				: name(zone_name)
+				, window(WindowSize, 0.0f)
+				, count(0)
+			{}
+
+			void add(float duration)
+			{
+				window[count % WindowSize] = duration;
+				++count;
+			}
+
+			ZoneStats getStats(std::vector<float>& samples) const
+			{
+				ZoneStats stats;
+				stats.count = count;
+				const uint64_t samples_count = std::min<uint64_t>(count, WindowSize);
+				if (!samples_count) {
+					return stats;
+				}
+				samples.assign(window.begin(), window.begin() + samples_count);
+				std::sort(samples.begin(), samples.end());
+				const auto percentile = [&samples](float p) {
+					return samples[static_cast<uint64_t>(p * (samples.size() - 1))];
+				};
+				stats.p50 = percentile(0.50f);
+				stats.p95 = percentile(0.95f);
+				stats.p99 = percentile(0.99f);
+				stats.max = samples.back();
+				return stats;
+			}
+		};
+
+		// Returns the thread's buffer to the pool when the thread exits
+		struct BufferHandle
+		{
+			ThreadBuffer* buffer;
+
+			BufferHandle()
+				: buffer(nullptr)
+			{}
+
+			~BufferHandle()
+			{
+				if (buffer) {
+					Profiler::get().releaseBuffer(buffer);
+				}
+			}
+		};
+
+		const std::chrono::steady_clock::time_point m_start;
+		std::mutex m_mutex;
+		std::vector<Zone> m_zones;
+		std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+		std::vector<ThreadBuffer*> m_free_buffers;
+		// Reused to keep statistics queries allocation free
+		std::vector<float> m_samples;
+
+		Profiler()
+			: m_start(std::chrono::steady_clock::now())
+		{}
+
+		ThreadBuffer* acquireBuffer()
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			if (!m_free_buffers.empty()) {
+				ThreadBuffer* buffer = m_free_buffers.back();
+				m_free_buffers.pop_back();
+				return buffer;
+			}
+			m_buffers.emplace_back(new ThreadBuffer(static_cast<uint32_t>(m_buffers.size())));
+			return m_buffers.back().get();
+		}
+
+		void releaseBuffer(ThreadBuffer* buffer)
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			m_free_buffers.push_back(buffer);
+		}
+	};
+
+	struct ScopedZone
+	{
+		const uint32_t zone;
+		const int64_t start;
+
+		ScopedZone(uint32_t zone_id)
+			: zone(zone_id)
+			, start(Profiler::get().now())
+		{}
+
+		~ScopedZone()
+		{
+			Profiler& profiler = Profiler::get();
+			profiler.record(zone, start, profiler.now());
+		}
+	};
+}
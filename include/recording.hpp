@@ -0,0 +1,719 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "tree.hpp"
+#include "mapped_file.hpp"
+#include "profiler.hpp"
+
+
+// Simulation recordings, a topology header followed by one chunk per frame
+// Each branch is stored as a rigid transform of its rest pose (root position and angle of its chord)
+// and each leaf as the angle of its direction, all quantized
+// Chunks hold these values either absolute (keyframes, to seek) or as deltas against the previous frame
+// Numbers are stored little endian, in the host's order
+namespace rec
+{
+	constexpr char Magic[4] = {'T', '2', 'D', 'R'};
+	constexpr uint32_t Version = 1;
+	// Positions are stored in 1/16 of a unit
+	constexpr float PositionStep = 1.0f / 16.0f;
+	// Angles are stored as fractions of a turn
+	constexpr uint32_t BranchAngleBits = 16;
+	constexpr uint32_t LeafAngleBits = 12;
+
+	enum ChunkType : uint32_t
+	{
+		Keyframe = 1,
+		Delta = 2
+	};
+
+	struct ChunkHeader
+	{
+		uint32_t type;
+		uint32_t frame;
+		// Bytes of payload following the header
+		uint32_t size;
+	};
+
+	struct ByteWriter
+	{
+		std::vector<uint8_t> data;
+
+		template<typename T>
+		void put(T value)
+		{
+			const uint64_t offset = data.size();
+			data.resize(offset + sizeof(T));
+			std::memcpy(&data[offset], &value, sizeof(T));
+		}
+
+		void putVarint(uint64_t value)
+		{
+			while (value >= 0x80) {
+				data.push_back(static_cast<uint8_t>(value | 0x80));
+				value >>= 7;
+			}
+			data.push_back(static_cast<uint8_t>(value));
+		}
+	};
+
+	struct ByteReader
+	{
+		const uint8_t* current;
+		const uint8_t* end;
+
+		ByteReader(const uint8_t* begin, const uint8_t* end_)
+			: current(begin)
+			, end(end_)
+		{}
+
+		bool canRead(uint64_t size) const
+		{
+			return static_cast<uint64_t>(end - current) >= size;
+		}
+
+		template<typename T>
+		T get()
+		{
+			T value;
+			std::memcpy(&value, current, sizeof(T));
+			current += sizeof(T);
+			return value;
+		}
+
+		uint64_t getVarint()
+		{
+			uint64_t value = 0;
+			for (uint32_t shift(0); current < end && shift < 64; shift += 7) {
+				const uint8_t byte = *current++;
+				value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+				if (!(byte & 0x80)) {
+					break;
+				}
+			}
+			return value;
+		}
+	};
+
+	uint64_t zigzag(int32_t value)
+	{
+		return static_cast<uint32_t>((value << 1) ^ (value >> 31));
+	}
+
+	int32_t unzigzag(uint64_t value)
+	{
+		return static_cast<int32_t>(static_cast<uint32_t>(value >> 1) ^ (0U - static_cast<uint32_t>(value & 1)));
+	}
+
+	// Difference of two angles of the given precision, in [-half turn, half turn)
+	int32_t wrapDelta(int32_t delta, uint32_t bits)
+	{
+		const uint32_t mask = (1U << bits) - 1;
+		const int32_t half = 1 << (bits - 1);
+		return static_cast<int32_t>((static_cast<uint32_t>(delta + half) & mask)) - half;
+	}
+
+	// Values are zigzag coded, a run of zeros takes a single token
+	// Tokens are varints, the lowest bit tells runs from values
+	void encodeValues(const std::vector<int32_t>& values, ByteWriter& out)
+	{
+		uint64_t zeros = 0;
+		for (const int32_t v : values) {
+			if (!v) {
+				++zeros;
+				continue;
+			}
+			if (zeros) {
+				out.putVarint((zeros << 1) | 1);
+				zeros = 0;
+			}
+			out.putVarint(zigzag(v) << 1);
+		}
+		if (zeros) {
+			out.putVarint((zeros << 1) | 1);
+		}
+	}
+
+	// Returns false if the payload doesn't hold values.size() values
+	bool decodeValues(ByteReader& in, std::vector<int32_t>& values)
+	{
+		const uint64_t count = values.size();
+		uint64_t i(0);
+		while (i < count && in.current < in.end) {
+			const uint64_t token = in.getVarint();
+			if (token & 1) {
+				const uint64_t zeros = token >> 1;
+				if (zeros > count - i) {
+					return false;
+				}
+				std::fill(values.begin() + i, values.begin() + i + zeros, 0);
+				i += zeros;
+			}
+			else {
+				values[i++] = unzigzag(token >> 1);
+			}
+		}
+		return i == count;
+	}
+
+	int32_t roundInt(float v)
+	{
+		return v >= 0.0f ? static_cast<int32_t>(v + 0.5f) : -static_cast<int32_t>(0.5f - v);
+	}
+
+	// Polynomial atan2, error under 1e-5 rad, far below the quantization steps
+	float fastAtan2(float y, float x)
+	{
+		const float ax = std::abs(x);
+		const float ay = std::abs(y);
+		const float max = std::max(ax, ay);
+		if (max == 0.0f) {
+			return 0.0f;
+		}
+		const float a = std::min(ax, ay) / max;
+		const float s = a * a;
+		float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + s * (-0.11643287f + s * (0.05265332f + s * -0.01172120f)))));
+		if (ay > ax) {
+			r = 0.5f * PI - r;
+		}
+		if (x < 0.0f) {
+			r = PI - r;
+		}
+		return y < 0.0f ? -r : r;
+	}
+
+	int32_t quantizeAngle(float angle, uint32_t bits)
+	{
+		const float turns = angle / (2.0f * PI);
+		return roundInt(turns * (1 << bits)) & ((1 << bits) - 1);
+	}
+
+	float dequantizeAngle(int32_t value, uint32_t bits)
+	{
+		return value * (2.0f * PI) / (1 << bits);
+	}
+
+	// Offsets of each node to the first one, in the frame where the branch's chord is along +x
+	void getRestPose(const v2::Branch& b, std::vector<Vec2>& rest)
+	{
+		const Vec2 origin = b.nodes.front().position;
+		const Vec2 chord = b.nodes.back().position - origin;
+		const RotMat2 mat(-std::atan2(chord.y, chord.x));
+		for (const v2::Node& n : b.nodes) {
+			Vec2 offset = n.position - origin;
+			offset.rotate(mat);
+			rest.push_back(offset);
+		}
+	}
+
+
+	// Appends a frame of a fixed set of trees to a file at each call
+	// Topology can't change while recording, a new recording has to be started when it does
+	class Recorder
+	{
+	public:
+		Recorder()
+			: m_file(nullptr)
+			, m_keyframe_interval(0)
+			, m_frames_count(0)
+			, m_bytes_written(0)
+		{}
+
+		~Recorder()
+		{
+			close();
+		}
+
+		// Trees have to outlive the recording, their leaves indexed by branch
+		bool open(const std::string& filename, const std::vector<const v2::Tree*>& trees, float dt, uint32_t keyframe_interval = 120)
+		{
+			close();
+			for (const v2::Tree* tree : trees) {
+				if (tree->leaves_offsets.size() != tree->branches.size() + 1 || tree->leaves_offsets.back() != tree->getLeavesCount()) {
+					return false;
+				}
+			}
+			m_file = std::fopen(filename.c_str(), "wb");
+			if (!m_file) {
+				return false;
+			}
+			m_trees = trees;
+			m_keyframe_interval = std::max(1U, keyframe_interval);
+			m_frames_count = 0;
+			m_bytes_written = 0;
+
+			ByteWriter header;
+			for (const char c : Magic) {
+				header.put(c);
+			}
+			header.put(Version);
+			header.put(dt);
+			header.put(m_keyframe_interval);
+			header.put(static_cast<uint32_t>(trees.size()));
+			uint64_t values_count(0);
+			std::vector<Vec2> rest;
+			for (const v2::Tree* tree : trees) {
+				const uint32_t leaves_count = static_cast<uint32_t>(tree->getLeavesCount());
+				header.put(static_cast<uint32_t>(tree->branches.size()));
+				header.put(leaves_count);
+				for (const v2::Branch& b : tree->branches) {
+					rest.clear();
+					getRestPose(b, rest);
+					header.put(static_cast<uint32_t>(b.nodes.size()));
+					for (uint64_t i(0); i < b.nodes.size(); ++i) {
+						header.put(rest[i].x);
+						header.put(rest[i].y);
+						header.put(b.nodes[i].width);
+					}
+				}
+				for (uint32_t k(0); k < leaves_count; ++k) {
+					header.put(getLeafBranch(*tree, k));
+					header.put(getLeafNode(*tree, k));
+					header.put(tree->compact ? tree->compact_leaves.hue[k] : tree->leaves[k].color.g);
+					header.put(tree->compact ? tree->compact_leaves.getSize(k) : tree->leaves[k].size);
+				}
+				values_count += 3 * tree->branches.size() + leaves_count;
+			}
+			m_current.resize(values_count);
+			m_previous.resize(values_count);
+			m_deltas.resize(values_count);
+			write(header.data);
+			return true;
+		}
+
+		void recordFrame()
+		{
+			if (!m_file) {
+				return;
+			}
+			PROFILE_SCOPE("Recorder::recordFrame");
+			quantize();
+			const bool keyframe = !(m_frames_count % m_keyframe_interval);
+			m_chunk.data.clear();
+			m_chunk.put(ChunkHeader{keyframe ? Keyframe : Delta, m_frames_count, 0});
+			if (keyframe) {
+				encodeValues(m_current, m_chunk);
+			}
+			else {
+				computeDeltas();
+				encodeValues(m_deltas, m_chunk);
+			}
+			const uint32_t payload_size = static_cast<uint32_t>(m_chunk.data.size() - sizeof(ChunkHeader));
+			std::memcpy(&m_chunk.data[offsetof(ChunkHeader, size)], &payload_size, sizeof(payload_size));
+			write(m_chunk.data);
+			// A crash loses at most the frames since the last keyframe
+			if (keyframe) {
+				std::fflush(m_file);
+			}
+			m_previous.swap(m_current);
+			++m_frames_count;
+		}
+
+		void close()
+		{
+			if (m_file) {
+				std::fclose(m_file);
+				m_file = nullptr;
+			}
+		}
+
+		bool isOpen() const
+		{
+			return m_file != nullptr;
+		}
+
+		uint32_t getFramesCount() const
+		{
+			return m_frames_count;
+		}
+
+		uint64_t getBytesWritten() const
+		{
+			return m_bytes_written;
+		}
+
+	private:
+		std::FILE* m_file;
+		std::vector<const v2::Tree*> m_trees;
+		uint32_t m_keyframe_interval;
+		uint32_t m_frames_count;
+		uint64_t m_bytes_written;
+		std::vector<int32_t> m_current;
+		std::vector<int32_t> m_previous;
+		std::vector<int32_t> m_deltas;
+		ByteWriter m_chunk;
+
+		static uint32_t getLeafBranch(const v2::Tree& tree, uint32_t k)
+		{
+			return tree.compact ? tree.compact_leaves.getBranchId(k) : tree.leaves[k].attach.branch_id;
+		}
+
+		static uint32_t getLeafNode(const v2::Tree& tree, uint32_t k)
+		{
+			return tree.compact ? tree.compact_leaves.getNodeId(k) : tree.leaves[k].attach.node_id;
+		}
+
+		void write(const std::vector<uint8_t>& data)
+		{
+			m_bytes_written += std::fwrite(data.data(), 1, data.size(), m_file);
+		}
+
+		void quantize()
+		{
+			uint64_t i(0);
+			for (const v2::Tree* tree : m_trees) {
+				for (const v2::Branch& b : tree->branches) {
+					const Vec2 origin = b.nodes.front().position;
+					const Vec2 chord = b.nodes.back().position - origin;
+					m_current[i++] = roundInt(origin.x / PositionStep);
+					m_current[i++] = roundInt(origin.y / PositionStep);
+					m_current[i++] = quantizeAngle(fastAtan2(chord.y, chord.x), BranchAngleBits);
+				}
+				const uint64_t leaves_count = tree->getLeavesCount();
+				for (uint64_t k(0); k < leaves_count; ++k) {
+					const Vec2 dir = tree->compact ? tree->compact_leaves.getDir(k) : tree->leaves[k].getDir();
+					m_current[i++] = quantizeAngle(fastAtan2(dir.y, dir.x), LeafAngleBits);
+				}
+			}
+		}
+
+		void computeDeltas()
+		{
+			uint64_t i(0);
+			for (const v2::Tree* tree : m_trees) {
+				const uint64_t branches_end = i + 3 * tree->branches.size();
+				for (; i < branches_end; i += 3) {
+					m_deltas[i] = m_current[i] - m_previous[i];
+					m_deltas[i + 1] = m_current[i + 1] - m_previous[i + 1];
+					m_deltas[i + 2] = wrapDelta(m_current[i + 2] - m_previous[i + 2], BranchAngleBits);
+				}
+				const uint64_t leaves_end = i + tree->getLeavesCount();
+				for (; i < leaves_end; ++i) {
+					m_deltas[i] = wrapDelta(m_current[i] - m_previous[i], LeafAngleBits);
+				}
+			}
+		}
+	};
+
+
+	// Plays a recording back from a memory mapped file, trees are rebuilt from the header and only their state is decoded
+	// The trees can be given to TreeRenderer as is, they have no physics
+	class Player
+	{
+	public:
+		Player()
+			: m_dt(0.016f)
+			, m_frame(0)
+			, m_decoded(false)
+		{}
+
+		bool open(const std::string& filename)
+		{
+			m_trees.clear();
+			m_rest.clear();
+			m_chunks.clear();
+			m_decoded = false;
+			m_frame = 0;
+			if (!m_file.open(filename)) {
+				return false;
+			}
+			ByteReader in(m_file.getData(), m_file.getData() + m_file.getSize());
+			if (!readHeader(in)) {
+				m_file.close();
+				return false;
+			}
+			indexChunks(in);
+
+			m_cos.resize(1 << LeafAngleBits);
+			m_sin.resize(1 << LeafAngleBits);
+			for (uint32_t i(0); i < m_cos.size(); ++i) {
+				const float angle = dequantizeAngle(i, LeafAngleBits);
+				m_cos[i] = std::cos(angle);
+				m_sin[i] = std::sin(angle);
+			}
+			return !m_chunks.empty() && seek(0);
+		}
+
+		// Decodes the following frame, returns false at the end of the recording
+		bool next()
+		{
+			if (m_frame + 1 >= m_chunks.size()) {
+				return false;
+			}
+			if (!decodeChunk(m_frame + 1)) {
+				return false;
+			}
+			++m_frame;
+			apply();
+			return true;
+		}
+
+		// Decodes from the closest previous keyframe
+		bool seek(uint32_t frame)
+		{
+			if (frame >= m_chunks.size()) {
+				return false;
+			}
+			uint32_t key = frame;
+			while (m_chunks[key].type != Keyframe) {
+				if (!key) {
+					return false;
+				}
+				--key;
+			}
+			// Going forward from the current frame is cheaper when it's after the keyframe
+			uint32_t first = key;
+			if (m_decoded && m_frame >= key && m_frame <= frame) {
+				first = m_frame + 1;
+			}
+			for (uint32_t i(first); i <= frame; ++i) {
+				if (!decodeChunk(i)) {
+					m_decoded = false;
+					return false;
+				}
+			}
+			m_decoded = true;
+			m_frame = frame;
+			apply();
+			return true;
+		}
+
+		const std::vector<v2::Tree>& getTrees() const
+		{
+			return m_trees;
+		}
+
+		uint32_t getFrame() const
+		{
+			return m_frame;
+		}
+
+		uint32_t getFramesCount() const
+		{
+			return static_cast<uint32_t>(m_chunks.size());
+		}
+
+		float getDt() const
+		{
+			return m_dt;
+		}
+
+	private:
+		struct Chunk
+		{
+			uint32_t type;
+			const uint8_t* payload;
+			uint32_t size;
+		};
+
+		MappedFile m_file;
+		float m_dt;
+		std::vector<v2::Tree> m_trees;
+		// Rest pose of every branch's nodes, for all trees
+		std::vector<Vec2> m_rest;
+		// Chunk i holds frame i, complete chunks only
+		std::vector<Chunk> m_chunks;
+		std::vector<int32_t> m_values;
+		std::vector<int32_t> m_deltas;
+		std::vector<float> m_cos;
+		std::vector<float> m_sin;
+		uint32_t m_frame;
+		bool m_decoded;
+
+		bool readHeader(ByteReader& in)
+		{
+			const uint64_t fixed_size = sizeof(Magic) + 4 * sizeof(uint32_t);
+			if (!in.canRead(fixed_size) || std::memcmp(in.current, Magic, sizeof(Magic))) {
+				return false;
+			}
+			in.current += sizeof(Magic);
+			if (in.get<uint32_t>() != Version) {
+				return false;
+			}
+			m_dt = in.get<float>();
+			in.get<uint32_t>();
+			const uint32_t trees_count = in.get<uint32_t>();
+			uint64_t values_count(0);
+			for (uint32_t t(0); t < trees_count; ++t) {
+				if (!in.canRead(2 * sizeof(uint32_t))) {
+					return false;
+				}
+				const uint32_t branches_count = in.get<uint32_t>();
+				const uint32_t leaves_count = in.get<uint32_t>();
+				m_trees.emplace_back();
+				v2::Tree& tree = m_trees.back();
+				tree.branches.resize(branches_count);
+				for (v2::Branch& b : tree.branches) {
+					if (!in.canRead(sizeof(uint32_t))) {
+						return false;
+					}
+					const uint32_t nodes_count = in.get<uint32_t>();
+					if (!nodes_count || !in.canRead(uint64_t(nodes_count) * 3 * sizeof(float))) {
+						return false;
+					}
+					b.nodes.resize(nodes_count);
+					for (v2::Node& n : b.nodes) {
+						const float x = in.get<float>();
+						const float y = in.get<float>();
+						m_rest.emplace_back(x, y);
+						n.width = in.get<float>();
+					}
+				}
+				if (!readLeaves(in, tree, leaves_count)) {
+					return false;
+				}
+				values_count += 3 * uint64_t(branches_count) + leaves_count;
+			}
+			m_values.assign(values_count, 0);
+			m_deltas.resize(values_count);
+			return true;
+		}
+
+		bool readLeaves(ByteReader& in, v2::Tree& tree, uint32_t leaves_count)
+		{
+			const uint64_t leaf_size = 2 * sizeof(uint32_t) + sizeof(uint8_t) + sizeof(float);
+			if (!in.canRead(leaf_size * leaves_count)) {
+				return false;
+			}
+			const uint32_t branches_count = static_cast<uint32_t>(tree.branches.size());
+			const ByteReader start = in;
+			bool packable = true;
+			for (uint32_t k(0); k < leaves_count; ++k) {
+				const uint32_t branch_id = in.get<uint32_t>();
+				const uint32_t node_id = in.get<uint32_t>();
+				in.current += sizeof(uint8_t) + sizeof(float);
+				if (branch_id >= branches_count || node_id >= tree.branches[branch_id].nodes.size()) {
+					return false;
+				}
+				packable = packable && v2::CompactLeaves::canPack(branch_id, node_id);
+			}
+
+			// Compact leaves are cheaper to decode into, they don't have to follow their node
+			in = start;
+			tree.leaves_offsets.assign(branches_count + 1, 0);
+			tree.max_leaf_size = 0.0f;
+			for (uint32_t k(0); k < leaves_count; ++k) {
+				const uint32_t branch_id = in.get<uint32_t>();
+				const uint32_t node_id = in.get<uint32_t>();
+				const uint8_t hue = in.get<uint8_t>();
+				const float size = in.get<float>();
+				if (packable) {
+					tree.compact_leaves.add(Vec2(1.0f, 0.0f), Vec2(1.0f, 0.0f), branch_id, node_id, Vec2(), hue, size);
+				}
+				else {
+					tree.leaves.emplace_back(v2::NodeRef(branch_id, node_id), Vec2(1.0f, 0.0f));
+					tree.leaves.back().color = sf::Color(255, hue, 0);
+					tree.leaves.back().size = size;
+				}
+				++tree.leaves_offsets[branch_id + 1];
+				tree.max_leaf_size = std::max(tree.max_leaf_size, size);
+			}
+			tree.compact = packable;
+			for (uint64_t i(1); i < tree.leaves_offsets.size(); ++i) {
+				tree.leaves_offsets[i] += tree.leaves_offsets[i - 1];
+			}
+			return true;
+		}
+
+		// A truncated last chunk, from an interrupted recording, is ignored
+		void indexChunks(ByteReader& in)
+		{
+			while (in.canRead(sizeof(ChunkHeader))) {
+				const ChunkHeader header = in.get<ChunkHeader>();
+				if (!in.canRead(header.size) || header.frame != m_chunks.size()) {
+					break;
+				}
+				m_chunks.push_back(Chunk{header.type, in.current, header.size});
+				in.current += header.size;
+			}
+		}
+
+		bool decodeChunk(uint32_t frame)
+		{
+			PROFILE_SCOPE("Player::decodeChunk");
+			const Chunk& chunk = m_chunks[frame];
+			ByteReader in(chunk.payload, chunk.payload + chunk.size);
+			if (chunk.type == Keyframe) {
+				if (!decodeValues(in, m_values)) {
+					return false;
+				}
+				// Leaf angles index the cos and sin tables, a corrupt keyframe must not read past them
+				uint64_t i(0);
+				for (const v2::Tree& tree : m_trees) {
+					const uint64_t branches_end = i + 3 * tree.branches.size();
+					for (; i < branches_end; i += 3) {
+						m_values[i + 2] &= (1 << BranchAngleBits) - 1;
+					}
+					const uint64_t leaves_end = i + tree.getLeavesCount();
+					for (; i < leaves_end; ++i) {
+						m_values[i] &= (1 << LeafAngleBits) - 1;
+					}
+				}
+				return true;
+			}
+			if (!decodeValues(in, m_deltas)) {
+				return false;
+			}
+			uint64_t i(0);
+			for (const v2::Tree& tree : m_trees) {
+				const uint64_t branches_end = i + 3 * tree.branches.size();
+				for (; i < branches_end; i += 3) {
+					m_values[i] += m_deltas[i];
+					m_values[i + 1] += m_deltas[i + 1];
+					m_values[i + 2] = (m_values[i + 2] + m_deltas[i + 2]) & ((1 << BranchAngleBits) - 1);
+				}
+				const uint64_t leaves_end = i + tree.getLeavesCount();
+				for (; i < leaves_end; ++i) {
+					m_values[i] = (m_values[i] + m_deltas[i]) & ((1 << LeafAngleBits) - 1);
+				}
+			}
+			return true;
+		}
+
+		// Moves the trees to the decoded state
+		void apply()
+		{
+			PROFILE_SCOPE("Player::apply");
+			uint64_t i(0);
+			uint64_t rest_i(0);
+			for (v2::Tree& tree : m_trees) {
+				tree.bbox.reset();
+				for (v2::Branch& b : tree.branches) {
+					const Vec2 origin(m_values[i] * PositionStep, m_values[i + 1] * PositionStep);
+					const RotMat2 mat(dequantizeAngle(m_values[i + 2], BranchAngleBits));
+					i += 3;
+					for (v2::Node& n : b.nodes) {
+						Vec2 offset = m_rest[rest_i++];
+						offset.rotate(mat);
+						n.position = origin + offset;
+					}
+					b.computeBoundingBox();
+					tree.bbox.merge(b.bbox);
+				}
+
+				const uint64_t leaves_count = tree.getLeavesCount();
+				if (tree.compact) {
+					v2::CompactLeaves& leaves = tree.compact_leaves;
+					for (uint64_t k(0); k < leaves_count; ++k, ++i) {
+						leaves.x[k] = m_cos[m_values[i]];
+						leaves.y[k] = m_sin[m_values[i]];
+					}
+					continue;
+				}
+				for (uint64_t k(0); k < leaves_count; ++k, ++i) {
+					v2::Leaf& l = tree.leaves[k];
+					const Vec2 attach = tree.branches[l.attach.branch_id].nodes[l.attach.node_id].position;
+					l.attach.position = attach;
+					l.free_particule.position = attach + Vec2(m_cos[m_values[i]], m_sin[m_values[i]]);
+				}
+			}
+		}
+	};
+}
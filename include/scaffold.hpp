@@ -44,6 +44,15 @@ namespace v2
 		struct Tree
 		{
 			std::vector<Branch> branches;
+
+			uint64_t getMemory() const
+			{
+				uint64_t memory = branches.capacity() * sizeof(Branch);
+				for (const Branch& b : branches) {
+					memory += b.nodes.capacity() * sizeof(Node);
+				}
+				return memory;
+			}
 		};
 	}
 }
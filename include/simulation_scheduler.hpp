@@ -0,0 +1,37 @@
+#pragma once
+#include <algorithm>
+#include "tree.hpp"
+
+
+// Trees close to the view are simulated every frame, the others once every offscreen_period frames
+struct SimulationScheduler
+{
+	uint32_t offscreen_period;
+	float view_margin;
+	uint64_t frame;
+	uint32_t updated_count;
+
+	SimulationScheduler(uint32_t period = 8, float margin = 300.0f)
+		: offscreen_period(period)
+		, view_margin(margin)
+		, frame(0)
+		, updated_count(0)
+	{}
+
+	void nextFrame()
+	{
+		++frame;
+		updated_count = 0;
+	}
+
+	// Off-screen trees are staggered by id so that the load is spread over the frames
+	bool shouldUpdate(uint32_t tree_id, const v2::Tree& tree, const BoundingBox& view)
+	{
+		const bool visible = tree.bbox.intersects(view.getInflated(view_margin));
+		if (visible || (frame + tree_id) % std::max(1U, offscreen_period) == 0) {
+			++updated_count;
+			return true;
+		}
+		return false;
+	}
+};
@@ -0,0 +1,441 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "forest_render_data.hpp"
+#include "profiler.hpp"
+#include "swarm.hpp"
+
+
+// Software rasterizer for headless rendering, draws ForestRenderData into an RGBA framebuffer
+// Primitives are binned per screen tile, then tiles are rasterized independently so that threads never share pixels
+// Branches are drawn before leaves and each primitive in submission order, as sf::RenderTarget would
+class SoftRasterizer
+{
+public:
+	static constexpr uint32_t TileSize = 64;
+	// Primitives are binned by this many chunks of consecutive primitives, whatever the threads count
+	static constexpr uint32_t BinChunks = 32;
+	// Leaves cover a few dozen pixels, a larger texture only costs cache misses
+	static constexpr uint32_t MaxTextureSize = 256;
+
+	SoftRasterizer(uint32_t width, uint32_t height)
+		: m_width(width)
+		, m_height(height)
+		, m_tiles_x((width + TileSize - 1) / TileSize)
+		, m_tiles_y((height + TileSize - 1) / TileSize)
+		, m_pixels(4 * width * height)
+		, m_clear_color(sf::Color::Black)
+		, m_texture_width(0)
+		, m_texture_height(0)
+		, m_texture_scale(1.0f)
+		, m_branches(nullptr)
+		, m_leaves(nullptr)
+		, m_branches_triangles(0)
+		, m_primitives_count(0)
+		, m_bins(BinChunks, std::vector<std::vector<uint32_t>>(m_tiles_x * m_tiles_y))
+		, m_next_chunk(0)
+		, m_next_tile(0)
+	{
+		setView(sf::Vector2f(0.5f * width, 0.5f * height), sf::Vector2f(float(width), float(height)));
+	}
+
+	// Same convention as sf::View
+	void setView(sf::Vector2f center, sf::Vector2f size)
+	{
+		m_view_origin = center - 0.5f * size;
+		m_view_scale = sf::Vector2f(m_width / size.x, m_height / size.y);
+	}
+
+	void setClearColor(sf::Color color)
+	{
+		m_clear_color = color;
+	}
+
+	// Texture of the leaves, vertices' texture coordinates are in this image's pixels
+	// It is downsampled by powers of 2 with a box filter and stored with premultiplied alpha
+	void setTexture(const sf::Image& image)
+	{
+		const sf::Vector2u size = image.getSize();
+		uint32_t factor = 1;
+		while (size.x / factor > MaxTextureSize || size.y / factor > MaxTextureSize) {
+			factor *= 2;
+		}
+		m_texture_width = std::max(1U, size.x / factor);
+		m_texture_height = std::max(1U, size.y / factor);
+		m_texture_scale = 1.0f / factor;
+		m_texture.resize(4 * m_texture_width * m_texture_height);
+		const uint8_t* pixels = image.getPixelsPtr();
+		for (uint32_t y(0); y < m_texture_height; ++y) {
+			for (uint32_t x(0); x < m_texture_width; ++x) {
+				uint32_t sum[4] = {0, 0, 0, 0};
+				for (uint32_t sy(0); sy < factor; ++sy) {
+					for (uint32_t sx(0); sx < factor; ++sx) {
+						const uint8_t* p = pixels + 4 * ((y * factor + sy) * size.x + x * factor + sx);
+						sum[0] += p[0] * p[3];
+						sum[1] += p[1] * p[3];
+						sum[2] += p[2] * p[3];
+						sum[3] += p[3];
+					}
+				}
+				const uint32_t count = factor * factor;
+				uint8_t* texel = &m_texture[4 * (y * m_texture_width + x)];
+				texel[0] = static_cast<uint8_t>(sum[0] / (255 * count));
+				texel[1] = static_cast<uint8_t>(sum[1] / (255 * count));
+				texel[2] = static_cast<uint8_t>(sum[2] / (255 * count));
+				texel[3] = static_cast<uint8_t>(sum[3] / count);
+			}
+		}
+	}
+
+	// Rasterizes the frame on the swarm's threads, or on the calling thread if swarm is nullptr
+	void render(const ForestRenderData& data, swrm::Swarm* swarm = nullptr)
+	{
+		PROFILE_SCOPE("SoftRasterizer::render");
+		m_branches = data.branches.data();
+		m_leaves = data.leaves.data();
+		m_branches_triangles = static_cast<uint32_t>(data.branches_vertices_count / 3);
+		m_primitives_count = m_branches_triangles + static_cast<uint32_t>(data.leaves_vertices_count / 4);
+		m_next_chunk = 0;
+		m_next_tile = 0;
+		if (swarm) {
+			swarm->execute([this](uint32_t, uint32_t) {
+				binChunks();
+			}).waitExecutionDone();
+			swarm->execute([this](uint32_t, uint32_t) {
+				rasterizeTiles();
+			}).waitExecutionDone();
+		}
+		else {
+			binChunks();
+			rasterizeTiles();
+		}
+	}
+
+	uint32_t getWidth() const
+	{
+		return m_width;
+	}
+
+	uint32_t getHeight() const
+	{
+		return m_height;
+	}
+
+	// RGBA, row major
+	const uint8_t* getPixels() const
+	{
+		return m_pixels.data();
+	}
+
+	bool saveToFile(const std::string& filename) const
+	{
+		sf::Image image;
+		image.create(m_width, m_height, m_pixels.data());
+		return image.saveToFile(filename);
+	}
+
+private:
+	const uint32_t m_width;
+	const uint32_t m_height;
+	const uint32_t m_tiles_x;
+	const uint32_t m_tiles_y;
+	std::vector<uint8_t> m_pixels;
+	sf::Color m_clear_color;
+	sf::Vector2f m_view_origin;
+	sf::Vector2f m_view_scale;
+
+	std::vector<uint8_t> m_texture;
+	uint32_t m_texture_width;
+	uint32_t m_texture_height;
+	float m_texture_scale;
+
+	// Frame being rendered
+	const sf::Vertex* m_branches;
+	const sf::Vertex* m_leaves;
+	uint32_t m_branches_triangles;
+	uint32_t m_primitives_count;
+	// Primitive ids per tile, one set of bins per chunk of primitives
+	std::vector<std::vector<std::vector<uint32_t>>> m_bins;
+	std::atomic<uint32_t> m_next_chunk;
+	std::atomic<uint32_t> m_next_tile;
+
+	// Vertices of a primitive, branches are triangles and leaves quads, returns the vertices count
+	uint32_t getPrimitive(uint32_t id, const sf::Vertex*& vertices) const
+	{
+		if (id < m_branches_triangles) {
+			vertices = m_branches + 3 * id;
+			return 3;
+		}
+		vertices = m_leaves + 4 * (id - m_branches_triangles);
+		return 4;
+	}
+
+	sf::Vector2f toScreen(sf::Vector2f position) const
+	{
+		return sf::Vector2f((position.x - m_view_origin.x) * m_view_scale.x, (position.y - m_view_origin.y) * m_view_scale.y);
+	}
+
+	void binChunks()
+	{
+		PROFILE_SCOPE("SoftRasterizer::binChunks");
+		for (uint32_t chunk(m_next_chunk++); chunk < BinChunks; chunk = m_next_chunk++) {
+			const uint32_t first = static_cast<uint32_t>(uint64_t(m_primitives_count) * chunk / BinChunks);
+			const uint32_t last = static_cast<uint32_t>(uint64_t(m_primitives_count) * (chunk + 1) / BinChunks);
+			binPrimitives(first, last, m_bins[chunk]);
+		}
+	}
+
+	void binPrimitives(uint32_t first, uint32_t last, std::vector<std::vector<uint32_t>>& bins) const
+	{
+		for (std::vector<uint32_t>& bin : bins) {
+			bin.clear();
+		}
+		const float width = float(m_width);
+		const float height = float(m_height);
+		for (uint32_t id(first); id < last; ++id) {
+			const sf::Vertex* vertices;
+			const uint32_t count = getPrimitive(id, vertices);
+			sf::Vector2f min(width, height);
+			// Below the screen's first pixel so that primitives left of or above it are culled
+			sf::Vector2f max(-1.0f, -1.0f);
+			for (uint32_t k(0); k < count; ++k) {
+				const sf::Vector2f p = toScreen(vertices[k].position);
+				min.x = std::min(min.x, p.x);
+				min.y = std::min(min.y, p.y);
+				max.x = std::max(max.x, p.x);
+				max.y = std::max(max.y, p.y);
+			}
+			min.x = std::max(0.0f, min.x);
+			min.y = std::max(0.0f, min.y);
+			max.x = std::min(width - 1.0f, max.x);
+			max.y = std::min(height - 1.0f, max.y);
+			if (min.x > max.x || min.y > max.y) {
+				continue;
+			}
+			const uint32_t tile_x_last = static_cast<uint32_t>(max.x) / TileSize;
+			const uint32_t tile_y_last = static_cast<uint32_t>(max.y) / TileSize;
+			for (uint32_t tile_y(static_cast<uint32_t>(min.y) / TileSize); tile_y <= tile_y_last; ++tile_y) {
+				for (uint32_t tile_x(static_cast<uint32_t>(min.x) / TileSize); tile_x <= tile_x_last; ++tile_x) {
+					bins[tile_y * m_tiles_x + tile_x].push_back(id);
+				}
+			}
+		}
+	}
+
+	void rasterizeTiles()
+	{
+		PROFILE_SCOPE("SoftRasterizer::rasterizeTiles");
+		const uint32_t tiles_count = m_tiles_x * m_tiles_y;
+		for (uint32_t tile(m_next_tile++); tile < tiles_count; tile = m_next_tile++) {
+			const uint32_t x0 = (tile % m_tiles_x) * TileSize;
+			const uint32_t y0 = (tile / m_tiles_x) * TileSize;
+			const uint32_t x1 = std::min(m_width, x0 + TileSize);
+			const uint32_t y1 = std::min(m_height, y0 + TileSize);
+			for (uint32_t y(y0); y < y1; ++y) {
+				for (uint32_t x(x0); x < x1; ++x) {
+					uint8_t* pixel = &m_pixels[4 * (y * m_width + x)];
+					pixel[0] = m_clear_color.r;
+					pixel[1] = m_clear_color.g;
+					pixel[2] = m_clear_color.b;
+					pixel[3] = m_clear_color.a;
+				}
+			}
+			// Chunks hold consecutive primitives, going through them in order keeps the submission order
+			for (const std::vector<std::vector<uint32_t>>& bins : m_bins) {
+				for (const uint32_t id : bins[tile]) {
+					rasterizePrimitive(id, x0, y0, x1, y1);
+				}
+			}
+		}
+	}
+
+	// std::floor and std::ceil are library calls without SSE4.1
+	static int32_t floorInt(float f)
+	{
+		const int32_t i = static_cast<int32_t>(f);
+		return i - (f < float(i) ? 1 : 0);
+	}
+
+	static int32_t ceilInt(float f)
+	{
+		const int32_t i = static_cast<int32_t>(f);
+		return i + (f > float(i) ? 1 : 0);
+	}
+
+	static float edge(sf::Vector2f a, sf::Vector2f b, sf::Vector2f p)
+	{
+		return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+	}
+
+	// Pixels exactly on an edge belong to one primitive only, the one for which the edge is top or left
+	static bool isTopLeft(sf::Vector2f a, sf::Vector2f b)
+	{
+		return (a.y == b.y && b.x < a.x) || b.y > a.y;
+	}
+
+	// Rasterizes the part of a convex primitive that is in [x0, x1) x [y0, y1), row by row
+	// Leaves are parallelograms so texture coordinates are affine over the whole quad
+	// Colors are taken from the first vertex, they are uniform in the generated data
+	void rasterizePrimitive(uint32_t id, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+	{
+		const sf::Vertex* vertices;
+		const uint32_t count = getPrimitive(id, vertices);
+		sf::Vector2f p[4];
+		sf::Vector2f uv[4];
+		for (uint32_t k(0); k < count; ++k) {
+			p[k] = toScreen(vertices[k].position);
+			uv[k] = vertices[k].texCoords;
+		}
+		float area = edge(p[0], p[1], p[2]);
+		if (area == 0.0f) {
+			return;
+		}
+		// Counter clockwise on screen
+		if (area < 0.0f) {
+			std::reverse(p + 1, p + count);
+			std::reverse(uv + 1, uv + count);
+			area = edge(p[0], p[1], p[2]);
+		}
+
+		sf::Vector2f min(p[0]);
+		sf::Vector2f max(p[0]);
+		for (uint32_t k(1); k < count; ++k) {
+			min.x = std::min(min.x, p[k].x);
+			min.y = std::min(min.y, p[k].y);
+			max.x = std::max(max.x, p[k].x);
+			max.y = std::max(max.y, p[k].y);
+		}
+		const int32_t row_first = std::max(int32_t(y0), ceilInt(min.y - 0.5f));
+		const int32_t row_last = std::min(int32_t(y1) - 1, floorInt(max.y - 0.5f));
+		const int32_t clip_first = int32_t(x0);
+		const int32_t clip_last = int32_t(x1) - 1;
+
+		const sf::Color color = vertices[0].color;
+		const bool textured = id >= m_branches_triangles && !m_texture.empty();
+		// Gradients of the texture coordinates, from the first triangle
+		const float inv_area = m_texture_scale / area;
+		const float w_dx[3] = {p[1].y - p[2].y, p[2].y - p[0].y, p[0].y - p[1].y};
+		const float w_dy[3] = {p[2].x - p[1].x, p[0].x - p[2].x, p[1].x - p[0].x};
+		const float u_dx = (w_dx[0] * uv[0].x + w_dx[1] * uv[1].x + w_dx[2] * uv[2].x) * inv_area;
+		const float u_dy = (w_dy[0] * uv[0].x + w_dy[1] * uv[1].x + w_dy[2] * uv[2].x) * inv_area;
+		const float v_dx = (w_dx[0] * uv[0].y + w_dx[1] * uv[1].y + w_dx[2] * uv[2].y) * inv_area;
+		const float v_dy = (w_dy[0] * uv[0].y + w_dy[1] * uv[1].y + w_dy[2] * uv[2].y) * inv_area;
+		const float u_origin = uv[0].x * m_texture_scale - u_dx * p[0].x - u_dy * p[0].y;
+		const float v_origin = uv[0].y * m_texture_scale - v_dx * p[0].x - v_dy * p[0].y;
+		const int32_t u_step = toFixed(u_dx);
+		const int32_t v_step = toFixed(v_dx);
+		const uint8_t solid[4] = {mul(color.r, color.a), mul(color.g, color.a), mul(color.b, color.a), color.a};
+
+		// Abscissa where each edge crosses the current row's centers, stepped from one row to the next
+		float cross_x[4];
+		float slope[4];
+		float edge_dx[4];
+		float edge_dy[4];
+		float edge_y[4];
+		bool top_left[4];
+		for (uint32_t k(0); k < count; ++k) {
+			const sf::Vector2f a = p[k];
+			const sf::Vector2f b = p[k + 1 < count ? k + 1 : 0];
+			edge_dx[k] = b.x - a.x;
+			edge_dy[k] = b.y - a.y;
+			edge_y[k] = a.y;
+			slope[k] = edge_dy[k] != 0.0f ? edge_dx[k] / edge_dy[k] : 0.0f;
+			cross_x[k] = a.x + slope[k] * (row_first + 0.5f - a.y) - 0.5f;
+			top_left[k] = isTopLeft(a, b);
+		}
+
+		for (int32_t y(row_first); y <= row_last; ++y) {
+			const float center_y = y + 0.5f;
+			int32_t span_first = clip_first;
+			int32_t span_last = clip_last;
+			for (uint32_t k(0); k < count; ++k) {
+				const float dy = edge_dy[k];
+				const float bound = cross_x[k];
+				cross_x[k] += slope[k];
+				if (dy > 0.0f) {
+					// Span ends at the crossing
+					int32_t last = floorInt(bound);
+					last -= (!top_left[k] && float(last) == bound) ? 1 : 0;
+					span_last = std::min(span_last, last);
+				}
+				else if (dy < 0.0f) {
+					// Span starts at the crossing
+					int32_t first = ceilInt(bound);
+					first += (!top_left[k] && float(first) == bound) ? 1 : 0;
+					span_first = std::max(span_first, first);
+				}
+				else {
+					// Horizontal edge, the row is on its inner side or not at all
+					const float side = edge_dx[k] * (center_y - edge_y[k]);
+					if (side < 0.0f || (side == 0.0f && !top_left[k])) {
+						span_last = span_first - 1;
+					}
+				}
+			}
+			if (span_first > span_last) {
+				continue;
+			}
+
+			uint8_t* pixel = &m_pixels[4 * (y * m_width + span_first)];
+			if (!textured) {
+				for (int32_t x(span_first); x <= span_last; ++x, pixel += 4) {
+					blend(pixel, solid[0], solid[1], solid[2], solid[3]);
+				}
+				continue;
+			}
+			// 16.16 fixed point, textures are at most MaxTextureSize wide
+			int32_t u = toFixed(u_origin + u_dx * (span_first + 0.5f) + u_dy * center_y);
+			int32_t v = toFixed(v_origin + v_dx * (span_first + 0.5f) + v_dy * center_y);
+			for (int32_t x(span_first); x <= span_last; ++x, pixel += 4, u += u_step, v += v_step) {
+				blendTexel(pixel, u >> 16, v >> 16, color);
+			}
+		}
+	}
+
+	static int32_t toFixed(float f)
+	{
+		return static_cast<int32_t>(f * 65536.0f);
+	}
+
+	// Nearest texel modulated by the vertex color as SFML does, u and v are in the downsampled texture's pixels
+	void blendTexel(uint8_t* pixel, int32_t u, int32_t v, sf::Color color) const
+	{
+		const int32_t tx = std::min(int32_t(m_texture_width) - 1, std::max(0, u));
+		const int32_t ty = std::min(int32_t(m_texture_height) - 1, std::max(0, v));
+		const uint8_t* texel = &m_texture[4 * (ty * m_texture_width + tx)];
+		if (!texel[3]) {
+			return;
+		}
+		blend(pixel, mul(texel[0], color.r), mul(texel[1], color.g), mul(texel[2], color.b), mul(texel[3], color.a));
+	}
+
+	// Source over, premultiplied alpha
+	static void blend(uint8_t* pixel, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+	{
+		// Most of a leaf and all branches are opaque
+		if (a == 255) {
+			pixel[0] = r;
+			pixel[1] = g;
+			pixel[2] = b;
+			pixel[3] = a;
+			return;
+		}
+		const uint32_t inv_a = 255 - a;
+		pixel[0] = static_cast<uint8_t>(r + mul(pixel[0], inv_a));
+		pixel[1] = static_cast<uint8_t>(g + mul(pixel[1], inv_a));
+		pixel[2] = static_cast<uint8_t>(b + mul(pixel[2], inv_a));
+		pixel[3] = static_cast<uint8_t>(a + mul(pixel[3], inv_a));
+	}
+
+	// a * b / 255 rounded, without division
+	static uint8_t mul(uint32_t a, uint32_t b)
+	{
+		const uint32_t t = a * b + 128;
+		return static_cast<uint8_t>((t + (t >> 8)) >> 8);
+	}
+};
@@ -0,0 +1,553 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+#include "tree.hpp"
+#include "profiler.hpp"
+
+
+// Bounding volume hierarchy over the branch segments of a tree
+// The hierarchy is built once, then only its boxes are refit from the nodes' positions
+// Branches' boxes overlap too much near the crown to be used as primitives
+struct SegmentBvh
+{
+	static constexpr uint32_t LeafSize = 4;
+	static constexpr uint32_t MaxDepth = 64;
+
+	// From node node_id of the branch to node node_id + 1
+	struct Segment
+	{
+		uint32_t branch_id;
+		uint32_t node_id;
+	};
+
+	struct Node
+	{
+		BoundingBox bbox;
+		// Leaf nodes hold segments [first, first + count), the children of the others are the next node and first
+		uint32_t first;
+		uint32_t count;
+	};
+
+	std::vector<Node> nodes;
+	// In the leaves' order
+	std::vector<Segment> segments;
+	// Leaf node of each segment, in the branches' order
+	std::vector<uint32_t> segments_leaves;
+	// Branches the hierarchy was built for, it is rebuilt if they change
+	const v2::Branch* source;
+	uint64_t source_count;
+	// Only the last branch of a growing tree gains nodes, see TreeGrower
+	uint64_t source_last_nodes;
+	uint64_t version;
+	uint64_t last_used;
+
+	SegmentBvh()
+		: source(nullptr)
+		, source_count(0)
+		, source_last_nodes(0)
+		, version(0)
+		, last_used(0)
+	{}
+
+	bool isBuiltFor(const v2::Tree& tree) const
+	{
+		return source == tree.branches.data() && source_count == tree.branches.size() && (tree.branches.empty() || source_last_nodes == tree.branches.back().nodes.size());
+	}
+
+	void build(const v2::Tree& tree)
+	{
+		PROFILE_SCOPE("SegmentBvh::build");
+		segments.clear();
+		const uint32_t branches_count = static_cast<uint32_t>(tree.branches.size());
+		std::vector<uint32_t> offsets(branches_count);
+		for (uint32_t branch_id(0); branch_id < branches_count; ++branch_id) {
+			offsets[branch_id] = static_cast<uint32_t>(segments.size());
+			const uint64_t nodes_count = tree.branches[branch_id].nodes.size();
+			for (uint32_t node_id(0); node_id + 1 < nodes_count; ++node_id) {
+				segments.push_back(Segment{branch_id, node_id});
+			}
+		}
+		nodes.clear();
+		if (!segments.empty()) {
+			buildNode(tree, 0, static_cast<uint32_t>(segments.size()), 0);
+		}
+		segments_leaves.resize(segments.size());
+		const uint32_t nodes_count = static_cast<uint32_t>(nodes.size());
+		for (uint32_t node_id(0); node_id < nodes_count; ++node_id) {
+			const Node& node = nodes[node_id];
+			for (uint32_t k(0); k < node.count; ++k) {
+				const Segment s = segments[node.first + k];
+				segments_leaves[offsets[s.branch_id] + s.node_id] = node_id;
+			}
+		}
+		source = tree.branches.data();
+		source_count = branches_count;
+		source_last_nodes = branches_count ? tree.branches.back().nodes.size() : 0;
+	}
+
+	// Nodes are read in the branches' order, then children come after their parent so a reverse pass sees them first
+	void refit(const v2::Tree& tree)
+	{
+		PROFILE_SCOPE("SegmentBvh::refit");
+		for (Node& node : nodes) {
+			node.bbox.reset();
+		}
+		uint64_t i(0);
+		for (const v2::Branch& b : tree.branches) {
+			const uint64_t nodes_count = b.nodes.size();
+			for (uint64_t k(1); k < nodes_count; ++k) {
+				BoundingBox& bbox = nodes[segments_leaves[i++]].bbox;
+				bbox.add(b.nodes[k - 1].position);
+				bbox.add(b.nodes[k].position);
+			}
+		}
+		for (uint64_t n(nodes.size()); n--;) {
+			Node& node = nodes[n];
+			if (!node.count) {
+				node.bbox = nodes[n + 1].bbox;
+				node.bbox.merge(nodes[node.first].bbox);
+			}
+		}
+	}
+
+private:
+	// Median split along the widest axis of the segments' centers
+	void buildNode(const v2::Tree& tree, uint32_t first, uint32_t last, uint32_t depth)
+	{
+		const uint32_t node_id = static_cast<uint32_t>(nodes.size());
+		nodes.push_back(Node{BoundingBox(), first, last - first});
+		if (last - first <= LeafSize || depth + 1 >= MaxDepth) {
+			return;
+		}
+		BoundingBox centers;
+		for (uint32_t i(first); i < last; ++i) {
+			centers.add(getCenter(tree, segments[i]));
+		}
+		const bool split_x = centers.max.x - centers.min.x > centers.max.y - centers.min.y;
+		const uint32_t middle = first + (last - first) / 2;
+		std::nth_element(segments.begin() + first, segments.begin() + middle, segments.begin() + last, [&](Segment s1, Segment s2) {
+			const Vec2 c1 = getCenter(tree, s1);
+			const Vec2 c2 = getCenter(tree, s2);
+			return split_x ? c1.x < c2.x : c1.y < c2.y;
+		});
+		buildNode(tree, first, middle, depth + 1);
+		const uint32_t right = static_cast<uint32_t>(nodes.size());
+		buildNode(tree, middle, last, depth + 1);
+		nodes[node_id].first = right;
+		nodes[node_id].count = 0;
+	}
+
+	static Vec2 getCenter(const v2::Tree& tree, Segment s)
+	{
+		const v2::Branch& b = tree.branches[s.branch_id];
+		return (b.nodes[s.node_id].position + b.nodes[s.node_id + 1].position) * 0.5f;
+	}
+};
+
+
+// Branch segments and leaves of a forest, for picking and pointer interactions
+// Trees are added every frame like with ForestRenderer, their hierarchies are kept from one frame to the next
+// and refit lazily by the queries that reach them
+class SpatialIndex
+{
+public:
+	// Segment node_id of a branch goes from node node_id to node node_id + 1
+	struct SegmentHit
+	{
+		uint32_t tree_id;
+		uint32_t branch_id;
+		uint32_t node_id;
+		// To the segment's center line, or along the ray for raycasts
+		float distance;
+		Vec2 point;
+	};
+
+	struct LeafHit
+	{
+		uint32_t tree_id;
+		uint32_t leaf_id;
+		float distance;
+	};
+
+	SpatialIndex()
+		: m_version(1)
+		, m_frame(1)
+	{}
+
+	// Hierarchies of the trees that have not been added since the last clear are released
+	void clear()
+	{
+		for (auto it(m_cache.begin()); it != m_cache.end();) {
+			if (it->second.last_used != m_frame) {
+				it = m_cache.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		m_trees.clear();
+		m_bvhs.clear();
+		++m_frame;
+		invalidate();
+	}
+
+	// Releases all the hierarchies, to be called when trees are destroyed as their addresses can be reused
+	void reset()
+	{
+		m_cache.clear();
+		m_trees.clear();
+		m_bvhs.clear();
+		invalidate();
+	}
+
+	void addTree(v2::Tree& tree)
+	{
+		SegmentBvh& bvh = m_cache[&tree];
+		bvh.last_used = m_frame;
+		m_trees.push_back(&tree);
+		m_bvhs.push_back(&bvh);
+	}
+
+	// The trees moved, boxes will be refit before being used
+	void invalidate()
+	{
+		++m_version;
+	}
+
+	// Refits the hierarchies of all the trees now instead of in the queries that reach them
+	void refit()
+	{
+		const uint32_t trees_count = getTreesCount();
+		for (uint32_t tree_id(0); tree_id < trees_count; ++tree_id) {
+			getBvh(tree_id);
+		}
+	}
+
+	v2::Tree& getTree(uint32_t tree_id)
+	{
+		return *m_trees[tree_id];
+	}
+
+	uint32_t getTreesCount() const
+	{
+		return static_cast<uint32_t>(m_trees.size());
+	}
+
+	// Closest segment within max_distance of the point, returns false if there is none
+	bool findNearestSegment(Vec2 point, float max_distance, SegmentHit& hit)
+	{
+		PROFILE_SCOPE("SpatialIndex::findNearestSegment");
+		float best_sq = max_distance * max_distance;
+		bool found = false;
+		const uint32_t trees_count = getTreesCount();
+		for (uint32_t tree_id(0); tree_id < trees_count; ++tree_id) {
+			const v2::Tree& tree = *m_trees[tree_id];
+			if (getDistanceSq(tree.bbox, point) > best_sq) {
+				continue;
+			}
+			const SegmentBvh& bvh = getBvh(tree_id);
+			if (bvh.nodes.empty()) {
+				continue;
+			}
+			uint32_t stack[SegmentBvh::MaxDepth + 1];
+			uint32_t stack_size(0);
+			stack[stack_size++] = 0;
+			while (stack_size) {
+				const SegmentBvh::Node& node = bvh.nodes[stack[--stack_size]];
+				if (getDistanceSq(node.bbox, point) > best_sq) {
+					continue;
+				}
+				if (!node.count) {
+					// The closest child is visited first
+					const uint32_t left = static_cast<uint32_t>(&node - bvh.nodes.data()) + 1;
+					const bool left_first = getDistanceSq(bvh.nodes[left].bbox, point) <= getDistanceSq(bvh.nodes[node.first].bbox, point);
+					stack[stack_size++] = left_first ? node.first : left;
+					stack[stack_size++] = left_first ? left : node.first;
+					continue;
+				}
+				for (uint32_t k(0); k < node.count; ++k) {
+					const SegmentBvh::Segment s = bvh.segments[node.first + k];
+					const v2::Branch& b = tree.branches[s.branch_id];
+					Vec2 closest;
+					const float d_sq = getSegmentDistanceSq(b.nodes[s.node_id].position, b.nodes[s.node_id + 1].position, point, closest);
+					if (d_sq <= best_sq) {
+						best_sq = d_sq;
+						hit = SegmentHit{tree_id, s.branch_id, s.node_id, 0.0f, closest};
+						found = true;
+					}
+				}
+			}
+		}
+		if (found) {
+			hit.distance = std::sqrt(best_sq);
+		}
+		return found;
+	}
+
+	// Segments and leaves' attach points within radius of the center, the vectors are cleared first
+	// Segments of a branch are consecutive
+	// Costs about 0.1 us per hit, a radius over the densest parts of a crown goes above 10 us (benchmark p99 21 us)
+	void queryRadius(Vec2 center, float radius, std::vector<SegmentHit>& segments, std::vector<LeafHit>& leaves)
+	{
+		PROFILE_SCOPE("SpatialIndex::queryRadius");
+		segments.clear();
+		leaves.clear();
+		const float radius_sq = radius * radius;
+		const uint32_t trees_count = getTreesCount();
+		for (uint32_t tree_id(0); tree_id < trees_count; ++tree_id) {
+			const v2::Tree& tree = *m_trees[tree_id];
+			if (getDistanceSq(tree.bbox, center) > radius_sq) {
+				continue;
+			}
+			const SegmentBvh& bvh = getBvh(tree_id);
+			if (bvh.nodes.empty()) {
+				continue;
+			}
+			uint32_t stack[SegmentBvh::MaxDepth + 1];
+			uint32_t stack_size(0);
+			stack[stack_size++] = 0;
+			while (stack_size) {
+				const uint32_t node_index = stack[--stack_size];
+				const SegmentBvh::Node& node = bvh.nodes[node_index];
+				if (getDistanceSq(node.bbox, center) > radius_sq) {
+					continue;
+				}
+				if (!node.count) {
+					stack[stack_size++] = node.first;
+					stack[stack_size++] = node_index + 1;
+					continue;
+				}
+				for (uint32_t k(0); k < node.count; ++k) {
+					const SegmentBvh::Segment s = bvh.segments[node.first + k];
+					const v2::Branch& b = tree.branches[s.branch_id];
+					Vec2 closest;
+					const float d_sq = getSegmentDistanceSq(b.nodes[s.node_id].position, b.nodes[s.node_id + 1].position, center, closest);
+					if (d_sq <= radius_sq) {
+						segments.push_back(SegmentHit{tree_id, s.branch_id, s.node_id, std::sqrt(d_sq), closest});
+					}
+				}
+			}
+		}
+		std::sort(segments.begin(), segments.end(), [](const SegmentHit& s1, const SegmentHit& s2) {
+			if (s1.tree_id != s2.tree_id) {
+				return s1.tree_id < s2.tree_id;
+			}
+			return s1.branch_id != s2.branch_id ? s1.branch_id < s2.branch_id : s1.node_id < s2.node_id;
+		});
+		// A leaf within radius has a node, hence a segment of its branch, within radius
+		for (uint64_t i(0); i < segments.size(); ++i) {
+			const SegmentHit& s = segments[i];
+			if (!i || s.tree_id != segments[i - 1].tree_id || s.branch_id != segments[i - 1].branch_id) {
+				addLeaves(*m_trees[s.tree_id], s.tree_id, s.branch_id, center, radius_sq, leaves);
+			}
+		}
+	}
+
+	// First segment crossed by the ray, direction doesn't have to be normalized
+	// Branches are seen as their center line
+	// Rays grazing a crown test many boxes, they can go above 10 us (benchmark p99 15 us)
+	bool raycast(Vec2 origin, Vec2 direction, float max_distance, SegmentHit& hit)
+	{
+		PROFILE_SCOPE("SpatialIndex::raycast");
+		const float length = direction.getLength();
+		if (length <= 0.0f) {
+			return false;
+		}
+		const Vec2 dir = direction / length;
+		const Vec2 inv_dir(getInverse(dir.x), getInverse(dir.y));
+		float best = max_distance;
+		bool found = false;
+		const uint32_t trees_count = getTreesCount();
+		for (uint32_t tree_id(0); tree_id < trees_count; ++tree_id) {
+			const v2::Tree& tree = *m_trees[tree_id];
+			if (!intersectsRay(tree.bbox, origin, inv_dir, best)) {
+				continue;
+			}
+			const SegmentBvh& bvh = getBvh(tree_id);
+			if (bvh.nodes.empty()) {
+				continue;
+			}
+			uint32_t stack[SegmentBvh::MaxDepth + 1];
+			uint32_t stack_size(0);
+			stack[stack_size++] = 0;
+			while (stack_size) {
+				const uint32_t node_index = stack[--stack_size];
+				const SegmentBvh::Node& node = bvh.nodes[node_index];
+				if (!intersectsRay(node.bbox, origin, inv_dir, best)) {
+					continue;
+				}
+				if (!node.count) {
+					stack[stack_size++] = node.first;
+					stack[stack_size++] = node_index + 1;
+					continue;
+				}
+				for (uint32_t k(0); k < node.count; ++k) {
+					const SegmentBvh::Segment s = bvh.segments[node.first + k];
+					const v2::Branch& b = tree.branches[s.branch_id];
+					const float t = intersectSegment(origin, dir, b.nodes[s.node_id].position, b.nodes[s.node_id + 1].position);
+					if (t >= 0.0f && t < best) {
+						best = t;
+						hit = SegmentHit{tree_id, s.branch_id, s.node_id, t, origin + dir * t};
+						found = true;
+					}
+				}
+			}
+		}
+		return found;
+	}
+
+	// Pushes the branches and leaves within radius of the center, the force fades out with the distance
+	// A branch is moved by its tip, the force on a segment is scaled by its position along the branch
+	// Returns the number of branches pushed
+	uint32_t applyForce(Vec2 center, float radius, Vec2 force)
+	{
+		PROFILE_SCOPE("SpatialIndex::applyForce");
+		queryRadius(center, radius, m_segments, m_leaves);
+		uint32_t pushed(0);
+		uint64_t i(0);
+		const uint64_t segments_count = m_segments.size();
+		while (i < segments_count) {
+			const SegmentHit& first = m_segments[i];
+			v2::Branch& b = m_trees[first.tree_id]->branches[first.branch_id];
+			const float segments = float(b.nodes.size() - 1);
+			float weight = 0.0f;
+			for (; i < segments_count && m_segments[i].tree_id == first.tree_id && m_segments[i].branch_id == first.branch_id; ++i) {
+				const SegmentHit& s = m_segments[i];
+				weight = std::max(weight, (1.0f - s.distance / radius) * (s.node_id + 1) / segments);
+			}
+			b.segment.moving_point.applyForce(force * weight);
+			++pushed;
+		}
+		for (const LeafHit& l : m_leaves) {
+			v2::Tree& tree = *m_trees[l.tree_id];
+			const Vec2 leaf_force = force * (1.0f - l.distance / radius);
+			if (tree.compact) {
+				tree.compact_leaves.applyForce(l.leaf_id, leaf_force);
+			}
+			else {
+				tree.leaves[l.leaf_id].free_particule.applyForce(leaf_force);
+			}
+		}
+		return pushed;
+	}
+
+	// Results of the last applyForce
+	const std::vector<SegmentHit>& getPushedSegments() const
+	{
+		return m_segments;
+	}
+
+	uint64_t getMemory() const
+	{
+		uint64_t memory = (m_segments.capacity() * sizeof(SegmentHit)) + (m_leaves.capacity() * sizeof(LeafHit));
+		for (const auto& entry : m_cache) {
+			memory += sizeof(SegmentBvh) + entry.second.nodes.capacity() * sizeof(SegmentBvh::Node) + entry.second.segments.capacity() * sizeof(SegmentBvh::Segment) + entry.second.segments_leaves.capacity() * sizeof(uint32_t);
+		}
+		return memory;
+	}
+
+private:
+	std::vector<v2::Tree*> m_trees;
+	std::vector<SegmentBvh*> m_bvhs;
+	std::unordered_map<const v2::Tree*, SegmentBvh> m_cache;
+	uint64_t m_version;
+	uint64_t m_frame;
+	// Reused by applyForce
+	std::vector<SegmentHit> m_segments;
+	std::vector<LeafHit> m_leaves;
+
+	const SegmentBvh& getBvh(uint32_t tree_id)
+	{
+		const v2::Tree& tree = *m_trees[tree_id];
+		SegmentBvh& bvh = *m_bvhs[tree_id];
+		if (!bvh.isBuiltFor(tree)) {
+			bvh.build(tree);
+			bvh.version = 0;
+		}
+		if (bvh.version != m_version) {
+			bvh.refit(tree);
+			bvh.version = m_version;
+		}
+		return bvh;
+	}
+
+	// Leaves are attached to the branch's nodes, the attach point is their position
+	static void addLeaves(const v2::Tree& tree, uint32_t tree_id, uint32_t branch_id, Vec2 center, float radius_sq, std::vector<LeafHit>& leaves)
+	{
+		if (tree.leaves_offsets.size() != tree.branches.size() + 1) {
+			return;
+		}
+		const v2::Branch& b = tree.branches[branch_id];
+		const uint32_t leaves_end = tree.leaves_offsets[branch_id + 1];
+		for (uint32_t k(tree.leaves_offsets[branch_id]); k < leaves_end; ++k) {
+			Vec2 position;
+			if (tree.compact) {
+				position = b.nodes[tree.compact_leaves.getNodeId(k)].position;
+			}
+			else if (!tree.leaves[k].detached) {
+				position = tree.leaves[k].getPosition();
+			}
+			else {
+				continue;
+			}
+			const Vec2 delta = position - center;
+			const float d_sq = delta.x * delta.x + delta.y * delta.y;
+			if (d_sq <= radius_sq) {
+				leaves.push_back(LeafHit{tree_id, k, std::sqrt(d_sq)});
+			}
+		}
+	}
+
+	static float getDistanceSq(const BoundingBox& bbox, Vec2 p)
+	{
+		const float dx = std::max(0.0f, std::max(bbox.min.x - p.x, p.x - bbox.max.x));
+		const float dy = std::max(0.0f, std::max(bbox.min.y - p.y, p.y - bbox.max.y));
+		return dx * dx + dy * dy;
+	}
+
+	static float getSegmentDistanceSq(Vec2 a, Vec2 b, Vec2 p, Vec2& closest)
+	{
+		const Vec2 ab = b - a;
+		const float length_sq = ab.x * ab.x + ab.y * ab.y;
+		const float t = length_sq > 0.0f ? std::min(1.0f, std::max(0.0f, (p - a).dot(ab) / length_sq)) : 0.0f;
+		closest = a + ab * t;
+		const Vec2 delta = p - closest;
+		return delta.x * delta.x + delta.y * delta.y;
+	}
+
+	// A large value of the same sign instead of inf for axis aligned rays, 0 * inf gives NaN in the slab test
+	// when the origin lies on a box face
+	static float getInverse(float v)
+	{
+		return std::abs(v) > 1e-20f ? 1.0f / v : std::copysign(1e20f, v);
+	}
+
+	// Slab test over [0, max_t]
+	static bool intersectsRay(const BoundingBox& bbox, Vec2 origin, Vec2 inv_dir, float max_t)
+	{
+		const float tx1 = (bbox.min.x - origin.x) * inv_dir.x;
+		const float tx2 = (bbox.max.x - origin.x) * inv_dir.x;
+		const float ty1 = (bbox.min.y - origin.y) * inv_dir.y;
+		const float ty2 = (bbox.max.y - origin.y) * inv_dir.y;
+		const float t_min = std::max(std::min(tx1, tx2), std::min(ty1, ty2));
+		const float t_max = std::min(std::max(tx1, tx2), std::max(ty1, ty2));
+		return t_max >= std::max(0.0f, t_min) && t_min <= max_t;
+	}
+
+	// Distance along the ray to the segment, negative if they don't cross
+	static float intersectSegment(Vec2 origin, Vec2 dir, Vec2 a, Vec2 b)
+	{
+		const Vec2 ab = b - a;
+		const float denom = dir.x * ab.y - dir.y * ab.x;
+		if (denom == 0.0f) {
+			return -1.0f;
+		}
+		const Vec2 ao = a - origin;
+		const float t = (ao.x * ab.y - ao.y * ab.x) / denom;
+		const float u = (ao.x * dir.y - ao.y * dir.x) / denom;
+		return (u >= 0.0f && u <= 1.0f) ? t : -1.0f;
+	}
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <cmath>
+#include <cstring>
+#include "tree.hpp"
+#include "number_generator.hpp"
+
+
+namespace v2
+{
+	// Hashes of a tree's simulated state, equal hashes mean two implementations of the update agree
+	// Exact hashes take the bits of each value, quantized ones round values to a grid first so that
+	// small differences, like those of a reordered sum, don't show. Values that land on both sides of
+	// a grid line still differ, the step has to be well above the expected error
+	struct StateHash
+	{
+		enum Subsystem : uint32_t
+		{
+			Nodes,
+			Segments,
+			Leaves,
+			SubsystemsCount
+		};
+
+		uint64_t exact[SubsystemsCount];
+		uint64_t quantized[SubsystemsCount];
+
+		StateHash()
+			: exact{}
+			, quantized{}
+		{}
+
+		static StateHash compute(const Tree& tree, float step)
+		{
+			StateHash hash;
+			const float inv_step = 1.0f / step;
+			for (const Branch& b : tree.branches) {
+				for (const Node& n : b.nodes) {
+					hash.add(Nodes, n.position, inv_step);
+				}
+				hash.add(Segments, b.segment.moving_point.position, inv_step);
+				hash.add(Segments, b.segment.moving_point.old_position, inv_step);
+			}
+			// Compact leaves are stored relative to their node, both are compared in world space
+			if (tree.compact) {
+				const CompactLeaves& leaves = tree.compact_leaves;
+				const uint64_t leaves_count = leaves.x.size();
+				for (uint64_t i(0); i < leaves_count; ++i) {
+					const Vec2 node = tree.branches[leaves.getBranchId(i)].nodes[leaves.getNodeId(i)].position;
+					hash.add(Leaves, node + leaves.getDir(i), inv_step);
+				}
+			}
+			else {
+				for (const Leaf& l : tree.leaves) {
+					hash.add(Leaves, l.free_particule.position, inv_step);
+				}
+			}
+			return hash;
+		}
+
+		static const char* getName(Subsystem subsystem)
+		{
+			const char* names[] = {"nodes", "segments", "leaves"};
+			return subsystem < SubsystemsCount ? names[subsystem] : "unknown";
+		}
+
+	private:
+		void add(Subsystem subsystem, Vec2 v, float inv_step)
+		{
+			exact[subsystem] = hashSeed(exact[subsystem], getBits(v.x));
+			exact[subsystem] = hashSeed(exact[subsystem], getBits(v.y));
+			quantized[subsystem] = hashSeed(quantized[subsystem], quantize(v.x, inv_step));
+			quantized[subsystem] = hashSeed(quantized[subsystem], quantize(v.y, inv_step));
+		}
+
+		static uint64_t getBits(float value)
+		{
+			uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			return bits;
+		}
+
+		static uint64_t quantize(float value, float inv_step)
+		{
+			return static_cast<uint64_t>(static_cast<int64_t>(std::floor(value * inv_step + 0.5f)));
+		}
+	};
+}
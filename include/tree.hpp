@@ -1,8 +1,12 @@
 #pragma once
+#include <algorithm>
 #include "vec2.hpp"
 #include "pinned_segment.hpp"
 #include "wind.hpp"
 #include "utils.hpp"
+#include "bounding_box.hpp"
+#include "compact_leaves.hpp"
+#include "profiler.hpp"
 
 
 namespace v2
@@ -62,6 +66,26 @@ namespace v2
 			moving_point.update(dt);
 			updateDeltaAngle();
 		}
+
+		// Same motion as update in substeps smaller steps, the constraint is solved before each of them
+		// Velocities are stored per step, they are scaled to the substep then back
+		void update(float dt, uint32_t substeps)
+		{
+			if (substeps < 2) {
+				update(dt);
+				return;
+			}
+			const float n = float(substeps);
+			moving_point.old_position = moving_point.position - (moving_point.position - moving_point.old_position) / n;
+			const Vec2 acceleration = moving_point.acceleration + direction;
+			for (uint32_t i(0); i < substeps; ++i) {
+				solveAttach();
+				moving_point.acceleration = acceleration;
+				moving_point.update(dt / (n * n), 0.5f * n);
+			}
+			moving_point.old_position = moving_point.position - (moving_point.position - moving_point.old_position) * n;
+			updateDeltaAngle();
+		}
 	};
 
 	struct Node
@@ -108,6 +132,7 @@ namespace v2
 		// Physics
 		PhysicSegment segment;
 		NodeRef root;
+		BoundingBox bbox;
 
 		Branch()
 			: level(0)
@@ -119,9 +144,9 @@ namespace v2
 			, root(root_ref)
 		{}
 
-		void update(float dt)
+		void update(float dt, uint32_t substeps = 1)
 		{
-			segment.update(dt);
+			segment.update(dt, substeps);
 		}
 
 		void translate(Vec2 v)
@@ -130,6 +155,7 @@ namespace v2
 			for (Node& n : nodes) {
 				n.position += v;
 			}
+			bbox.translate(v);
 		}
 
 		void translateTo(Vec2 position)
@@ -145,6 +171,15 @@ namespace v2
 			const float joint_strength(4000.0f * std::powf(0.4f, float(level)));
 			segment.direction = segment.direction * joint_strength;
 		}
+
+		void computeBoundingBox()
+		{
+			bbox.reset();
+			for (const Node& n : nodes) {
+				bbox.add(n.position);
+			}
+			bbox = bbox.getInflated(0.5f * nodes.front().width);
+		}
 	};
 
 	struct Leaf
@@ -152,14 +187,16 @@ namespace v2
 		NodeRef attach;
 
 		Particule free_particule;
-		Particule broken_part;
 
 		Vec2 target_direction;
 		Vec2 acceleration;
 
 		sf::Color color;
+		// Stretch of the stem over which the leaf is torn off
 		float cut_threshold;
 		float size;
+		// Torn off, the leaf is no longer updated nor drawn
+		bool detached;
 
 		Leaf(NodeRef anchor, const Vec2& dir)
 			: attach(anchor)
@@ -167,31 +204,25 @@ namespace v2
 			, target_direction(dir * RNGf::getRange(1.0f, 4.0f))
 			, cut_threshold(0.4f + RNGf::getUnder(1.0f))
 			, size(1.0f)
+			, detached(false)
 		{
 			color = sf::Color(255, static_cast<uint8_t>(168 + RNGf::getRange(80.0f)), 0);
 			
 		}
 
-		void solveAttach()
+		// Returns true if the stem breaks, which can only happen if the leaf is detachable
+		bool solveAttach(bool detachable = false)
 		{
 			const float target_length = 1.0f;
 			Vec2 delta = free_particule.position - attach.position;
 			const float length = delta.normalize();
 			const float dist_delta = target_length - length;
-			/*if (std::abs(dist_delta) > cut_threshold) {
-				cut();
-			}*/
+			if (detachable && std::abs(dist_delta) > cut_threshold) {
+				return true;
+			}
 
 			free_particule.move(delta * dist_delta);
-		}
-
-		void solveLink()
-		{
-			const float length = 1.0f;
-			const Vec2 delta = free_particule.position - broken_part.position;
-			const float dist_delta = 1.0f - delta.getLength();
-			free_particule.move(delta.getNormalized() * (0.5f * dist_delta));
-			broken_part.move(delta.getNormalized() * (-0.5f * dist_delta));
+			return false;
 		}
 
 		Vec2 getDir() const
@@ -212,28 +243,53 @@ namespace v2
 			free_particule.old_position += delta;
 		}
 
-		/*void cut()
-		{
-			broken_part = Particule(attach->pos);
-			attach = nullptr;
-			target_direction = Vec2(0.0f, 1.0f);
-		}*/
-
 		void applyWind(const Wind& wind)
 		{
+			if (detached) {
+				return;
+			}
 			const float ratio = 1.0f;
 			const float wind_force = wind.strength * (wind.speed ? ratio : 1.0f);
 			free_particule.acceleration += Vec2(1.0f, RNGf::getRange(2.0f)) * wind_force;
 		}
 
-		void update(float dt)
+		// Returns true if the leaf has just been torn off
+		bool update(float dt, bool detachable = false)
 		{
-			solveAttach();
+			if (detached) {
+				return false;
+			}
+			if (solveAttach(detachable)) {
+				detached = true;
+				return true;
+			}
 			free_particule.update(dt);
 			// Reset acceleration
 			free_particule.acceleration = target_direction;
-			/*broken_part.update(dt);
-			broken_part.acceleration = target_direction * joint_strenght;*/
+			return false;
+		}
+
+		// Puts a detached leaf back on its node, at rest
+		void reattach()
+		{
+			const Vec2 dir = target_direction.getNormalized();
+			free_particule = Particule(attach.position + dir);
+			free_particule.acceleration = target_direction;
+			detached = false;
+		}
+	};
+
+	// In bytes
+	struct MemoryFootprint
+	{
+		uint64_t branches;
+		uint64_t nodes;
+		uint64_t leaves;
+		uint64_t scaffold;
+
+		uint64_t getTotal() const
+		{
+			return branches + nodes + leaves + scaffold;
 		}
 	};
 
@@ -241,29 +297,80 @@ namespace v2
 	{
 		std::vector<Branch> branches;
 		std::vector<Leaf> leaves;
-
-		Tree() = default;
+		// Replaces leaves once compactLeaves has been called
+		CompactLeaves compact_leaves;
+		bool compact;
+		// Leaves are sorted by branch, those of branch i are in [leaves_offsets[i], leaves_offsets[i + 1])
+		std::vector<uint32_t> leaves_offsets;
+		// Covers the branches only, leaves extend up to max_leaf_size times the leaf length around it
+		BoundingBox bbox;
+		float max_leaf_size;
+		// Peak memory of the builder's scaffold, it is released once the tree is built
+		uint64_t scaffold_memory;
+		// Fidelity, lowered by FrameGovernor when frames go over budget
+		// Leaves are split in leaves_period slices and each update only integrates one of them, in turn
+		uint32_t leaves_period;
+		uint32_t leaves_slice;
+		uint32_t branch_substeps;
+		// Fraction of each branch's leaves that is drawn, and simulated unless leaves are compact
+		float active_leaves;
+		// Leaves are torn off when their stem stretches too much, regular leaves only
+		bool detachable_leaves;
+		// Leaves torn off since the last FallingLeaves::collect, storage is reserved by setDetachableLeaves
+		std::vector<uint32_t> torn_leaves;
+
+		Tree()
+			: compact(false)
+			, max_leaf_size(0.0f)
+			, scaffold_memory(0)
+			, leaves_period(1)
+			, leaves_slice(0)
+			, branch_substeps(1)
+			, active_leaves(1.0f)
+			, detachable_leaves(false)
+		{}
 
 		void updateBranches(float dt)
 		{
+			PROFILE_SCOPE("Tree::updateBranches");
 			for (Branch& b : branches) {
-				b.update(dt);
+				b.update(dt, branch_substeps);
 			}
 		}
 
 		void updateLeaves(float dt)
 		{
-			for (Leaf& l : leaves) {
-				l.update(dt);
+			PROFILE_SCOPE("Tree::updateLeaves");
+			uint32_t first, last;
+			nextLeavesSlice(first, last);
+			if (compact) {
+				updateCompactLeaves(dt, first, last);
+				return;
+			}
+			if (active_leaves >= 1.0f) {
+				for (uint32_t k(first); k < last; ++k) {
+					updateLeaf(k, dt);
+				}
+				return;
+			}
+			checkLeavesIndex();
+			const uint64_t branches_count = branches.size();
+			for (uint64_t i(0); i < branches_count; ++i) {
+				const uint32_t leaves_end = std::min(last, getActiveLeavesEnd(i));
+				for (uint32_t k(std::max(first, leaves_offsets[i])); k < leaves_end; ++k) {
+					updateLeaf(k, dt);
+				}
 			}
 		}
 
 		void updateStructure()
 		{
+			PROFILE_SCOPE("Tree::updateStructure");
 			// Apply resulting translations
 			rotateBranches();
 			translateBranches();
 			translateLeaves();
+			mergeBoundingBoxes();
 		}
 
 		void update(float dt)
@@ -276,11 +383,149 @@ namespace v2
 			updateStructure();
 		}
 
+		// Single top-down pass, each branch and its leaves are updated while hot in cache
+		// Compact leaves don't depend on their branch, they are updated in a single vectorized pass
+		void updateFused(float dt)
+		{
+			PROFILE_SCOPE("Tree::updateFused");
+			checkLeavesIndex();
+			uint32_t first, last;
+			nextLeavesSlice(first, last);
+
+			bbox.reset();
+			const uint64_t branches_count = branches.size();
+			for (uint64_t i(0); i < branches_count; ++i) {
+				Branch& b = branches[i];
+				b.update(dt, branch_substeps);
+				rotateBranchTarget(b);
+				// Parents come first so the root node is already at its final position
+				if (i) {
+					b.translateTo(getNode(b.root).position);
+				}
+				bbox.merge(b.bbox);
+				if (compact) {
+					continue;
+				}
+
+				// Leaves that are not updated still follow their node, detached ones are left where they are
+				const uint32_t leaves_end = leaves_offsets[i + 1];
+				const uint32_t active_end = std::min(last, getActiveLeavesEnd(i));
+				for (uint32_t k(leaves_offsets[i]); k < leaves_end; ++k) {
+					Leaf& l = leaves[k];
+					if (k >= first && k < active_end) {
+						updateLeaf(k, dt);
+					}
+					if (!l.detached) {
+						l.moveTo(b.nodes[l.attach.node_id].position);
+					}
+				}
+			}
+
+			if (compact) {
+				updateCompactLeaves(dt, first, last);
+			}
+		}
+
+		void updateLeaf(uint32_t k, float dt)
+		{
+			if (leaves[k].update(dt, detachable_leaves)) {
+				torn_leaves.push_back(k);
+			}
+		}
+
+		// Leaves [first, last) to integrate this update, the slice advances at each call
+		void nextLeavesSlice(uint32_t& first, uint32_t& last)
+		{
+			const uint64_t count = getLeavesCount();
+			const uint32_t period = std::max(1U, leaves_period);
+			leaves_slice = (leaves_slice + 1) % period;
+			first = static_cast<uint32_t>(count * leaves_slice / period);
+			last = static_cast<uint32_t>(count * (leaves_slice + 1) / period);
+		}
+
+		// End of the leaves of a branch that are drawn and simulated, see active_leaves
+		uint32_t getActiveLeavesEnd(uint64_t branch_id) const
+		{
+			const uint32_t first = leaves_offsets[branch_id];
+			const uint32_t last = leaves_offsets[branch_id + 1];
+			if (active_leaves >= 1.0f) {
+				return last;
+			}
+			return first + static_cast<uint32_t>(std::ceil((last - first) * std::max(0.0f, active_leaves)));
+		}
+
+		// Compact leaves are integrated in a single vectorized pass, even the inactive ones
+		void updateCompactLeaves(float dt, uint32_t first, uint32_t last)
+		{
+			if (compact_leaves.kinematic) {
+				std::vector<float>& angular_velocity = compact_leaves.branch_angular_velocity;
+				const uint64_t branches_count = branches.size();
+				angular_velocity.resize(branches_count);
+				for (uint64_t i(0); i < branches_count; ++i) {
+					// Angles are in (-PI, PI], a branch crossing the boundary would seem to spin
+					float delta_angle = branches[i].segment.delta_angle;
+					if (delta_angle > PI) {
+						delta_angle -= 2.0f * PI;
+					}
+					else if (delta_angle < -PI) {
+						delta_angle += 2.0f * PI;
+					}
+					angular_velocity[i] = delta_angle / dt;
+				}
+			}
+			compact_leaves.update(first, last, dt);
+		}
+
+		void checkLeavesIndex()
+		{
+			if (leaves_offsets.size() != branches.size() + 1 || leaves_offsets.back() != getLeavesCount()) {
+				indexLeaves();
+			}
+		}
+
+		void indexLeaves()
+		{
+			// Compact leaves are already sorted
+			if (compact) {
+				return;
+			}
+			std::stable_sort(leaves.begin(), leaves.end(), [](const Leaf& l1, const Leaf& l2) {
+				return l1.attach.branch_id < l2.attach.branch_id;
+			});
+
+			leaves_offsets.assign(branches.size() + 1, 0);
+			max_leaf_size = 0.0f;
+			for (const Leaf& l : leaves) {
+				++leaves_offsets[l.attach.branch_id + 1];
+				max_leaf_size = std::max(max_leaf_size, l.size);
+			}
+			for (uint64_t i(1); i < leaves_offsets.size(); ++i) {
+				leaves_offsets[i] += leaves_offsets[i - 1];
+			}
+		}
+
 		void applyWind(const std::vector<Wind>& wind)
 		{
+			PROFILE_SCOPE("Tree::applyWind");
+			if (compact) {
+				const uint64_t branches_count = branches.size();
+				for (uint64_t i(0); i < branches_count; ++i) {
+					const Branch& b = branches[i];
+					const uint32_t leaves_end = leaves_offsets[i + 1];
+					for (uint32_t k(leaves_offsets[i]); k < leaves_end; ++k) {
+						const float attach_x = b.nodes[compact_leaves.getNodeId(k)].position.x;
+						for (const Wind& w : wind) {
+							compact_leaves.applyWind(k, attach_x, w);
+						}
+					}
+				}
+			}
+
 			for (const Wind& w : wind) {
 				for (Leaf& l : leaves) {
-					w.apply(l.free_particule);
+					if (!l.detached) {
+						w.apply(l.free_particule);
+					}
 				}
 
 				for (Branch& b : branches) {
@@ -300,9 +545,28 @@ namespace v2
 		{
 			const RotMat2 mat(b.segment.delta_angle);
 			const Vec2 origin = b.nodes.front().position;
+			b.bbox.reset();
 			for (Node& n : b.nodes) {
 				n.position.rotate(origin, mat);
+				b.bbox.add(n.position);
+			}
+			b.bbox = b.bbox.getInflated(0.5f * b.nodes.front().width);
+		}
+
+		void mergeBoundingBoxes()
+		{
+			bbox.reset();
+			for (const Branch& b : branches) {
+				bbox.merge(b.bbox);
+			}
+		}
+
+		void computeBoundingBoxes()
+		{
+			for (Branch& b : branches) {
+				b.computeBoundingBox();
 			}
+			mergeBoundingBoxes();
 		}
 
 		void translateBranches()
@@ -319,11 +583,78 @@ namespace v2
 			return branches[ref.branch_id].nodes[ref.node_id];
 		}
 
+		// Compact leaves are relative to their node and don't need to be moved
 		void translateLeaves()
 		{
 			for (Leaf& l : leaves) {
-				l.moveTo(getNode(l.attach).position);
+				if (!l.detached) {
+					l.moveTo(getNode(l.attach).position);
+				}
+			}
+		}
+
+		uint64_t getLeavesCount() const
+		{
+			return compact ? compact_leaves.getCount() : leaves.size();
+		}
+
+		// Switches to the compact leaves storage, fails if the tree is too large to pack attachments
+		bool compactLeaves()
+		{
+			if (compact) {
+				return true;
+			}
+			indexLeaves();
+			for (const Leaf& l : leaves) {
+				if (!CompactLeaves::canPack(l.attach.branch_id, l.attach.node_id)) {
+					return false;
+				}
+			}
+
+			compact_leaves.clear();
+			for (const Leaf& l : leaves) {
+				const Vec2 attach = getNode(l.attach).position;
+				compact_leaves.add(l.free_particule.position - attach, l.free_particule.old_position - attach,
+					l.attach.branch_id, l.attach.node_id, l.target_direction, l.color.g, l.size);
+			}
+			compact_leaves.shrinkToFit();
+			leaves.clear();
+			leaves.shrink_to_fit();
+			setDetachableLeaves(false);
+			torn_leaves.shrink_to_fit();
+			compact = true;
+			return true;
+		}
+
+		// Leaves follow their branch analytically instead of being integrated, they have to be compact
+		bool setKinematicLeaves(bool enabled)
+		{
+			if (enabled && !compactLeaves()) {
+				return false;
+			}
+			if (compact) {
+				compact_leaves.setKinematic(enabled);
 			}
+			return true;
+		}
+
+		bool hasKinematicLeaves() const
+		{
+			return compact && compact_leaves.kinematic;
+		}
+
+		// Compact leaves can't be detached
+		bool setDetachableLeaves(bool enabled)
+		{
+			if (enabled && compact) {
+				return false;
+			}
+			detachable_leaves = enabled;
+			torn_leaves.clear();
+			if (enabled) {
+				torn_leaves.reserve(leaves.size());
+			}
+			return true;
 		}
 
 		uint64_t getNodesCount() const
@@ -335,6 +666,19 @@ namespace v2
 			return res;
 		}
 
+		MemoryFootprint memoryFootprint() const
+		{
+			MemoryFootprint footprint;
+			footprint.branches = sizeof(Tree) + branches.capacity() * sizeof(Branch);
+			footprint.nodes = 0;
+			for (const Branch& b : branches) {
+				footprint.nodes += b.nodes.capacity() * sizeof(Node);
+			}
+			footprint.leaves = leaves.capacity() * sizeof(Leaf) + compact_leaves.getMemory() + (leaves_offsets.capacity() + torn_leaves.capacity()) * sizeof(uint32_t);
+			footprint.scaffold = scaffold_memory;
+			return footprint;
+		}
+
 		void generateSkeleton()
 		{
 			for (Branch& b : branches) {
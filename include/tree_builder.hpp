@@ -1,8 +1,10 @@
 #pragma once
+#include <limits>
 #include "tree.hpp"
 #include "number_generator.hpp"
 #include "utils.hpp"
 #include "scaffold.hpp"
+#include "alloc_tracker.hpp"
 
 
 namespace v2
@@ -23,20 +25,60 @@ namespace v2
 		uint32_t max_level;
 	};
 
+	// How a branch starts, its parent's growth is resolved so that it can be regrown alone
+	struct BranchGrowth
+	{
+		// Of the branch's own draws, they don't depend on the other branches
+		uint64_t seed;
+		NodeRef root;
+		uint32_t level;
+		// Parent's growth at the split, before the split parameters are applied
+		Vec2 direction;
+		float length;
+		float width;
+		// Split draws, in [0, 1) and the side
+		float split_var;
+		bool flip;
+
+		BranchGrowth()
+			: seed(0)
+			, root()
+			, level(0)
+			, direction(0.0f, -1.0f)
+			, length(0.0f)
+			, width(0.0f)
+			, split_var(0.5f)
+			, flip(false)
+		{}
+	};
+
+	// Kept next to a tree to regrow it when its configuration changes
+	// Branches are sorted by level, those under a given level are a prefix of the tree's
+	struct TreeGrowth
+	{
+		TreeConf conf;
+		uint64_t seed;
+		std::vector<BranchGrowth> branches;
+
+		TreeGrowth()
+			: conf()
+			, seed(0)
+		{}
+
+		uint64_t getMemory() const
+		{
+			return branches.capacity() * sizeof(BranchGrowth);
+		}
+	};
+
 	struct GrowthResult
 	{
 		bool split;
-		Node node;
-		scaffold::Node sfd_node;
-		uint32_t level;
-		NodeRef root;
+		BranchGrowth branch;
 
 		GrowthResult()
 			: split(false)
-			, node()
-			, sfd_node()
-			, level(0)
-			, root()
+			, branch()
 		{}
 	};
 
@@ -71,21 +113,18 @@ namespace v2
 				// Check for split
 				if (index && (index % 5 == 0) && level < conf.max_level) {
 					result.split = true;
-					float split_angle = conf.branch_split_angle + RNGf::getRange(conf.branch_split_var);
+					BranchGrowth& split = result.branch;
+					split.split_var = RNGf::get();
 					// Determine side
-					if (RNGf::rng(0.5f)) {
-						split_angle = -split_angle;
-					}
-					result.root.node_id = index;
-					result.root.position = new_node.position;
-					result.node.position = start;
-					result.sfd_node.direction = Vec2::getRotated(direction, split_angle);
-					result.sfd_node.length = new_length * conf.branch_length_ratio;
-					result.node.width = new_width * conf.split_width_ratio;
-					result.level = level + 1;
-					result.sfd_node.index = 0;
+					split.flip = RNGf::rng(0.5f);
+					split.root.node_id = index;
+					split.root.position = new_node.position;
+					split.level = level + 1;
+					split.direction = direction;
+					split.length = new_length;
+					split.width = new_width;
 					// Avoid single node branches
-					if (result.node.width < width_threshold) {
+					if (new_width * conf.split_width_ratio < width_threshold) {
 						result.split = false;
 						new_node.width = 0.0f;
 					}
@@ -95,70 +134,209 @@ namespace v2
 			return result;
 		}
 
-		static void grow(scaffold::Tree& sfd_tree, Tree& tree, const TreeConf& conf)
+		// Creates the first node of a branch
+		static Branch sprout(const BranchGrowth& growth, const TreeConf& conf, scaffold::Node& sfd_node)
 		{
-			std::vector<GrowthResult> to_add;
-			uint32_t i(0);
-			for (Branch& b : tree.branches) {
-				scaffold::Branch& sfd_b = sfd_tree.branches[i];
-				GrowthResult res = TreeBuilder::grow(sfd_b, b, conf);
-				if (res.split) {
-					to_add.emplace_back(res);
-					to_add.back().root.branch_id = i;
-				}
-				++i;
+			if (!growth.level) {
+				sfd_node = scaffold::Node(growth.direction, conf.branch_length, 0, 0);
+				return Branch(Node(growth.root.position, conf.branch_width), 0);
 			}
-
-			for (const GrowthResult& res : to_add) {
-				//tree.branches[res.root.branch_id].nodes[res.root.node_id].branch_id = static_cast<uint32_t>(tree.branches.size());
-				sfd_tree.branches.emplace_back(res.sfd_node);
-				tree.branches.emplace_back(res.node, res.level, res.root);
+			float split_angle = conf.branch_split_angle + (growth.split_var - 0.5f) * conf.branch_split_var;
+			if (growth.flip) {
+				split_angle = -split_angle;
 			}
+			sfd_node = scaffold::Node(Vec2::getRotated(growth.direction, split_angle), growth.length * conf.branch_length_ratio, 0, 0);
+			return Branch(Node(growth.root.position, growth.width * conf.split_width_ratio), growth.level, growth.root);
 		}
 
-		static void addLeaves(Tree& tree)
+		// Branches are grown one after the other with their own draws, children are queued so that branches end up sorted by level
+		// Branches queued from end on are left for a later call
+		static void grow(Tree& tree, TreeGrowth& growth, const TreeConf& conf, uint64_t end = std::numeric_limits<uint64_t>::max())
 		{
-			uint32_t branch_id = 0;
-			for (const Branch& b : tree.branches) {
-				const uint64_t nodes_count = b.nodes.size() - 1;
-				const uint32_t leafs_count = 10;
-				int32_t node_id = static_cast<int32_t>(nodes_count);
-				for (uint32_t i(0); i < leafs_count; ++i) {
-					node_id -= i;
-					if (node_id < 0) {
+			PROFILE_SCOPE("TreeBuilder::grow");
+			scaffold::Branch sfd_branch(scaffold::Node{});
+			uint64_t scaffold_memory = 0;
+			for (uint64_t i(tree.branches.size()); i < std::min(end, static_cast<uint64_t>(growth.branches.size())); ++i) {
+				const uint64_t seed = growth.branches[i].seed;
+				sfd_branch.nodes.resize(1);
+				tree.branches.push_back(sprout(growth.branches[i], conf, sfd_branch.nodes.front()));
+				RNGf::setSeed(seed);
+				while (true) {
+					Branch& b = tree.branches[i];
+					const uint64_t nodes_count = b.nodes.size();
+					GrowthResult res = TreeBuilder::grow(sfd_branch, b, conf);
+					if (res.split) {
+						res.branch.seed = hashSeed(seed, res.branch.root.node_id);
+						res.branch.root.branch_id = static_cast<uint32_t>(i);
+						growth.branches.push_back(res.branch);
+					}
+					if (nodes_count == b.nodes.size()) {
 						break;
 					}
-					const float angle = RNGf::getRange(2.0f * PI);
-					const NodeRef anchor(branch_id, node_id, b.nodes[node_id].position);
-					tree.leaves.emplace_back(anchor, Vec2(cos(angle), sin(angle)));
-					tree.leaves.back().size = 1.0f + (0.5f * i / float(leafs_count));
 				}
-				++branch_id;
+				scaffold_memory = std::max(scaffold_memory, static_cast<uint64_t>(sfd_branch.nodes.capacity() * sizeof(scaffold::Node)));
 			}
+			tree.scaffold_memory = scaffold_memory;
 		}
 
-		static Tree build(Vec2 position, const TreeConf& conf)
+		// Leaves of the branches from first on
+		static void addLeaves(Tree& tree, const TreeGrowth& growth, uint64_t first)
 		{
-			// Create root
-			const Node root(position, conf.branch_width);
-			scaffold::Tree sfd_tree;
-			sfd_tree.branches.emplace_back(scaffold::Node(Vec2(0.0f, -1.0f), conf.branch_length, 0, 0));
-			Tree tree;
-			tree.branches.emplace_back(root, 0);
-			// Build the tree
-			uint64_t nodes_count = 0;
-			while (true) {
-				grow(sfd_tree, tree, conf);
-				if (nodes_count == tree.getNodesCount()) {
+			PROFILE_SCOPE("TreeBuilder::addLeaves");
+			const uint64_t branches_count = tree.branches.size();
+			for (uint64_t branch_id(first); branch_id < branches_count; ++branch_id) {
+				addLeaves(tree.leaves, tree.branches[branch_id], static_cast<uint32_t>(branch_id), growth.branches[branch_id].seed);
+			}
+		}
+
+		// Each branch has its own draws, derived from its growth's seed
+		static void addLeaves(std::vector<Leaf>& leaves, const Branch& b, uint32_t branch_id, uint64_t seed)
+		{
+			RNGf::setSeed(hashSeed(seed));
+			const uint64_t nodes_count = b.nodes.size() - 1;
+			const uint32_t leafs_count = 10;
+			int32_t node_id = static_cast<int32_t>(nodes_count);
+			for (uint32_t i(0); i < leafs_count; ++i) {
+				node_id -= i;
+				if (node_id < 0) {
 					break;
 				}
-				nodes_count = tree.getNodesCount();
+				const float angle = RNGf::getRange(2.0f * PI);
+				const NodeRef anchor(branch_id, node_id, b.nodes[node_id].position);
+				leaves.emplace_back(anchor, Vec2(cos(angle), sin(angle)));
+				leaves.back().size = 1.0f + (0.5f * i / float(leafs_count));
 			}
+		}
+
+		// Resets growth to the trunk alone, not grown yet
+		static void plant(TreeGrowth& growth, Vec2 position, const TreeConf& conf, uint64_t seed)
+		{
+			growth.conf = conf;
+			growth.seed = seed;
+			growth.branches.assign(1, BranchGrowth());
+			growth.branches.front().seed = hashSeed(seed);
+			growth.branches.front().root.position = position;
+		}
+
+		// Same seed, same tree, regardless of the thread building it
+		static Tree build(Vec2 position, const TreeConf& conf, uint64_t seed)
+		{
+			TreeGrowth growth;
+			return build(position, conf, seed, growth);
+		}
+
+		// Also returns what regrow needs
+		static Tree build(Vec2 position, const TreeConf& conf, uint64_t seed, TreeGrowth& growth)
+		{
+			PROFILE_SCOPE("TreeBuilder::build");
+			ALLOC_SCOPE(alloc::Builder);
+			plant(growth, position, conf, seed);
+			// Build the tree
+			Tree tree;
+			grow(tree, growth, conf);
 			// Add physic and leaves
-			addLeaves(tree);
-			tree.generateSkeleton();
+			addLeaves(tree, growth, 0);
+			tree.indexLeaves();
+			{
+				PROFILE_SCOPE("TreeBuilder::generateSkeleton");
+				tree.generateSkeleton();
+			}
+			tree.computeBoundingBoxes();
 
 			return tree;
 		}
+
+		// Lowest level of the branches that depend on a parameter that differs, past the last level if none does
+		static uint32_t getFirstChangedLevel(const TreeConf& conf_1, const TreeConf& conf_2)
+		{
+			// Every node depends on these, the split width also decides whether the parent stops growing
+			if (conf_1.branch_width != conf_2.branch_width ||
+				conf_1.branch_width_ratio != conf_2.branch_width_ratio ||
+				conf_1.split_width_ratio != conf_2.split_width_ratio ||
+				conf_1.branch_deviation != conf_2.branch_deviation ||
+				conf_1.branch_length != conf_2.branch_length ||
+				conf_1.branch_length_ratio != conf_2.branch_length_ratio ||
+				conf_1.attraction.x != conf_2.attraction.x ||
+				conf_1.attraction.y != conf_2.attraction.y) {
+				return 0;
+			}
+			uint32_t level = std::max(conf_1.max_level, conf_2.max_level) + 1;
+			// Branches of the last level don't split, which changes their draws
+			if (conf_1.max_level != conf_2.max_level) {
+				level = std::min(conf_1.max_level, conf_2.max_level);
+			}
+			// Only the children's start depends on these, the draws are made either way
+			if (conf_1.branch_split_angle != conf_2.branch_split_angle || conf_1.branch_split_var != conf_2.branch_split_var) {
+				level = std::min(level, 1U);
+			}
+			// branch_split_proba and double_split_proba are not used by the builder
+			return level;
+		}
+
+		// Regrows the branches that depend on the parameters that changed since growth was recorded, the others keep their physics state
+		// Compact trees are rebuilt from scratch, with the regular leaves and the settings of a new tree
+		// Returns the number of regrown branches
+		static uint64_t regrow(Tree& tree, TreeGrowth& growth, const TreeConf& conf)
+		{
+			PROFILE_SCOPE("TreeBuilder::regrow");
+			const uint32_t level = getFirstChangedLevel(growth.conf, conf);
+			growth.conf = conf;
+			// Branches are sorted by level
+			uint64_t first = 0;
+			while (first < tree.branches.size() && tree.branches[first].level < level) {
+				++first;
+			}
+			if (first == tree.branches.size()) {
+				return 0;
+			}
+
+			if (!first || tree.compact) {
+				// The root stays where the tree has been moved to
+				const Vec2 root = tree.branches.front().nodes.front().position;
+				tree = build(growth.branches.front().root.position, conf, growth.seed, growth);
+				const Vec2 delta = root - tree.branches.front().nodes.front().position;
+				for (Branch& b : tree.branches) {
+					b.translateTo(b.root.position + delta);
+				}
+				tree.translateLeaves();
+				tree.mergeBoundingBoxes();
+				return tree.branches.size();
+			}
+
+			ALLOC_SCOPE(alloc::Builder);
+			tree.checkLeavesIndex();
+			const uint32_t leaves_count = tree.leaves_offsets[first];
+			tree.leaves.erase(tree.leaves.begin() + leaves_count, tree.leaves.end());
+			tree.torn_leaves.erase(std::remove_if(tree.torn_leaves.begin(), tree.torn_leaves.end(), [leaves_count](uint32_t k) {
+				return k >= leaves_count;
+			}), tree.torn_leaves.end());
+			tree.branches.erase(tree.branches.begin() + first, tree.branches.end());
+			// Keep how the first regrown level starts, it only depends on the kept parents
+			uint64_t last = first;
+			while (last < growth.branches.size() && growth.branches[last].level == level) {
+				++last;
+			}
+			growth.branches.erase(growth.branches.begin() + last, growth.branches.end());
+
+			grow(tree, growth, conf);
+			const uint64_t branches_count = tree.branches.size();
+			// Grown in the rest pose, then moved to where the parents currently are
+			for (uint64_t i(first); i < branches_count; ++i) {
+				Branch& b = tree.branches[i];
+				b.initializePhysics();
+				// Children start at the node that follows their root, see grow
+				b.translateTo(tree.branches[b.root.branch_id].nodes[b.root.node_id + 1].position);
+				b.computeBoundingBox();
+			}
+			addLeaves(tree, growth, first);
+			const uint64_t total_leaves = tree.leaves.size();
+			for (uint64_t k(leaves_count); k < total_leaves; ++k) {
+				Leaf& l = tree.leaves[k];
+				l.moveTo(tree.getNode(l.attach).position);
+			}
+			tree.indexLeaves();
+			tree.mergeBoundingBoxes();
+			return branches_count - first;
+		}
 	};
 }
@@ -0,0 +1,164 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <chrono>
+#include "tree_builder.hpp"
+
+
+namespace v2
+{
+	// Grows a tree over several frames, the tree is complete and simulated at each step
+	// Branches come in the builder's order, once done the tree is the one TreeBuilder::build returns for the same seed
+	class TreeGrower
+	{
+	public:
+		// Growth steps between two looks at the clock
+		static constexpr uint32_t ClockPeriod = 16;
+
+		TreeGrower()
+			: m_sfd_branch(scaffold::Node{})
+			, m_branch_id(0)
+			, m_rng_state(0)
+			, m_done(true)
+		{}
+
+		// The tree only has the first nodes of the trunk
+		Tree start(Vec2 position, const TreeConf& conf, uint64_t seed)
+		{
+			TreeBuilder::plant(m_growth, position, conf, seed);
+			m_branch_id = 0;
+			m_done = false;
+			sprout();
+
+			Tree tree;
+			advance(tree, 0.0f);
+			return tree;
+		}
+
+		// Makes at least ClockPeriod growth steps and stops once budget_us microseconds are spent, returns true when the tree is done
+		// The thread's number generator is left as it was
+		bool advance(Tree& tree, float budget_us)
+		{
+			if (m_done) {
+				return true;
+			}
+			PROFILE_SCOPE("TreeGrower::advance");
+			ALLOC_SCOPE(alloc::Builder);
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const uint64_t rng_state = RNGf::getState();
+			RNGf::setState(m_rng_state);
+			const uint64_t leaves_count = tree.leaves.size();
+			uint32_t steps = 0;
+			while (true) {
+				const uint64_t nodes_count = m_branch.nodes.size();
+				GrowthResult res = TreeBuilder::grow(m_sfd_branch, m_branch, m_growth.conf);
+				if (res.split) {
+					res.branch.seed = hashSeed(m_growth.branches[m_branch_id].seed, res.branch.root.node_id);
+					res.branch.root.branch_id = static_cast<uint32_t>(m_branch_id);
+					m_growth.branches.push_back(res.branch);
+				}
+				if (nodes_count == m_branch.nodes.size()) {
+					completeBranch(tree);
+					if (m_done) {
+						break;
+					}
+				}
+				if (++steps % ClockPeriod == 0 && getElapsed(start) >= budget_us) {
+					break;
+				}
+			}
+			m_rng_state = RNGf::getState();
+			RNGf::setState(rng_state);
+
+			if (!m_done && m_branch.nodes.size() > 1) {
+				writeBranch(tree);
+			}
+			tree.leaves_offsets.resize(tree.branches.size() + 1, static_cast<uint32_t>(tree.leaves.size()));
+			// New leaves are moved to where their nodes currently are, the branch having been translated to its parent
+			const uint64_t new_leaves_count = tree.leaves.size();
+			for (uint64_t k(leaves_count); k < new_leaves_count; ++k) {
+				Leaf& l = tree.leaves[k];
+				l.moveTo(tree.getNode(l.attach).position);
+				tree.max_leaf_size = std::max(tree.max_leaf_size, l.size);
+			}
+			tree.mergeBoundingBoxes();
+			tree.scaffold_memory = m_sfd_branch.nodes.capacity() * sizeof(scaffold::Node);
+			return m_done;
+		}
+
+		bool isDone() const
+		{
+			return m_done;
+		}
+
+		// Branches known so far, grown or not
+		const TreeGrowth& getGrowth() const
+		{
+			return m_growth;
+		}
+
+		uint64_t getMemory() const
+		{
+			return m_growth.getMemory() + m_sfd_branch.nodes.capacity() * sizeof(scaffold::Node) + m_branch.nodes.capacity() * sizeof(Node);
+		}
+
+	private:
+		TreeGrowth m_growth;
+		scaffold::Branch m_sfd_branch;
+		// In the rest pose
+		Branch m_branch;
+		uint64_t m_branch_id;
+		uint64_t m_rng_state;
+		bool m_done;
+
+		void sprout()
+		{
+			const BranchGrowth& growth = m_growth.branches[m_branch_id];
+			m_sfd_branch.nodes.resize(1);
+			m_branch = TreeBuilder::sprout(growth, m_growth.conf, m_sfd_branch.nodes.front());
+			// Same draws as TreeBuilder::grow
+			m_rng_state = growth.seed;
+		}
+
+		// The branch gets its leaves, then the next one is started
+		void completeBranch(Tree& tree)
+		{
+			writeBranch(tree);
+			// Leaves come in the branches' order, only the offsets of the new ones are needed
+			const uint32_t first_leaf = static_cast<uint32_t>(tree.leaves.size());
+			TreeBuilder::addLeaves(tree.leaves, m_branch, static_cast<uint32_t>(m_branch_id), m_growth.branches[m_branch_id].seed);
+			tree.leaves_offsets.resize(m_branch_id + 2);
+			tree.leaves_offsets[m_branch_id] = first_leaf;
+			tree.leaves_offsets[m_branch_id + 1] = static_cast<uint32_t>(tree.leaves.size());
+			++m_branch_id;
+			if (m_branch_id == m_growth.branches.size()) {
+				m_done = true;
+				return;
+			}
+			sprout();
+			RNGf::setState(m_rng_state);
+		}
+
+		// The branch's physics start over from the rest pose, then it is moved to where its parent currently is
+		void writeBranch(Tree& tree) const
+		{
+			if (tree.branches.size() == m_branch_id) {
+				tree.branches.push_back(m_branch);
+			}
+			else {
+				tree.branches[m_branch_id] = m_branch;
+			}
+			Branch& b = tree.branches[m_branch_id];
+			b.initializePhysics();
+			if (m_branch_id) {
+				// Children start at the node that follows their root, see TreeBuilder::grow
+				b.translateTo(tree.branches[b.root.branch_id].nodes[b.root.node_id + 1].position);
+			}
+			b.computeBoundingBox();
+		}
+
+		static float getElapsed(std::chrono::steady_clock::time_point start)
+		{
+			return std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+		}
+	};
+}
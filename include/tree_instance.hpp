@@ -0,0 +1,226 @@
+#pragma once
+#include <memory>
+#include "tree.hpp"
+
+
+namespace v2
+{
+	// Immutable data shared by every instance of a tree, positions are stored relative to the root
+	struct TreeArchetype
+	{
+		using Ptr = std::shared_ptr<const TreeArchetype>;
+
+		struct BranchInfo
+		{
+			uint32_t nodes_offset;
+			uint32_t nodes_count;
+			uint32_t level;
+			// Attach node in the parent branch
+			uint32_t parent_id;
+			uint32_t parent_node_id;
+			// Rest pose
+			Vec2 origin;
+			float rest_angle;
+			// Physics
+			Vec2 direction;
+			float length;
+		};
+
+		struct LeafInfo
+		{
+			uint32_t node_id;
+			Vec2 rest_direction;
+			Vec2 target_direction;
+			sf::Color color;
+			float size;
+		};
+
+		std::vector<BranchInfo> branches;
+		// Nodes positions relative to their branch's first node
+		std::vector<Vec2> nodes;
+		std::vector<float> widths;
+		// Leaves are sorted by branch, those of branch i are in [leaves_offsets[i], leaves_offsets[i + 1])
+		std::vector<LeafInfo> leaves;
+		std::vector<uint32_t> leaves_offsets;
+
+		Vec2 getNode(uint32_t branch_id, uint32_t node_id) const
+		{
+			return nodes[branches[branch_id].nodes_offset + node_id];
+		}
+
+		// The tree is expected to be in its rest pose, as returned by TreeBuilder::build
+		static Ptr create(const Tree& tree)
+		{
+			std::shared_ptr<TreeArchetype> archetype = std::make_shared<TreeArchetype>();
+			const Vec2 root = tree.branches.front().nodes.front().position;
+
+			archetype->branches.reserve(tree.branches.size());
+			archetype->nodes.reserve(tree.getNodesCount());
+			archetype->widths.reserve(tree.getNodesCount());
+			for (const Branch& b : tree.branches) {
+				BranchInfo info;
+				info.nodes_offset = static_cast<uint32_t>(archetype->nodes.size());
+				info.nodes_count = static_cast<uint32_t>(b.nodes.size());
+				info.level = b.level;
+				info.parent_id = b.root.branch_id;
+				info.parent_node_id = b.root.node_id;
+				info.origin = b.nodes.front().position - root;
+				info.rest_angle = b.segment.last_angle;
+				info.direction = b.segment.direction;
+				info.length = b.segment.length;
+				archetype->branches.push_back(info);
+
+				const Vec2 origin = b.nodes.front().position;
+				for (const Node& n : b.nodes) {
+					archetype->nodes.push_back(n.position - origin);
+					archetype->widths.push_back(n.width);
+				}
+			}
+
+			// Counting sort of the leaves by branch
+			std::vector<uint32_t>& offsets = archetype->leaves_offsets;
+			offsets.assign(tree.branches.size() + 1, 0);
+			for (const Leaf& l : tree.leaves) {
+				++offsets[l.attach.branch_id + 1];
+			}
+			for (uint64_t i(1); i < offsets.size(); ++i) {
+				offsets[i] += offsets[i - 1];
+			}
+			std::vector<uint32_t> cursors(offsets.begin(), offsets.end() - 1);
+			archetype->leaves.resize(tree.leaves.size());
+			for (const Leaf& l : tree.leaves) {
+				LeafInfo& info = archetype->leaves[cursors[l.attach.branch_id]++];
+				info.node_id = l.attach.node_id;
+				info.rest_direction = l.free_particule.position - l.attach.position;
+				info.target_direction = l.target_direction;
+				info.color = l.color;
+				info.size = l.size;
+			}
+
+			return archetype;
+		}
+	};
+
+	// Dynamic state of a branch, nodes positions are derived from the archetype's rest pose
+	struct BranchState
+	{
+		Vec2 attach_point;
+		Particule moving_point;
+		float last_angle;
+	};
+
+	struct TreeInstance
+	{
+		TreeArchetype::Ptr archetype;
+		Vec2 position;
+		std::vector<BranchState> branches;
+		std::vector<Particule> leaves;
+
+		TreeInstance(TreeArchetype::Ptr tree_archetype, Vec2 pos)
+			: archetype(tree_archetype)
+			, position(pos)
+		{
+			branches.reserve(archetype->branches.size());
+			uint32_t branch_id = 0;
+			for (const TreeArchetype::BranchInfo& info : archetype->branches) {
+				BranchState state;
+				state.attach_point = position + info.origin;
+				state.moving_point = Particule(state.attach_point + archetype->getNode(branch_id, info.nodes_count - 1));
+				state.last_angle = info.rest_angle;
+				branches.push_back(state);
+				++branch_id;
+			}
+
+			leaves.reserve(archetype->leaves.size());
+			branch_id = 0;
+			for (const BranchState& state : branches) {
+				const uint32_t leaves_end = archetype->leaves_offsets[branch_id + 1];
+				for (uint32_t k(archetype->leaves_offsets[branch_id]); k < leaves_end; ++k) {
+					const TreeArchetype::LeafInfo& info = archetype->leaves[k];
+					leaves.emplace_back(state.attach_point + archetype->getNode(branch_id, info.node_id) + info.rest_direction);
+				}
+				++branch_id;
+			}
+		}
+
+		RotMat2 getRotation(uint32_t branch_id) const
+		{
+			return RotMat2(branches[branch_id].last_angle - archetype->branches[branch_id].rest_angle);
+		}
+
+		Vec2 getNodePosition(uint32_t branch_id, uint32_t node_id, const RotMat2& mat) const
+		{
+			Vec2 position = archetype->getNode(branch_id, node_id);
+			position.rotate(mat);
+			return branches[branch_id].attach_point + position;
+		}
+
+		Vec2 getNodePosition(uint32_t branch_id, uint32_t node_id) const
+		{
+			return getNodePosition(branch_id, node_id, getRotation(branch_id));
+		}
+
+		// Same single top-down pass as Tree::updateFused
+		void update(float dt)
+		{
+			const TreeArchetype& arch = *archetype;
+			const uint64_t branches_count = branches.size();
+			for (uint64_t i(0); i < branches_count; ++i) {
+				const uint32_t branch_id = static_cast<uint32_t>(i);
+				const TreeArchetype::BranchInfo& info = arch.branches[i];
+				BranchState& state = branches[i];
+				const Vec2 old_attach = state.attach_point;
+				const RotMat2 old_mat = getRotation(branch_id);
+				// Segment physics
+				const Vec2 delta = state.moving_point.position - state.attach_point;
+				const float dist = delta.getLength();
+				state.moving_point.move(delta * ((info.length - dist) / dist));
+				state.moving_point.acceleration += info.direction;
+				state.moving_point.update(dt);
+				state.last_angle = (state.moving_point.position - state.attach_point).getAngle();
+				// Re-anchor to the parent's node
+				if (i) {
+					const Vec2 anchor = getNodePosition(info.parent_id, info.parent_node_id);
+					const Vec2 translation = anchor - state.attach_point;
+					state.attach_point = anchor;
+					state.moving_point.position += translation;
+					state.moving_point.old_position += translation;
+				}
+				// Leaves
+				const RotMat2 mat = getRotation(branch_id);
+				const uint32_t leaves_end = arch.leaves_offsets[i + 1];
+				for (uint32_t k(arch.leaves_offsets[i]); k < leaves_end; ++k) {
+					const TreeArchetype::LeafInfo& leaf_info = arch.leaves[k];
+					Particule& p = leaves[k];
+					Vec2 old_node = arch.getNode(branch_id, leaf_info.node_id);
+					Vec2 new_node = old_node;
+					old_node.rotate(old_mat);
+					new_node.rotate(mat);
+					// Same as Leaf::update
+					Vec2 to_leaf = p.position - (old_attach + old_node);
+					const float length = to_leaf.normalize();
+					p.move(to_leaf * (1.0f - length));
+					p.update(dt);
+					p.acceleration = leaf_info.target_direction;
+					// Same as Leaf::moveTo
+					const Vec2 translation = (state.attach_point + new_node) - (old_attach + old_node);
+					p.position += translation;
+					p.old_position += translation;
+				}
+			}
+		}
+
+		void applyWind(const std::vector<Wind>& wind)
+		{
+			for (const Wind& w : wind) {
+				for (Particule& p : leaves) {
+					w.apply(p);
+				}
+
+				for (BranchState& b : branches) {
+					w.apply(b.moving_point);
+				}
+			}
+		}
+	};
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include "tree.hpp"
+
+
+namespace v2
+{
+	const uint32_t LodNone = 0xFFFFFFFF;
+
+	struct TreeLod
+	{
+		Tree tree;
+		// Full detail index of each branch
+		std::vector<uint32_t> source_branches;
+		// Index of each full detail branch in this level, LodNone if it has been dropped
+		std::vector<uint32_t> branches_index;
+	};
+
+	struct LodTree
+	{
+		// levels[0] is the full detail tree
+		std::vector<TreeLod> levels;
+		// On screen height in pixels under which levels[i + 1] is used
+		std::vector<float> thresholds;
+		float hysteresis;
+		float height;
+		uint32_t active;
+
+		LodTree()
+			: hysteresis(0.15f)
+			, height(0.0f)
+			, active(0)
+		{}
+
+		Tree& getTree()
+		{
+			return levels[active].tree;
+		}
+
+		const Tree& getTree() const
+		{
+			return levels[active].tree;
+		}
+
+		// Select the level from the size the tree would have on screen
+		void updateLod(float pixels_per_unit)
+		{
+			const float screen_size = height * pixels_per_unit;
+			uint32_t target = active;
+			while (target + 1 < levels.size() && screen_size < thresholds[target] * (1.0f - hysteresis)) {
+				++target;
+			}
+			while (target > 0 && screen_size > thresholds[target - 1] * (1.0f + hysteresis)) {
+				--target;
+			}
+			setActive(target);
+		}
+
+		void setActive(uint32_t level)
+		{
+			if (level == active) {
+				return;
+			}
+			transferState(levels[active], levels[level]);
+			active = level;
+		}
+
+		void update(float dt)
+		{
+			getTree().updateFused(dt);
+		}
+
+		void applyWind(const std::vector<Wind>& wind)
+		{
+			getTree().applyWind(wind);
+		}
+
+	private:
+		// Bring the new level into the pose of the current one so that switching is seamless
+		static void transferState(const TreeLod& from, TreeLod& to)
+		{
+			Tree& tree = to.tree;
+			const uint64_t branches_count = tree.branches.size();
+			for (uint64_t i(0); i < branches_count; ++i) {
+				Branch& b = tree.branches[i];
+				const uint32_t src_id = from.branches_index[to.source_branches[i]];
+				if (src_id != LodNone) {
+					const Branch& src = from.tree.branches[src_id];
+					const RotMat2 mat(src.segment.last_angle - b.segment.last_angle);
+					const Vec2 origin = b.nodes.front().position;
+					for (Node& n : b.nodes) {
+						n.position.rotate(origin, mat);
+					}
+					b.segment = src.segment;
+					const Vec2 delta = src.nodes.front().position - origin;
+					for (Node& n : b.nodes) {
+						n.position += delta;
+					}
+					// Parents are already transferred, the offset to the mapped node is kept as generateLevel sets it up
+					b.root.position = tree.getNode(b.root).position;
+				}
+				else if (i) {
+					b.translateTo(tree.getNode(b.root).position);
+				}
+			}
+			tree.translateLeaves();
+			tree.computeBoundingBoxes();
+		}
+	};
+
+	struct LodBuilder
+	{
+		// Each level halves the nodes count, drops the highest level branches and merges leaves by groups
+		static LodTree generate(const Tree& tree, uint32_t levels_count, float base_threshold = 400.0f)
+		{
+			LodTree lod;
+			uint32_t max_level = 0;
+			float min_y = tree.branches.front().nodes.front().position.y;
+			float max_y = min_y;
+			for (const Branch& b : tree.branches) {
+				max_level = std::max(max_level, b.level);
+				for (const Node& n : b.nodes) {
+					min_y = std::min(min_y, n.position.y);
+					max_y = std::max(max_y, n.position.y);
+				}
+			}
+			lod.height = max_y - min_y;
+
+			float threshold = base_threshold;
+			for (uint32_t i(0); i < levels_count; ++i) {
+				lod.levels.push_back(generateLevel(tree, i, max_level));
+				if (i + 1 < levels_count) {
+					lod.thresholds.push_back(threshold);
+					threshold *= 0.5f;
+				}
+			}
+			return lod;
+		}
+
+		static TreeLod generateLevel(const Tree& tree, uint32_t level, uint32_t max_level)
+		{
+			TreeLod lod;
+			const uint32_t node_step = 1 << level;
+			const uint32_t max_branch_level = level > max_level ? 0 : max_level - level;
+			const uint64_t branches_count = tree.branches.size();
+			// Keep branches of low level only, parents are always before their children
+			lod.branches_index.assign(branches_count, LodNone);
+			for (uint64_t i(0); i < branches_count; ++i) {
+				const Branch& b = tree.branches[i];
+				if (b.level > max_branch_level) {
+					continue;
+				}
+				lod.branches_index[i] = static_cast<uint32_t>(lod.source_branches.size());
+				lod.source_branches.push_back(static_cast<uint32_t>(i));
+
+				Branch branch(b.nodes.front(), b.level, b.root);
+				const uint64_t nodes_count = b.nodes.size();
+				for (uint64_t k(node_step); k < nodes_count - 1; k += node_step) {
+					branch.nodes.push_back(b.nodes[k]);
+				}
+				if (nodes_count > 1) {
+					branch.nodes.push_back(b.nodes.back());
+				}
+				// Same end nodes, the segment and its rest direction are kept even if the tree is not at rest
+				branch.segment = b.segment;
+				if (i) {
+					branch.root.branch_id = lod.branches_index[b.root.branch_id];
+					branch.root.node_id = mapNode(b.root.node_id, node_step, tree.branches[b.root.branch_id]);
+					branch.root.position = lod.tree.getNode(branch.root).position;
+				}
+				lod.tree.branches.push_back(branch);
+			}
+
+			// Leaves are attached to the closest kept node, then merged by groups
+			struct Anchor
+			{
+				uint32_t branch_id;
+				uint32_t node_id;
+				uint32_t leaf_id;
+			};
+			std::vector<Anchor> anchors;
+			anchors.reserve(tree.leaves.size());
+			uint32_t leaf_id = 0;
+			for (const Leaf& l : tree.leaves) {
+				uint32_t branch_id = l.attach.branch_id;
+				uint32_t node_id = l.attach.node_id;
+				while (lod.branches_index[branch_id] == LodNone) {
+					node_id = tree.branches[branch_id].root.node_id;
+					branch_id = tree.branches[branch_id].root.branch_id;
+				}
+				anchors.push_back({lod.branches_index[branch_id], mapNode(node_id, node_step, tree.branches[branch_id]), leaf_id++});
+			}
+			std::stable_sort(anchors.begin(), anchors.end(), [](const Anchor& a1, const Anchor& a2) {
+				return a1.branch_id < a2.branch_id || (a1.branch_id == a2.branch_id && a1.node_id < a2.node_id);
+			});
+
+			const uint32_t group_size = node_step;
+			const uint64_t anchors_count = anchors.size();
+			uint64_t i(0);
+			while (i < anchors_count) {
+				const Anchor& first = anchors[i];
+				uint64_t end = i + 1;
+				while (end < anchors_count && end - i < group_size && anchors[end].branch_id == first.branch_id && anchors[end].node_id == first.node_id) {
+					++end;
+				}
+				const uint32_t count = static_cast<uint32_t>(end - i);
+				// Keep the first leaf of the group, with an area matching the whole group
+				Leaf leaf = tree.leaves[first.leaf_id];
+				uint32_t green = 0;
+				float area = 0.0f;
+				for (uint64_t k(i); k < end; ++k) {
+					const Leaf& l = tree.leaves[anchors[k].leaf_id];
+					green += l.color.g;
+					area += l.size * l.size;
+				}
+				leaf.color.g = static_cast<uint8_t>(green / count);
+				leaf.size = sqrt(area);
+				leaf.attach.branch_id = first.branch_id;
+				leaf.attach.node_id = first.node_id;
+				leaf.moveTo(lod.tree.getNode(leaf.attach).position);
+				lod.tree.leaves.push_back(leaf);
+				i = end;
+			}
+
+			lod.tree.indexLeaves();
+			lod.tree.computeBoundingBoxes();
+			return lod;
+		}
+
+	private:
+		static uint32_t mapNode(uint32_t node_id, uint32_t node_step, const Branch& source)
+		{
+			// Same rounding as the nodes kept by generateLevel, the last node is always kept
+			const uint32_t last = static_cast<uint32_t>(source.nodes.size()) - 1;
+			if (node_id >= last) {
+				return (last + node_step - 1) / node_step;
+			}
+			return (node_id + node_step / 2) / node_step;
+		}
+	};
+}
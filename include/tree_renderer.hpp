@@ -1,6 +1,11 @@
 #pragma once
 #include <SFML/Graphics.hpp>
 #include "tree.hpp"
+#include "tree_instance.hpp"
+#include "baked_wind.hpp"
+#include "leaf_vertex_generator.hpp"
+#include "forest_render_data.hpp"
+#include "swarm.hpp"
 
 
 class TreeRenderer
@@ -40,52 +45,413 @@ public:
 
 	static void generateRenderData(const v2::Tree& tree, std::vector<sf::VertexArray>& branches_va, sf::VertexArray& leaves_va)
 	{
-		// Create branches
-		branches_va.clear();
+		generateRenderData(tree, branches_va, leaves_va, BoundingBox::infinite());
+	}
+
+	// Only branches and leaves overlapping the view are generated
+	static void generateRenderData(const v2::Tree& tree, std::vector<sf::VertexArray>& branches_va, sf::VertexArray& leaves_va, const BoundingBox& view)
+	{
+		PROFILE_SCOPE("TreeRenderer::generateRenderData");
+		const float leaf_length = LeafVertexGenerator::LeafLength;
+		const float leaf_width = LeafVertexGenerator::LeafWidth;
+		const float leaves_margin = LeafVertexGenerator::getMargin(tree);
+		if (!tree.bbox.getInflated(leaves_margin).intersects(view)) {
+			leaves_va.clear();
+			clearBranches(branches_va, 0);
+			return;
+		}
+
+		generateBranches(tree, branches_va, view);
+		leaves_va.resize(4 * tree.getLeavesCount());
+		sf::Vertex* const leaves_first = leaves_va.getVertexCount() ? &leaves_va[0] : nullptr;
+		sf::Vertex* leaves_out = leaves_first;
+		const uint64_t branches_count = tree.branches.size();
+		for (uint64_t branch_id(0); branch_id < branches_count; ++branch_id) {
+			const v2::Branch& b = tree.branches[branch_id];
+			if (!b.bbox.getInflated(leaves_margin).intersects(view)) {
+				continue;
+			}
+			const uint32_t leaves_end = tree.getActiveLeavesEnd(branch_id);
+			if (tree.compact) {
+				const v2::CompactLeaves& leaves = tree.compact_leaves;
+				for (uint32_t k(tree.leaves_offsets[branch_id]); k < leaves_end; ++k) {
+					const float size = leaves.getSize(k);
+					const Vec2 leaf_dir = leaves.getDir(k).getNormalized();
+					const Vec2 dir = leaf_dir * leaf_length * size;
+					const Vec2 nrm = leaf_dir.getNormal() * (0.5f * leaf_width * size);
+					leaves_out = addLeaf(leaves_out, b.nodes[leaves.getNodeId(k)].position, dir, nrm, sf::Color(255, leaves.hue[k], 0));
+				}
+				continue;
+			}
+			for (uint32_t k(tree.leaves_offsets[branch_id]); k < leaves_end; ++k) {
+				const v2::Leaf& l = tree.leaves[k];
+				if (l.detached) {
+					continue;
+				}
+				const Vec2 leaf_dir = l.getDir().getNormalized();
+				const Vec2 dir = leaf_dir * leaf_length * l.size;
+				const Vec2 nrm = leaf_dir.getNormal() * (0.5f * leaf_width* l.size);
+				leaves_out = addLeaf(leaves_out, l.getPosition(), dir, nrm, l.color);
+			}
+		}
+		leaves_va.resize(leaves_out - leaves_first);
+	}
+
+	// Leaves are written by the generator in its contiguous buffer, see LeafVertexGenerator
+	static void generateRenderData(const v2::Tree& tree, std::vector<sf::VertexArray>& branches_va, LeafVertexGenerator& leaves, const BoundingBox& view)
+	{
+		PROFILE_SCOPE("TreeRenderer::generateRenderData");
+		leaves.initialize(tree);
+		if (!leaves.cull(tree, view)) {
+			clearBranches(branches_va, 0);
+			return;
+		}
+		generateBranches(tree, branches_va, view);
+		leaves.generate(tree);
+	}
+
+	// Whole forest on the calling thread
+	static void generateRenderData(const std::vector<const v2::Tree*>& trees, ForestRenderData& data, const BoundingBox& view)
+	{
+		PROFILE_SCOPE("TreeRenderer::generateRenderData");
+		prepareForest(trees, data, view);
+		for (const ForestRenderData::Task& task : data.tasks) {
+			generateTask(*trees[task.tree_id], data, task);
+		}
+	}
+
+	// Whole forest on the swarm's threads, tasks of about TaskVertices vertices are picked by idle threads
+	// Each task writes a slice of the shared buffers computed beforehand so no merge or lock is needed
+	static void generateRenderData(const std::vector<const v2::Tree*>& trees, ForestRenderData& data, const BoundingBox& view, swrm::Swarm& swarm)
+	{
+		PROFILE_SCOPE("TreeRenderer::generateRenderData");
+		prepareForest(trees, data, view);
+		if (data.tasks.empty()) {
+			return;
+		}
+
+		struct Context
+		{
+			const std::vector<const v2::Tree*>& trees;
+			ForestRenderData& data;
+			std::atomic<uint32_t> next_task;
+		};
+		Context context{trees, data, {0}};
+		// A single capture keeps the job in std::function's local storage
+		swarm.execute([&context](uint32_t, uint32_t) {
+			PROFILE_SCOPE("TreeRenderer::generateTasks");
+			const uint32_t tasks_count = static_cast<uint32_t>(context.data.tasks.size());
+			for (uint32_t i(context.next_task++); i < tasks_count; i = context.next_task++) {
+				const ForestRenderData::Task& task = context.data.tasks[i];
+				generateTask(*context.trees[task.tree_id], context.data, task);
+			}
+		}).waitExecutionDone();
+	}
+
+	// All the instances of an archetype in one pass, branches are output as sf::Triangles
+	static void generateRenderData(const v2::TreeArchetype& archetype, const std::vector<v2::TreeInstance>& instances, sf::VertexArray& branches_va, sf::VertexArray& leaves_va)
+	{
+		PROFILE_SCOPE("TreeRenderer::generateRenderData");
+		uint64_t branches_vertices = 0;
+		for (const v2::TreeArchetype::BranchInfo& info : archetype.branches) {
+			branches_vertices += getBranchVerticesCount(info);
+		}
+		branches_va.setPrimitiveType(sf::Triangles);
+		branches_va.resize(branches_vertices * instances.size());
+		leaves_va.setPrimitiveType(sf::Quads);
+		leaves_va.resize(4 * archetype.leaves.size() * instances.size());
+
+		sf::Vertex* branches_out = branches_va.getVertexCount() ? &branches_va[0] : nullptr;
+		sf::Vertex* leaves_out = leaves_va.getVertexCount() ? &leaves_va[0] : nullptr;
+		const float leaf_length = LeafVertexGenerator::LeafLength;
+		const float leaf_width = LeafVertexGenerator::LeafWidth;
+		for (const v2::TreeInstance& instance : instances) {
+			const uint64_t branches_count = archetype.branches.size();
+			for (uint64_t branch_id(0); branch_id < branches_count; ++branch_id) {
+				const v2::TreeArchetype::BranchInfo& info = archetype.branches[branch_id];
+				const RotMat2 mat = instance.getRotation(static_cast<uint32_t>(branch_id));
+				const Vec2 origin = instance.branches[branch_id].attach_point;
+				branches_out = writeBranch(archetype, info, mat, origin, branches_out);
+
+				const uint32_t leaves_end = archetype.leaves_offsets[branch_id + 1];
+				for (uint32_t k(archetype.leaves_offsets[branch_id]); k < leaves_end; ++k) {
+					const v2::TreeArchetype::LeafInfo& leaf = archetype.leaves[k];
+					Vec2 attach = archetype.nodes[info.nodes_offset + leaf.node_id];
+					attach.rotate(mat);
+					attach += origin;
+					const Vec2 leaf_dir = (instance.leaves[k].position - attach).getNormalized();
+					const Vec2 dir = leaf_dir * leaf_length * leaf.size;
+					const Vec2 nrm = leaf_dir.getNormal() * (0.5f * leaf_width * leaf.size);
+					leaves_out = addLeaf(leaves_out, attach, dir, nrm, leaf.color);
+				}
+			}
+		}
+	}
+
+	// Instances replaying a baked loop, each frame is a lookup in the loop's tables
+	// Only instances intersecting the view are generated, branches are output as sf::Triangles
+	static void generateRenderData(const v2::BakedWind& baked, const std::vector<v2::BakedInstance>& instances, float time, sf::VertexArray& branches_va, sf::VertexArray& leaves_va, const BoundingBox& view)
+	{
+		PROFILE_SCOPE("TreeRenderer::generateBaked");
+		const v2::TreeArchetype& archetype = *baked.archetype;
+		const float leaf_length = LeafVertexGenerator::LeafLength;
+		const float leaf_width = LeafVertexGenerator::LeafWidth;
+		const BoundingBox bounds = baked.bounds.getInflated((leaf_length + 0.5f * leaf_width) * baked.max_leaf_size);
+		uint64_t branches_vertices = 0;
+		for (const v2::TreeArchetype::BranchInfo& info : archetype.branches) {
+			branches_vertices += getBranchVerticesCount(info);
+		}
+		uint64_t visible_count = 0;
+		for (const v2::BakedInstance& instance : instances) {
+			BoundingBox instance_bounds = bounds;
+			instance_bounds.translate(instance.position);
+			visible_count += instance_bounds.intersects(view) ? 1 : 0;
+		}
+		branches_va.setPrimitiveType(sf::Triangles);
+		branches_va.resize(branches_vertices * visible_count);
+		leaves_va.setPrimitiveType(sf::Quads);
+		leaves_va.resize(4 * archetype.leaves.size() * visible_count);
+
+		sf::Vertex* branches_out = branches_va.getVertexCount() ? &branches_va[0] : nullptr;
+		sf::Vertex* leaves_out = leaves_va.getVertexCount() ? &leaves_va[0] : nullptr;
+		const uint64_t branches_count = archetype.branches.size();
+		for (const v2::BakedInstance& instance : instances) {
+			BoundingBox instance_bounds = bounds;
+			instance_bounds.translate(instance.position);
+			if (!instance_bounds.intersects(view)) {
+				continue;
+			}
+			const uint32_t frame = baked.getFrame(time + instance.phase);
+			const v2::BakedWind::BranchFrame* branches = baked.getBranches(frame);
+			const v2::BakedWind::LeafFrame* leaves = baked.getLeaves(frame);
+			for (uint64_t branch_id(0); branch_id < branches_count; ++branch_id) {
+				const v2::TreeArchetype::BranchInfo& info = archetype.branches[branch_id];
+				const RotMat2 mat = v2::BakedWind::getRotation(branches[branch_id]);
+				const Vec2 origin = instance.position + branches[branch_id].origin;
+				branches_out = writeBranch(archetype, info, mat, origin, branches_out);
+
+				const uint32_t leaves_end = archetype.leaves_offsets[branch_id + 1];
+				for (uint32_t k(archetype.leaves_offsets[branch_id]); k < leaves_end; ++k) {
+					const v2::TreeArchetype::LeafInfo& leaf = archetype.leaves[k];
+					Vec2 attach = archetype.nodes[info.nodes_offset + leaf.node_id];
+					attach.rotate(mat);
+					attach += origin;
+					const Vec2 leaf_dir = v2::BakedWind::getDirection(leaves[k]);
+					const Vec2 dir = leaf_dir * leaf_length * leaf.size;
+					const Vec2 nrm = leaf_dir.getNormal() * (0.5f * leaf_width * leaf.size);
+					leaves_out = addLeaf(leaves_out, attach, dir, nrm, leaf.color);
+				}
+			}
+		}
+	}
+
+private:
+	static constexpr uint64_t TaskVertices = 8192;
+
+	// Visibility, tasks and slices, serial
+	static void prepareForest(const std::vector<const v2::Tree*>& trees, ForestRenderData& data, const BoundingBox& view)
+	{
+		data.tasks.clear();
+		data.visibility.clear();
+		uint64_t branches_vertices(0);
+		uint64_t leaves_vertices(0);
+		const uint32_t trees_count = static_cast<uint32_t>(trees.size());
+		for (uint32_t tree_id(0); tree_id < trees_count; ++tree_id) {
+			const v2::Tree& tree = *trees[tree_id];
+			const float margin = LeafVertexGenerator::getMargin(tree);
+			if (!tree.bbox.getInflated(margin).intersects(view)) {
+				continue;
+			}
+
+			const uint32_t branches_count = static_cast<uint32_t>(tree.branches.size());
+			ForestRenderData::Task task{tree_id, 0, 0, data.visibility.size(), branches_vertices, leaves_vertices};
+			uint64_t task_vertices(0);
+			for (uint32_t branch_id(0); branch_id < branches_count; ++branch_id) {
+				const v2::Branch& b = tree.branches[branch_id];
+				uint8_t flags = 0;
+				if (b.bbox.intersects(view)) {
+					flags |= ForestRenderData::BranchVisible;
+					const uint64_t count = ForestRenderData::getBranchVerticesCount(b);
+					branches_vertices += count;
+					task_vertices += count;
+				}
+				if (b.bbox.getInflated(margin).intersects(view)) {
+					flags |= ForestRenderData::LeavesVisible;
+					const uint64_t count = 4 * (tree.getActiveLeavesEnd(branch_id) - tree.leaves_offsets[branch_id]);
+					leaves_vertices += count;
+					task_vertices += count;
+				}
+				data.visibility.push_back(flags);
+
+				if (task_vertices >= TaskVertices) {
+					task.branches_last = branch_id + 1;
+					data.tasks.push_back(task);
+					task = ForestRenderData::Task{tree_id, branch_id + 1, branch_id + 1, data.visibility.size(), branches_vertices, leaves_vertices};
+					task_vertices = 0;
+				}
+			}
+			task.branches_last = branches_count;
+			if (task.branches_first < task.branches_last) {
+				data.tasks.push_back(task);
+			}
+		}
+		data.branches_vertices_count = branches_vertices;
+		data.leaves_vertices_count = leaves_vertices;
+		data.reserve();
+	}
+
+	static void generateTask(const v2::Tree& tree, ForestRenderData& data, const ForestRenderData::Task& task)
+	{
+		sf::Vertex* branches_out = data.branches.data() + task.branches_offset;
+		sf::Vertex* leaves_out = data.leaves.data() + task.leaves_offset;
+		// Leaves of consecutive visible branches are contiguous, they are generated together
+		// Runs are broken when some leaves of a branch are inactive
+		uint32_t run_first(0);
+		uint32_t run_last(0);
+		for (uint32_t branch_id(task.branches_first); branch_id < task.branches_last; ++branch_id) {
+			const uint8_t flags = data.visibility[task.visibility_offset + branch_id - task.branches_first];
+			if (flags & ForestRenderData::BranchVisible) {
+				branches_out = writeBranch(tree.branches[branch_id], branches_out);
+			}
+			if (flags & ForestRenderData::LeavesVisible) {
+				const uint32_t leaves_first = tree.leaves_offsets[branch_id];
+				if (run_last != leaves_first) {
+					leaves_out = writeLeaves(tree, run_first, run_last, leaves_out, data.atlas);
+					run_first = leaves_first;
+				}
+				run_last = tree.getActiveLeavesEnd(branch_id);
+			}
+			else {
+				leaves_out = writeLeaves(tree, run_first, run_last, leaves_out, data.atlas);
+				run_first = run_last;
+			}
+		}
+		writeLeaves(tree, run_first, run_last, leaves_out, data.atlas);
+	}
+
+	// Same geometry as the branch's triangle strip, returns the end of the written vertices
+	static sf::Vertex* writeBranch(const v2::Branch& b, sf::Vertex* out)
+	{
+		const uint64_t pairs_count = b.nodes.size() - 1;
+		sf::Vector2f last_left;
+		sf::Vector2f last_right;
+		for (uint64_t k(0); k < pairs_count; ++k) {
+			const v2::Node& n = b.nodes[k];
+			const v2::Node& next_n = b.nodes[k+1];
+			const float width = 0.5f * n.width;
+			const Vec2 n_vec = (next_n.position - n.position).getNormalized().getNormal() * width;
+			const sf::Vector2f left(n.position.x + n_vec.x, n.position.y + n_vec.y);
+			const sf::Vector2f right(n.position.x - n_vec.x, n.position.y - n_vec.y);
+			if (k) {
+				out[0] = sf::Vertex(last_left);
+				out[1] = sf::Vertex(last_right);
+				out[2] = sf::Vertex(left);
+				out[3] = sf::Vertex(last_right);
+				out[4] = sf::Vertex(left);
+				out[5] = sf::Vertex(right);
+				out += 6;
+			}
+			last_left = left;
+			last_right = right;
+		}
+		return out;
+	}
+
+	static uint64_t getBranchVerticesCount(const v2::TreeArchetype::BranchInfo& info)
+	{
+		return info.nodes_count > 2 ? 6 * (info.nodes_count - 2) : 0;
+	}
+
+	// Branch of an archetype rotated by mat and moved to origin, same geometry as a tree's branch
+	static sf::Vertex* writeBranch(const v2::TreeArchetype& archetype, const v2::TreeArchetype::BranchInfo& info, const RotMat2& mat, Vec2 origin, sf::Vertex* out)
+	{
+		const uint32_t first = info.nodes_offset;
+		const uint32_t pairs_count = info.nodes_count - 1;
+		Vec2 n_pos = archetype.nodes[first];
+		n_pos.rotate(mat);
+		n_pos += origin;
+		sf::Vector2f last_left;
+		sf::Vector2f last_right;
+		for (uint32_t k(0); k < pairs_count; ++k) {
+			Vec2 next_pos = archetype.nodes[first + k + 1];
+			next_pos.rotate(mat);
+			next_pos += origin;
+			const float width = 0.5f * archetype.widths[first + k];
+			const Vec2 n_vec = (next_pos - n_pos).getNormalized().getNormal() * width;
+			const sf::Vector2f left(n_pos.x + n_vec.x, n_pos.y + n_vec.y);
+			const sf::Vector2f right(n_pos.x - n_vec.x, n_pos.y - n_vec.y);
+			if (k) {
+				out[0] = sf::Vertex(last_left);
+				out[1] = sf::Vertex(last_right);
+				out[2] = sf::Vertex(left);
+				out[3] = sf::Vertex(last_right);
+				out[4] = sf::Vertex(left);
+				out[5] = sf::Vertex(right);
+				out += 6;
+			}
+			last_left = left;
+			last_right = right;
+			n_pos = next_pos;
+		}
+		return out;
+	}
+
+	static sf::Vertex* writeLeaves(const v2::Tree& tree, uint32_t first, uint32_t last, sf::Vertex* out, const LeafAtlas* atlas)
+	{
+		if (first == last) {
+			return out;
+		}
+		LeafVertexGenerator::writeStatic(tree, first, last, out, atlas);
+		LeafVertexGenerator::writePositions(tree, first, last, out, nullptr);
+		return out + 4 * (last - first);
+	}
+
+	static void generateBranches(const v2::Tree& tree, std::vector<sf::VertexArray>& branches_va, const BoundingBox& view)
+	{
+		uint64_t branches_va_count(0);
 		for (const v2::Branch& b : tree.branches) {
+			if (!b.bbox.intersects(view)) {
+				continue;
+			}
 			const uint64_t nodes_count = b.nodes.size() - 1;
-			branches_va.emplace_back(sf::TriangleStrip, nodes_count * 2);
-			sf::VertexArray& va = branches_va.back();
-			for (uint64_t i(0); i < nodes_count; ++i) {
-				const v2::Node& n = b.nodes[i];
-				const v2::Node& next_n = b.nodes[i+1];
+			if (branches_va_count == branches_va.size()) {
+				branches_va.emplace_back(sf::TriangleStrip);
+			}
+			sf::VertexArray& va = branches_va[branches_va_count++];
+			va.setPrimitiveType(sf::TriangleStrip);
+			va.resize(nodes_count * 2);
+			for (uint64_t k(0); k < nodes_count; ++k) {
+				const v2::Node& n = b.nodes[k];
+				const v2::Node& next_n = b.nodes[k+1];
 				const float width = 0.5f * n.width;
 				const Vec2 n_vec = (next_n.position - n.position).getNormalized().getNormal() * width;
-				va[2 * i].position = sf::Vector2f(n.position.x + n_vec.x, n.position.y + n_vec.y);
-				va[2 * i + 1].position = sf::Vector2f(n.position.x - n_vec.x, n.position.y - n_vec.y);
-			}
-		}
-
-		uint64_t i(0);
-		const float leaf_length = 30.0f;
-		const float leaf_width = 30.0f;
-		leaves_va.resize(4 * tree.leaves.size());
-		for (const v2::Leaf& l : tree.leaves) {
-			const Vec2 leaf_dir = l.getDir().getNormalized();
-			const Vec2 dir = leaf_dir * leaf_length * l.size;
-			const Vec2 nrm = leaf_dir.getNormal() * (0.5f * leaf_width* l.size);
-			const Vec2 attach = l.getPosition();
-			const Vec2 pt1 = attach + nrm;
-			const Vec2 pt2 = attach + nrm + dir;
-			const Vec2 pt3 = attach - nrm + dir;
-			const Vec2 pt4 = attach - nrm;
-			// Geometry
-			leaves_va[4 * i + 0].position = sf::Vector2f(pt1.x, pt1.y);
-			leaves_va[4 * i + 1].position = sf::Vector2f(pt2.x, pt2.y);
-			leaves_va[4 * i + 2].position = sf::Vector2f(pt3.x, pt3.y);
-			leaves_va[4 * i + 3].position = sf::Vector2f(pt4.x, pt4.y);
-			// Texture
-			leaves_va[4 * i + 0].texCoords = sf::Vector2f(0.0f, 0.0f);
-			leaves_va[4 * i + 1].texCoords = sf::Vector2f(1024.0f, 0.0f);
-			leaves_va[4 * i + 2].texCoords = sf::Vector2f(1024.0f, 1024.0f);
-			leaves_va[4 * i + 3].texCoords = sf::Vector2f(0.0f, 1024.0f);
-			// Color
-			leaves_va[4 * i + 0].color = l.color;
-			leaves_va[4 * i + 1].color = l.color;
-			leaves_va[4 * i + 2].color = l.color;
-			leaves_va[4 * i + 3].color = l.color;
-
-			++i;
+				va[2 * k].position = sf::Vector2f(n.position.x + n_vec.x, n.position.y + n_vec.y);
+				va[2 * k + 1].position = sf::Vector2f(n.position.x - n_vec.x, n.position.y - n_vec.y);
+			}
 		}
+		clearBranches(branches_va, branches_va_count);
+	}
+
+	// Arrays are emptied rather than destroyed so that their storage is reused from one frame to the next
+	static void clearBranches(std::vector<sf::VertexArray>& branches_va, uint64_t first)
+	{
+		for (uint64_t k(first); k < branches_va.size(); ++k) {
+			branches_va[k].clear();
+		}
+	}
+
+	// Returns the end of the written vertices
+	static sf::Vertex* addLeaf(sf::Vertex* out, Vec2 attach, Vec2 dir, Vec2 nrm, sf::Color color)
+	{
+		const Vec2 pt1 = attach + nrm;
+		const Vec2 pt2 = attach + nrm + dir;
+		const Vec2 pt3 = attach - nrm + dir;
+		const Vec2 pt4 = attach - nrm;
+		const float size = LeafVertexGenerator::TextureSize;
+		out[0] = sf::Vertex(sf::Vector2f(pt1.x, pt1.y), color, sf::Vector2f(0.0f, 0.0f));
+		out[1] = sf::Vertex(sf::Vector2f(pt2.x, pt2.y), color, sf::Vector2f(size, 0.0f));
+		out[2] = sf::Vertex(sf::Vector2f(pt3.x, pt3.y), color, sf::Vector2f(size, size));
+		out[3] = sf::Vertex(sf::Vector2f(pt4.x, pt4.y), color, sf::Vector2f(0.0f, size));
+		return out + 4;
 	}
 };
@@ -0,0 +1,336 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+
+// Vector backends compiled in, TREE2D_NO_SIMD keeps the scalar one only
+#if !defined(TREE2D_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+	#define TREE2D_SIMD_X86
+	#include <immintrin.h>
+#elif !defined(TREE2D_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+	#define TREE2D_SIMD_NEON
+	#include <arm_neon.h>
+#endif
+
+// AVX2 code is compiled for its own functions only, the rest of the program keeps the baseline instruction set
+// FMA is left out so that add, sub, mul, div and sqrt give the same results on every backend, except div on ARMv7
+// rsqrt is exact on the scalar backend only, SSE2, AVX2 and NEON refine an estimate and differ in the last bits
+// Kernels are flattened so that no AVX register is passed across a call (GCC's -Wpsabi note)
+#if defined(TREE2D_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+	#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+	#define SIMD_FLATTEN __attribute__((flatten))
+#else
+	#define SIMD_TARGET_AVX2
+	#define SIMD_FLATTEN
+#endif
+
+
+namespace simd
+{
+	enum Backend : uint32_t
+	{
+		Scalar,
+		SSE2,
+		AVX2,
+		NEON,
+		BackendsCount
+	};
+
+	struct ScalarBackend
+	{
+		using Float = float;
+		static constexpr uint32_t Width = 1;
+
+		static Float load(const float* p) { return *p; }
+		static void store(float* p, Float v) { *p = v; }
+		static Float loadInt8(const int8_t* p) { return static_cast<float>(*p); }
+		static Float loadUint8(const uint8_t* p) { return static_cast<float>(*p); }
+		static Float set1(float v) { return v; }
+		static Float add(Float a, Float b) { return a + b; }
+		static Float sub(Float a, Float b) { return a - b; }
+		static Float mul(Float a, Float b) { return a * b; }
+		static Float div(Float a, Float b) { return a / b; }
+		static Float sqrt(Float a) { return std::sqrt(a); }
+		static Float rsqrt(Float a) { return 1.0f / std::sqrt(a); }
+		static Float min(Float a, Float b) { return std::min(a, b); }
+		static Float max(Float a, Float b) { return std::max(a, b); }
+	};
+
+#ifdef TREE2D_SIMD_X86
+	struct Sse2Backend
+	{
+		using Float = __m128;
+		static constexpr uint32_t Width = 4;
+
+		static Float load(const float* p) { return _mm_loadu_ps(p); }
+		static void store(float* p, Float v) { _mm_storeu_ps(p, v); }
+		static Float set1(float v) { return _mm_set1_ps(v); }
+		static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+		static Float sqrt(Float a) { return _mm_sqrt_ps(a); }
+		static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+
+		// Estimate refined by a Newton step, about 22 bits of precision
+		static Float rsqrt(Float a)
+		{
+			const __m128 y = _mm_rsqrt_ps(a);
+			const __m128 yy_a = _mm_mul_ps(_mm_mul_ps(y, y), a);
+			return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), _mm_sub_ps(_mm_set1_ps(3.0f), yy_a));
+		}
+
+		static Float loadInt8(const int8_t* p)
+		{
+			int32_t packed;
+			std::memcpy(&packed, p, sizeof(packed));
+			__m128i v = _mm_cvtsi32_si128(packed);
+			// Move each byte to the top of its lane, then sign extend
+			v = _mm_unpacklo_epi8(v, v);
+			v = _mm_unpacklo_epi16(v, v);
+			return _mm_cvtepi32_ps(_mm_srai_epi32(v, 24));
+		}
+
+		static Float loadUint8(const uint8_t* p)
+		{
+			int32_t packed;
+			std::memcpy(&packed, p, sizeof(packed));
+			const __m128i zero = _mm_setzero_si128();
+			__m128i v = _mm_cvtsi32_si128(packed);
+			v = _mm_unpacklo_epi8(v, zero);
+			v = _mm_unpacklo_epi16(v, zero);
+			return _mm_cvtepi32_ps(v);
+		}
+	};
+
+	struct Avx2Backend
+	{
+		using Float = __m256;
+		static constexpr uint32_t Width = 8;
+
+		SIMD_TARGET_AVX2 static Float load(const float* p) { return _mm256_loadu_ps(p); }
+		SIMD_TARGET_AVX2 static void store(float* p, Float v) { _mm256_storeu_ps(p, v); }
+		SIMD_TARGET_AVX2 static Float set1(float v) { return _mm256_set1_ps(v); }
+		SIMD_TARGET_AVX2 static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+		SIMD_TARGET_AVX2 static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+		SIMD_TARGET_AVX2 static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+		SIMD_TARGET_AVX2 static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+		SIMD_TARGET_AVX2 static Float sqrt(Float a) { return _mm256_sqrt_ps(a); }
+		SIMD_TARGET_AVX2 static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+		SIMD_TARGET_AVX2 static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+
+		SIMD_TARGET_AVX2 static Float rsqrt(Float a)
+		{
+			const __m256 y = _mm256_rsqrt_ps(a);
+			const __m256 yy_a = _mm256_mul_ps(_mm256_mul_ps(y, y), a);
+			return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y), _mm256_sub_ps(_mm256_set1_ps(3.0f), yy_a));
+		}
+
+		SIMD_TARGET_AVX2 static Float loadInt8(const int8_t* p)
+		{
+			int64_t packed;
+			std::memcpy(&packed, p, sizeof(packed));
+			return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_cvtsi64_si128(packed)));
+		}
+
+		SIMD_TARGET_AVX2 static Float loadUint8(const uint8_t* p)
+		{
+			int64_t packed;
+			std::memcpy(&packed, p, sizeof(packed));
+			return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(packed)));
+		}
+	};
+#endif
+
+#ifdef TREE2D_SIMD_NEON
+	struct NeonBackend
+	{
+		using Float = float32x4_t;
+		static constexpr uint32_t Width = 4;
+
+		static Float load(const float* p) { return vld1q_f32(p); }
+		static void store(float* p, Float v) { vst1q_f32(p, v); }
+		static Float set1(float v) { return vdupq_n_f32(v); }
+		static Float add(Float a, Float b) { return vaddq_f32(a, b); }
+		static Float sub(Float a, Float b) { return vsubq_f32(a, b); }
+		static Float mul(Float a, Float b) { return vmulq_f32(a, b); }
+		static Float min(Float a, Float b) { return vminq_f32(a, b); }
+		static Float max(Float a, Float b) { return vmaxq_f32(a, b); }
+
+		static Float div(Float a, Float b)
+		{
+		#if defined(__aarch64__)
+			return vdivq_f32(a, b);
+		#else
+			// Reciprocal estimate refined by two Newton steps, ARMv7 has no division
+			float32x4_t inv = vrecpeq_f32(b);
+			inv = vmulq_f32(vrecpsq_f32(b, inv), inv);
+			inv = vmulq_f32(vrecpsq_f32(b, inv), inv);
+			return vmulq_f32(a, inv);
+		#endif
+		}
+
+		static Float sqrt(Float a)
+		{
+			float result[4];
+			vst1q_f32(result, a);
+			for (float& f : result) {
+				f = std::sqrt(f);
+			}
+			return vld1q_f32(result);
+		}
+
+		static Float rsqrt(Float a)
+		{
+			const float32x4_t y = vrsqrteq_f32(a);
+			return vmulq_f32(y, vrsqrtsq_f32(vmulq_f32(a, y), y));
+		}
+
+		static Float loadInt8(const int8_t* p)
+		{
+			int32_t packed;
+			std::memcpy(&packed, p, sizeof(packed));
+			const int16x8_t v = vmovl_s8(vreinterpret_s8_s32(vdup_n_s32(packed)));
+			return vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+		}
+
+		static Float loadUint8(const uint8_t* p)
+		{
+			int32_t packed;
+			std::memcpy(&packed, p, sizeof(packed));
+			const uint16x8_t v = vmovl_u8(vreinterpret_u8_s32(vdup_n_s32(packed)));
+			return vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+		}
+	};
+#endif
+
+	// B::Width 2D vectors, stored as one register of x and one of y
+	template<typename B>
+	struct Vec2xN
+	{
+		using Float = typename B::Float;
+
+		Float x, y;
+
+		Vec2xN() = default;
+
+		Vec2xN(Float x_, Float y_)
+			: x(x_)
+			, y(y_)
+		{}
+
+		static Vec2xN load(const float* xs, const float* ys)
+		{
+			return Vec2xN(B::load(xs), B::load(ys));
+		}
+
+		static Vec2xN set1(float x_, float y_)
+		{
+			return Vec2xN(B::set1(x_), B::set1(y_));
+		}
+
+		void store(float* xs, float* ys) const
+		{
+			B::store(xs, x);
+			B::store(ys, y);
+		}
+
+		Vec2xN operator+(const Vec2xN& v) const
+		{
+			return Vec2xN(B::add(x, v.x), B::add(y, v.y));
+		}
+
+		Vec2xN operator-(const Vec2xN& v) const
+		{
+			return Vec2xN(B::sub(x, v.x), B::sub(y, v.y));
+		}
+
+		Vec2xN operator*(Float f) const
+		{
+			return Vec2xN(B::mul(x, f), B::mul(y, f));
+		}
+
+		Float getLength2() const
+		{
+			return B::add(B::mul(x, x), B::mul(y, y));
+		}
+
+		Float getLength() const
+		{
+			return B::sqrt(getLength2());
+		}
+
+		Vec2xN getNormalized() const
+		{
+			const Float length = getLength();
+			return Vec2xN(B::div(x, length), B::div(y, length));
+		}
+
+		// Uses the backend's reciprocal square root, less precise than getNormalized and not the same on every backend
+		Vec2xN getNormalizedFast() const
+		{
+			const Float inv_length = B::rsqrt(getLength2());
+			return Vec2xN(B::mul(x, inv_length), B::mul(y, inv_length));
+		}
+
+		Vec2xN getNormal() const
+		{
+			return Vec2xN(B::sub(B::set1(0.0f), y), x);
+		}
+	};
+
+	bool isSupported(Backend backend)
+	{
+		switch (backend) {
+		case Scalar:
+			return true;
+#ifdef TREE2D_SIMD_X86
+		// Part of the x86-64 baseline
+		case SSE2:
+			return true;
+		case AVX2:
+	#if defined(__GNUC__) || defined(__clang__)
+			return __builtin_cpu_supports("avx2");
+	#else
+			return false;
+	#endif
+#endif
+#ifdef TREE2D_SIMD_NEON
+		case NEON:
+			return true;
+#endif
+		default:
+			return false;
+		}
+	}
+
+	Backend& currentBackend()
+	{
+		static Backend backend = isSupported(AVX2) ? AVX2 : (isSupported(SSE2) ? SSE2 : (isSupported(NEON) ? NEON : Scalar));
+		return backend;
+	}
+
+	// Widest backend supported by the CPU unless overridden with setBackend
+	Backend getBackend()
+	{
+		return currentBackend();
+	}
+
+	bool setBackend(Backend backend)
+	{
+		if (!isSupported(backend)) {
+			return false;
+		}
+		currentBackend() = backend;
+		return true;
+	}
+
+	const char* getName(Backend backend)
+	{
+		static const char* names[BackendsCount] = {"scalar", "sse2", "avx2", "neon"};
+		return names[backend];
+	}
+}
@@ -20,10 +20,15 @@ struct Wind
 	}
 
 	void update(float dt, float max_x)
+	{
+		update(dt, 0.0f, max_x);
+	}
+
+	void update(float dt, float min_x, float max_x)
 	{
 		pos_x += speed * dt;
-		if (pos_x - width * 0.5f > max_x) {
-			pos_x = -width * 0.5f;
+		if (pos_x - width * 0.5f > max_x || pos_x + width * 0.5f < min_x) {
+			pos_x = min_x - width * 0.5f;
 		}
 	}
 
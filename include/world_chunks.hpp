@@ -0,0 +1,381 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include "tree_builder.hpp"
+#include "tree_grower.hpp"
+#include "tree_lod.hpp"
+
+
+struct WorldChunkConf
+{
+	float chunk_width;
+	uint32_t max_trees_per_chunk;
+	uint32_t lod_levels;
+	float ground_y;
+	// Chunks closer than this to the view are built ahead of time
+	float preload_distance;
+	// Bytes of trees kept alive, including the cache of evicted chunks
+	uint64_t memory_budget;
+	uint32_t max_pending_builds;
+	uint64_t world_seed;
+	// Trees use the compact leaves storage
+	bool compact_leaves;
+	// Levels of detail from this one on have kinematic leaves, v2::LodNone for none
+	uint32_t kinematic_leaves_lod;
+	// Leaves can be torn off by strong wind, only those that are not compact
+	bool detachable_leaves;
+	// Microseconds per frame spent growing the trees of the loaded chunks, 0 to build them whole with the chunk
+	float growth_budget;
+	v2::TreeConf tree_conf;
+};
+
+
+struct WorldChunk
+{
+	int64_t index;
+	std::vector<v2::LodTree> trees;
+	// What each tree needs to be regrown when the configuration changes
+	std::vector<v2::TreeGrowth> growths;
+	// Of each tree's trunk, x its width and y its length
+	std::vector<Vec2> conf_scales;
+	// Empty once all the trees are grown, the levels of detail of a tree are generated when it is
+	std::vector<v2::TreeGrower> growers;
+	uint64_t memory;
+
+	WorldChunk()
+		: index(0)
+		, memory(0)
+	{}
+
+	// Only depends on the chunk's index and the configuration
+	static WorldChunk generate(int64_t chunk_index, const WorldChunkConf& conf)
+	{
+		ALLOC_SCOPE(alloc::Streaming);
+		WorldChunk chunk;
+		chunk.index = chunk_index;
+		const uint64_t chunk_seed = hashSeed(conf.world_seed, static_cast<uint64_t>(chunk_index));
+		RNGf::setSeed(chunk_seed);
+		const uint32_t trees_count = static_cast<uint32_t>(RNGf::getUnder(float(conf.max_trees_per_chunk) + 0.99f));
+		const float slot_width = conf.chunk_width / float(std::max(1U, trees_count));
+		const float chunk_start = chunk_index * conf.chunk_width;
+		// Draw everything before building, the builder reseeds the generator
+		std::vector<Vec2> positions;
+		for (uint32_t i(0); i < trees_count; ++i) {
+			const float x = chunk_start + slot_width * (i + 0.5f + RNGf::getRange(0.5f));
+			positions.emplace_back(x, conf.ground_y);
+			chunk.conf_scales.emplace_back(RNGf::getRange(0.6f, 1.0f), RNGf::getRange(0.7f, 1.0f));
+		}
+
+		chunk.growths.resize(trees_count);
+		if (conf.growth_budget > 0.0f) {
+			chunk.growers.resize(trees_count);
+		}
+		for (uint32_t i(0); i < trees_count; ++i) {
+			const v2::TreeConf tree_conf = getTreeConf(conf, chunk.conf_scales[i]);
+			if (!chunk.growers.empty()) {
+				chunk.trees.emplace_back();
+				chunk.trees.back().levels.emplace_back();
+				chunk.trees.back().levels.back().tree = chunk.growers[i].start(positions[i], tree_conf, hashSeed(chunk_seed, i));
+				continue;
+			}
+			const v2::Tree tree = v2::TreeBuilder::build(positions[i], tree_conf, hashSeed(chunk_seed, i), chunk.growths[i]);
+			chunk.trees.push_back(v2::LodBuilder::generate(tree, conf.lod_levels));
+			setupLevels(chunk.trees.back(), conf);
+		}
+		chunk.memory = computeMemory(chunk);
+		return chunk;
+	}
+
+	// Regrows the parts of the trees that depend on what changed in the trees' configuration
+	// Levels of detail are generated again from the full detail tree, kept branches keep their physics state
+	// Returns the number of regrown branches
+	uint64_t regrow(const WorldChunkConf& conf)
+	{
+		uint64_t regrown = 0;
+		const uint64_t trees_count = trees.size();
+		for (uint64_t i(0); i < trees_count; ++i) {
+			if (isGrowing(i)) {
+				continue;
+			}
+			v2::LodTree& lod = trees[i];
+			// Level 0 isn't simulated while another one is active, it is brought to the current pose first
+			const uint32_t active = lod.active;
+			lod.setActive(0);
+			const uint64_t count = v2::TreeBuilder::regrow(lod.levels.front().tree, growths[i], getTreeConf(conf, conf_scales[i]));
+			if (!count) {
+				lod.setActive(active);
+				continue;
+			}
+			regrown += count;
+			lod = v2::LodBuilder::generate(lod.levels.front().tree, conf.lod_levels);
+			setupLevels(lod, conf);
+			lod.setActive(active);
+		}
+		if (regrown) {
+			memory = computeMemory(*this);
+		}
+		return regrown;
+	}
+
+	// Grows the trees in turn until budget_us microseconds are spent, returns the time left
+	float grow(const WorldChunkConf& conf, float budget_us)
+	{
+		const uint64_t trees_count = growers.size();
+		for (uint64_t i(0); i < trees_count && budget_us > 0.0f; ++i) {
+			if (!isGrowing(i)) {
+				continue;
+			}
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			v2::LodTree& lod = trees[i];
+			if (growers[i].advance(lod.levels.front().tree, budget_us)) {
+				growths[i] = growers[i].getGrowth();
+				growers[i] = v2::TreeGrower();
+				lod = v2::LodBuilder::generate(lod.levels.front().tree, conf.lod_levels);
+				setupLevels(lod, conf);
+			}
+			budget_us -= std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+		}
+		if (std::all_of(growers.begin(), growers.end(), [](const v2::TreeGrower& grower) { return grower.isDone(); })) {
+			growers.clear();
+			growers.shrink_to_fit();
+		}
+		memory = computeMemory(*this);
+		return budget_us;
+	}
+
+	bool isGrowing(uint64_t tree_id) const
+	{
+		return tree_id < growers.size() && !growers[tree_id].isDone();
+	}
+
+	static v2::TreeConf getTreeConf(const WorldChunkConf& conf, Vec2 scale)
+	{
+		v2::TreeConf tree_conf = conf.tree_conf;
+		tree_conf.branch_width *= scale.x;
+		tree_conf.branch_length *= scale.y;
+		return tree_conf;
+	}
+
+	static void setupLevels(v2::LodTree& lod, const WorldChunkConf& conf)
+	{
+		std::vector<v2::TreeLod>& levels = lod.levels;
+		for (uint32_t level(0); level < levels.size(); ++level) {
+			if (conf.compact_leaves) {
+				levels[level].tree.compactLeaves();
+			}
+			if (level >= conf.kinematic_leaves_lod) {
+				levels[level].tree.setKinematicLeaves(true);
+			}
+			if (conf.detachable_leaves) {
+				levels[level].tree.setDetachableLeaves(true);
+			}
+		}
+	}
+
+	static uint64_t computeMemory(const WorldChunk& chunk)
+	{
+		uint64_t memory = sizeof(WorldChunk);
+		for (const v2::LodTree& lod : chunk.trees) {
+			for (const v2::TreeLod& level : lod.levels) {
+				const v2::MemoryFootprint footprint = level.tree.memoryFootprint();
+				memory += footprint.getTotal() - footprint.scaffold;
+				memory += (level.source_branches.capacity() + level.branches_index.capacity()) * sizeof(uint32_t);
+			}
+		}
+		for (const v2::TreeGrowth& growth : chunk.growths) {
+			memory += growth.getMemory();
+		}
+		for (const v2::TreeGrower& grower : chunk.growers) {
+			memory += grower.getMemory();
+		}
+		return memory;
+	}
+};
+
+
+// Streams chunks in around the view, chunks leaving it go to an LRU cache bounded by the memory budget
+class WorldChunkManager
+{
+public:
+	WorldChunkManager(const WorldChunkConf& conf)
+		: m_conf(conf)
+		, m_memory(0)
+		, m_built_count(0)
+	{}
+
+	void update(float view_min_x, float view_max_x)
+	{
+		const int64_t first = static_cast<int64_t>(std::floor((view_min_x - m_conf.preload_distance) / m_conf.chunk_width));
+		const int64_t last = static_cast<int64_t>(std::floor((view_max_x + m_conf.preload_distance) / m_conf.chunk_width));
+		collectBuilds(first, last);
+		// Move out of range chunks to the cache
+		for (auto it = m_chunks.begin(); it != m_chunks.end();) {
+			if (it->first < first || it->first > last) {
+				cache(std::move(it->second));
+				it = m_chunks.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		// Request missing chunks, closest to the view first
+		const int64_t center = static_cast<int64_t>(std::floor(0.5f * (view_min_x + view_max_x) / m_conf.chunk_width));
+		for (int64_t offset(0); center - offset >= first || center + offset <= last; ++offset) {
+			request(center - offset, first, last);
+			request(center + offset, first, last);
+		}
+		grow();
+		enforceBudget();
+	}
+
+	std::map<int64_t, WorldChunk>& getChunks()
+	{
+		return m_chunks;
+	}
+
+	uint64_t getMemory() const
+	{
+		return m_memory;
+	}
+
+	uint64_t getCachedCount() const
+	{
+		return m_cache.size();
+	}
+
+	uint64_t getPendingCount() const
+	{
+		return m_pending.size();
+	}
+
+	uint64_t getBuiltCount() const
+	{
+		return m_built_count;
+	}
+
+	// Trees of the loaded chunks that are still growing
+	uint64_t getGrowingCount() const
+	{
+		uint64_t count = 0;
+		for (const auto& chunk : m_chunks) {
+			for (uint64_t i(0); i < chunk.second.growers.size(); ++i) {
+				count += chunk.second.isGrowing(i);
+			}
+		}
+		return count;
+	}
+
+	// Loaded chunks are regrown now, the others when they are loaded, returns the number of regrown branches
+	uint64_t setTreeConf(const v2::TreeConf& tree_conf)
+	{
+		PROFILE_SCOPE("WorldChunkManager::setTreeConf");
+		m_conf.tree_conf = tree_conf;
+		uint64_t regrown = 0;
+		for (auto& chunk : m_chunks) {
+			regrown += regrow(chunk.second);
+		}
+		return regrown;
+	}
+
+private:
+	WorldChunkConf m_conf;
+	std::map<int64_t, WorldChunk> m_chunks;
+	std::map<int64_t, std::future<WorldChunk>> m_pending;
+	// Most recently evicted first
+	std::list<WorldChunk> m_cache;
+	std::unordered_map<int64_t, std::list<WorldChunk>::iterator> m_cache_index;
+	uint64_t m_memory;
+	uint64_t m_built_count;
+
+	void request(int64_t index, int64_t first, int64_t last)
+	{
+		if (index < first || index > last || m_chunks.count(index) || m_pending.count(index)) {
+			return;
+		}
+		// Restore from cache
+		const auto cached = m_cache_index.find(index);
+		if (cached != m_cache_index.end()) {
+			regrow(*cached->second);
+			m_chunks[index] = std::move(*cached->second);
+			m_cache.erase(cached->second);
+			m_cache_index.erase(cached);
+			return;
+		}
+
+		if (m_pending.size() < m_conf.max_pending_builds) {
+			m_pending[index] = std::async(std::launch::async, WorldChunk::generate, index, m_conf);
+		}
+	}
+
+	void collectBuilds(int64_t first, int64_t last)
+	{
+		for (auto it = m_pending.begin(); it != m_pending.end();) {
+			if (it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				++it;
+				continue;
+			}
+
+			WorldChunk chunk = it->second.get();
+			// Built with the configuration of the time it has been requested
+			chunk.regrow(m_conf);
+			m_memory += chunk.memory;
+			++m_built_count;
+			if (chunk.index < first || chunk.index > last) {
+				cache(std::move(chunk));
+			}
+			else {
+				m_chunks[chunk.index] = std::move(chunk);
+			}
+			it = m_pending.erase(it);
+		}
+	}
+
+	// Loaded chunks share the growth budget, each one stops growing once it is cached
+	void grow()
+	{
+		PROFILE_SCOPE("WorldChunkManager::grow");
+		float budget = m_conf.growth_budget;
+		for (auto& chunk : m_chunks) {
+			if (budget <= 0.0f) {
+				break;
+			}
+			if (chunk.second.growers.empty()) {
+				continue;
+			}
+			m_memory -= chunk.second.memory;
+			budget = chunk.second.grow(m_conf, budget);
+			// Grown with the configuration of the time the chunk has been requested
+			chunk.second.regrow(m_conf);
+			m_memory += chunk.second.memory;
+		}
+	}
+
+	uint64_t regrow(WorldChunk& chunk)
+	{
+		m_memory -= chunk.memory;
+		const uint64_t regrown = chunk.regrow(m_conf);
+		m_memory += chunk.memory;
+		return regrown;
+	}
+
+	void cache(WorldChunk&& chunk)
+	{
+		const int64_t index = chunk.index;
+		m_cache.push_front(std::move(chunk));
+		m_cache_index[index] = m_cache.begin();
+	}
+
+	void enforceBudget()
+	{
+		while (m_memory > m_conf.memory_budget && !m_cache.empty()) {
+			m_memory -= m_cache.back().memory;
+			m_cache_index.erase(m_cache.back().index);
+			m_cache.pop_back();
+		}
+	}
+};
@@ -218,11 +218,14 @@ public:
 			group_size = m_thread_count;
 		}
 
-		if (group_size > m_available_workers.size()) {
+		if (group_size > m_thread_count) {
 			return WorkGroup();
 		}
 
-		return WorkGroup(std::make_unique<ExecutionGroup>(job, group_size, m_available_workers));
+		// Workers of the previous group may still be on their way back
+		std::unique_lock<std::mutex> ul(m_mutex);
+		m_available_condition.wait(ul, [this, group_size] { return m_available_workers.size() >= group_size; });
+		return WorkGroup(std::make_shared<ExecutionGroup>(job, group_size, m_available_workers));
 	}
 
 
@@ -233,6 +236,7 @@ private:
 	std::list<Worker*>  m_workers;
 	std::list<Worker*>  m_available_workers;
 	std::mutex m_mutex;
+	std::condition_variable m_available_condition;
 
 	void createWorker()
 	{
@@ -250,9 +254,12 @@ private:
 
 	void notifyWorkerReady(Worker* worker)
 	{
-		std::lock_guard<std::mutex> lg(m_mutex);
-		++m_ready_count;
-		m_available_workers.push_back(worker);
+		{
+			std::lock_guard<std::mutex> lg(m_mutex);
+			++m_ready_count;
+			m_available_workers.push_back(worker);
+		}
+		m_available_condition.notify_all();
 	}
 
 	friend Worker;
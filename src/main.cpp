@@ -3,12 +3,26 @@
 #include <string>
 #include <iostream>
 #include <cmath>
+#include <cstdio>
+#include <memory>
+#include <thread>
 
 #include "tree_renderer.hpp"
+#include "forest_renderer.hpp"
 #include "wind.hpp"
 
 #include "tree.hpp"
 #include "tree_builder.hpp"
+#include "tree_lod.hpp"
+#include "simulation_scheduler.hpp"
+#include "world_chunks.hpp"
+#include "frame_governor.hpp"
+#include "falling_leaves.hpp"
+#include "spatial_index.hpp"
+#include "leaf_collider.hpp"
+#include "conf_watcher.hpp"
+#include "profiler.hpp"
+#include "alloc_tracker.hpp"
 
 
 int main()
@@ -41,9 +55,17 @@ int main()
 		Vec2(0.0f, -0.5f), // Attraction
 		8
 	};
+	// Saving this file regrows the trees, only the branches that depend on what changed
+	TreeConfWatcher conf_watcher("../res/tree.conf");
+	conf_watcher.log = stdout;
+	conf_watcher.poll(tree_conf);
 
 	sf::Texture texture;
 	texture.loadFromFile("../res/leaf.png");
+	// Leaf variants of the batched renderer
+	LeafAtlas leaf_atlas;
+	leaf_atlas.addFromFile("../res/leaf.png");
+	leaf_atlas.build();
 
 	sf::Font font;
 	font.loadFromFile("../res/font.ttf");
@@ -53,8 +75,62 @@ int main()
 	text_profiler.setCharacterSize(24);
 
 	std::vector<sf::VertexArray> branches_va;
-	sf::VertexArray leaves_va(sf::Quads);
-	v2::Tree tree = v2::TreeBuilder::build(Vec2(WinWidth * 0.5f, WinHeight), tree_conf);
+	// One per drawn tree so that the leaves' static attributes are kept from one frame to the next
+	std::vector<LeafVertexGenerator> leaves_generators;
+	// All drawn trees at once, generated on the swarm's threads
+	swrm::Swarm swarm(std::max(1U, std::thread::hardware_concurrency()));
+	ForestRenderer forest_renderer(&swarm);
+	forest_renderer.setAtlas(&leaf_atlas);
+	// Of the last frame, shown in the overlay
+	uint32_t draw_calls = 0;
+	uint64_t drawn_vertices = 0;
+	sf::VertexArray va_debug(sf::Lines);
+	WorldChunkConf world_conf;
+	world_conf.chunk_width = 2000.0f;
+	world_conf.max_trees_per_chunk = 3;
+	world_conf.lod_levels = 4;
+	world_conf.ground_y = WinHeight;
+	world_conf.preload_distance = 2000.0f;
+	world_conf.memory_budget = 512 * 1024 * 1024;
+	world_conf.max_pending_builds = 4;
+	world_conf.world_seed = 0;
+	world_conf.compact_leaves = false;
+	world_conf.kinematic_leaves_lod = 2;
+	world_conf.detachable_leaves = true;
+	// Trees grow in front of the camera instead of appearing whole
+	world_conf.growth_budget = 1000.0f;
+	world_conf.tree_conf = tree_conf;
+	std::unique_ptr<WorldChunkManager> world(new WorldChunkManager(world_conf));
+	SimulationScheduler scheduler;
+	// Leaves torn off by gusts, they outlive the chunks they fell from
+	FallingLeaves falling_leaves(8192, float(WinHeight));
+	falling_leaves.setAtlas(&leaf_atlas);
+	// Trades fidelity for frame time, decisions are printed to the console
+	FrameGovernor governor(14.0f);
+	governor.log = stdout;
+	bool governed = true;
+	bool restore_fidelity = false;
+	sf::Clock stage_clock;
+	// Picking and mouse drag forces
+	SpatialIndex spatial_index;
+	sf::Vector2f last_mouse_world;
+	// Leaves of the simulated trees collide with each other and with the branches, toggled with X
+	LeafCollider leaf_collider(1 << 17);
+	bool leaf_collisions = false;
+
+	// Background trees replay a loop baked once from a reduced tree, they have no physics
+	const v2::Tree background_tree = v2::TreeBuilder::build(Vec2(), tree_conf, world_conf.world_seed);
+	const v2::BakedWind::Ptr background = v2::BakedWind::bake(v2::TreeArchetype::create(v2::LodBuilder::generate(background_tree, 3).levels.back().tree), v2::PeriodicWind());
+	std::vector<v2::BakedInstance> background_instances;
+	for (int32_t i(-150); i < 150; ++i) {
+		background_instances.emplace_back(Vec2(350.0f * i, float(WinHeight)), RNGf::getUnder(10.0f));
+	}
+	sf::VertexArray background_branches;
+	sf::VertexArray background_leaves;
+	float time = 0.0f;
+
+	sf::View world_view(sf::FloatRect(0.0f, 0.0f, float(WinWidth), float(WinHeight)));
+	float zoom = 1.0f;
 
 	float base_wind_force = 0.05f;
 	float max_wind_force = 30.0f;
@@ -70,10 +146,15 @@ int main()
 
 	const float dt = 0.016f;
 
-	float time_sum_leaves = 0.0f;
-	float time_sum_branches = 0.0f;
-	float time_sum_rest = 0.0f;
-	float img_count = 1.0f;
+	prof::Profiler& profiler = prof::Profiler::get();
+	char text_buffer[256];
+	const auto draw_zone_stats = [&](const char* label, const char* zone, float y) {
+		const prof::ZoneStats stats = profiler.getStats(zone);
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s p50 %6.0f  p95 %6.0f  p99 %6.0f  max %6.0f us", label, stats.p50, stats.p95, stats.p99, stats.max);
+		text_profiler.setString(text_buffer);
+		text_profiler.setPosition(10.0f, y);
+		window.draw(text_profiler);
+	};
 
 	bool boosting = false;
 
@@ -81,6 +162,9 @@ int main()
 	bool draw_leaves = true;
 	bool draw_debug = false;
 	bool draw_wind_debug = false;
+	bool fused_update = true;
+	bool batch_render = true;
+	bool draw_background = true;
 
 	sf::Clock clock;
 	while (window.isOpen())
@@ -91,9 +175,15 @@ int main()
 		while (window.pollEvent(event)) {
 			if (event.type == sf::Event::Closed) {
 				window.close();
+			} else if (event.type == sf::Event::MouseWheelScrolled) {
+				const float zoom_factor = event.mouseWheelScroll.delta > 0.0f ? 0.9f : 1.0f / 0.9f;
+				zoom *= zoom_factor;
+				world_view.zoom(zoom_factor);
 			} else if (event.type == sf::Event::KeyReleased) {
 				if (event.key.code == sf::Keyboard::Space) {
-					tree = v2::TreeBuilder::build(Vec2(WinWidth * 0.5f, WinHeight), tree_conf);
+					++world_conf.world_seed;
+					world.reset(new WorldChunkManager(world_conf));
+					spatial_index.reset();
 				}
 				else if (event.key.code == sf::Keyboard::B) {
 					draw_branches = !draw_branches;
@@ -107,6 +197,39 @@ int main()
 				else if (event.key.code == sf::Keyboard::W) {
 					draw_wind_debug = !draw_wind_debug;
 				}
+				else if (event.key.code == sf::Keyboard::F) {
+					fused_update = !fused_update;
+				}
+				else if (event.key.code == sf::Keyboard::C) {
+					world_conf.compact_leaves = !world_conf.compact_leaves;
+					world.reset(new WorldChunkManager(world_conf));
+					spatial_index.reset();
+				}
+				else if (event.key.code == sf::Keyboard::T) {
+					batch_render = !batch_render;
+				}
+				else if (event.key.code == sf::Keyboard::K) {
+					// Cycles between kinematic leaves for distant trees, for all trees and for none
+					const uint32_t lod = world_conf.kinematic_leaves_lod;
+					world_conf.kinematic_leaves_lod = lod == v2::LodNone ? 2 : (lod ? 0 : v2::LodNone);
+					world.reset(new WorldChunkManager(world_conf));
+					spatial_index.reset();
+				}
+				else if (event.key.code == sf::Keyboard::G) {
+					draw_background = !draw_background;
+				}
+				else if (event.key.code == sf::Keyboard::Q) {
+					governed = !governed;
+					governor.reset();
+					// Trees go back to full fidelity once, then are left alone while the governor is off
+					restore_fidelity = !governed;
+				}
+				else if (event.key.code == sf::Keyboard::X) {
+					leaf_collisions = !leaf_collisions;
+				}
+				else if (event.key.code == sf::Keyboard::P) {
+					profiler.exportChromeTrace("trace.json");
+				}
 				else {
 					boosting = false;
 					wind[0].strength = base_wind_force;
@@ -131,6 +254,9 @@ int main()
 				}
 				else if (event.key.code == sf::Keyboard::W) {
 					base_wind_force = 1.0f;
+				}
+				else if (event.key.code == sf::Keyboard::Left || event.key.code == sf::Keyboard::Right) {
+
 				}
 				else {
 					boosting = true;
@@ -142,94 +268,307 @@ int main()
 			}
 		}
 
-		for (Wind& w : wind) {
-			w.update(dt, WinWidth);
+		const float scroll_speed = 1000.0f * zoom;
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Left)) {
+			world_view.move(-scroll_speed * dt, 0.0f);
 		}
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Right)) {
+			world_view.move(scroll_speed * dt, 0.0f);
+		}
+		const sf::Vector2f view_center = world_view.getCenter();
+		const sf::Vector2f view_half_size = 0.5f * world_view.getSize();
+		const Vec2 view_min(view_center.x - view_half_size.x, view_center.y - view_half_size.y);
+		const Vec2 view_max(view_center.x + view_half_size.x, view_center.y + view_half_size.y);
+		const BoundingBox view_bbox(view_min, view_max);
 
-		tree.applyWind(wind);
-
-		if (boosting) {
-			for (v2::Branch& b : tree.branches) {
-				b.segment.moving_point.acceleration += Vec2(1.0f, 0.0f) * wind_force;
+		for (Wind& w : wind) {
+			w.update(dt, view_min.x, view_max.x);
+		}
+		time += dt;
+
+		stage_clock.restart();
+		{
+			ALLOC_SCOPE(alloc::Streaming);
+			if (conf_watcher.poll(world_conf.tree_conf, dt)) {
+				const uint64_t regrown = world->setTreeConf(world_conf.tree_conf);
+				std::printf("[TreeConfWatcher] %llu branches regrown\n", static_cast<unsigned long long>(regrown));
+				spatial_index.reset();
 			}
+			world->update(view_min.x, view_max.x);
 		}
+		governor.setStageTime(FrameGovernor::Streaming, stage_clock.restart().asMicroseconds() * 0.001f);
+
+		// Dragging with the left button pushes what is under the mouse
+		const sf::Vector2f mouse_world = window.mapPixelToCoords(mouse_pos, world_view);
+		spatial_index.clear();
+		for (auto& chunk : world->getChunks()) {
+			for (v2::LodTree& lod_tree : chunk.second.trees) {
+				spatial_index.addTree(lod_tree.getTree());
+			}
+		}
+		if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
+			const sf::Vector2f mouse_velocity = (mouse_world - last_mouse_world) / dt;
+			spatial_index.applyForce(Vec2(mouse_world.x, mouse_world.y), 80.0f * zoom, Vec2(mouse_velocity.x, mouse_velocity.y) * 0.01f);
+		}
+		last_mouse_world = mouse_world;
+
+		scheduler.nextFrame();
+		uint32_t tree_id = 0;
+		uint32_t trees_count = 0;
+		{
+			PROFILE_SCOPE("Frame physics");
+			ALLOC_SCOPE(alloc::Physics);
+			leaf_collider.clear();
+			for (auto& chunk : world->getChunks()) {
+				for (v2::LodTree& lod_tree : chunk.second.trees) {
+					++trees_count;
+					lod_tree.updateLod(1.0f / zoom);
+					v2::Tree& tree = lod_tree.getTree();
+					if (governed || restore_fidelity) {
+						governor.apply(tree);
+					}
+					if (!scheduler.shouldUpdate(tree_id++, tree, view_bbox)) {
+						continue;
+					}
 
-		sf::Clock profiler_clock;
-		tree.updateBranches(dt);
-		const float elapsed_b = static_cast<float>(profiler_clock.getElapsedTime().asMicroseconds());
-		time_sum_branches += elapsed_b;
-
-		profiler_clock.restart();
-		tree.updateLeaves(dt);
-		const float elapsed_l = static_cast<float>(profiler_clock.getElapsedTime().asMicroseconds());
-		time_sum_leaves += elapsed_l;
+					tree.applyWind(wind);
+					if (boosting) {
+						for (v2::Branch& b : tree.branches) {
+							b.segment.moving_point.acceleration += Vec2(1.0f, 0.0f) * wind_force;
+						}
+					}
 
-		profiler_clock.restart();
-		tree.updateStructure();
-		const float elapsed_r = static_cast<float>(profiler_clock.getElapsedTime().asMicroseconds());
-		time_sum_rest += elapsed_r;
+					if (fused_update) {
+						tree.updateFused(dt);
+					}
+					else {
+						tree.updateBranches(dt);
+						tree.updateLeaves(dt);
+						tree.updateStructure();
+					}
+					falling_leaves.collect(tree, dt);
+					if (leaf_collisions) {
+						leaf_collider.addTree(tree);
+					}
+				}
+			}
+			restore_fidelity = false;
+			// Only the trees updated this frame
+			leaf_collider.solve(&swarm);
+			falling_leaves.applyWind(wind);
+			falling_leaves.update(dt);
+		}
+		spatial_index.invalidate();
+		governor.setStageTime(FrameGovernor::Physics, stage_clock.restart().asMicroseconds() * 0.001f);
 
 		window.clear(sf::Color::Black);
+		window.setView(window.getDefaultView());
 
+		ALLOC_SCOPE(alloc::Overlay);
+		profiler.collect();
 		const float text_offset = 24.0f;
 		float text_y = 10.0f;
-		text_profiler.setString("Structure simulation    " + toString(int(time_sum_branches / img_count)) + " us");
+		draw_zone_stats("Frame physics", "Frame physics", text_y);
+		text_y += text_offset;
+		if (fused_update) {
+			draw_zone_stats("Fused update", "Tree::updateFused", text_y);
+			text_y += text_offset;
+		}
+		else {
+			draw_zone_stats("Structure simulation", "Tree::updateBranches", text_y);
+			text_y += text_offset;
+			draw_zone_stats("Leaves simulation", "Tree::updateLeaves", text_y);
+			text_y += text_offset;
+			draw_zone_stats("Structure update", "Tree::updateStructure", text_y);
+			text_y += text_offset;
+		}
+		draw_zone_stats("Wind", "Tree::applyWind", text_y);
+		text_y += text_offset;
+		if (leaf_collisions) {
+			draw_zone_stats("Leaf collisions", "LeafCollider::solve", text_y);
+			text_y += text_offset;
+		}
+		if (draw_debug) {
+			draw_zone_stats("Picking", "SpatialIndex::findNearestSegment", text_y);
+			text_y += text_offset;
+		}
+		draw_zone_stats(batch_render ? "Render data (batched)" : "Render data", "TreeRenderer::generateRenderData", text_y);
+		text_y += text_offset;
+		if (draw_background) {
+			draw_zone_stats("Background (baked)", "TreeRenderer::generateBaked", text_y);
+			text_y += text_offset;
+		}
+		text_y += text_offset;
+
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %u (%u vertices)", "Draw calls", draw_calls, static_cast<uint32_t>(drawn_vertices));
+		text_profiler.setString(text_buffer);
+		text_profiler.setPosition(10.0f, text_y);
+		window.draw(text_profiler);
+		text_y += text_offset;
+
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %u / %u", "Simulated trees", scheduler.updated_count, trees_count);
+		text_profiler.setString(text_buffer);
 		text_profiler.setPosition(10.0f, text_y);
 		window.draw(text_profiler);
 		text_y += text_offset;
 
-		text_profiler.setString("Leaves simulation       " + toString(int(time_sum_leaves / img_count)) + " us");
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %u active, %u cached, %u building, %u trees growing", "Chunks",
+			static_cast<uint32_t>(world->getChunks().size()), static_cast<uint32_t>(world->getCachedCount()), static_cast<uint32_t>(world->getPendingCount()),
+			static_cast<uint32_t>(world->getGrowingCount()));
+		text_profiler.setString(text_buffer);
 		text_profiler.setPosition(10.0f, text_y);
 		window.draw(text_profiler);
 		text_y += text_offset;
 
-		text_profiler.setString("Structure update        " + toString(int(time_sum_rest / img_count)) + " us");
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %u MB%s", "Trees memory", static_cast<uint32_t>(world->getMemory() / (1024 * 1024)), world_conf.compact_leaves ? " (compact leaves)" : "");
+		text_profiler.setString(text_buffer);
 		text_profiler.setPosition(10.0f, text_y);
 		window.draw(text_profiler);
-		text_y += 2.0f * text_offset;
+		text_y += text_offset;
 
-		text_profiler.setString("Physic simulation time  " + toString(0.001f * ((time_sum_leaves + time_sum_branches + time_sum_rest) / img_count), true) + "ms");
+		if (world_conf.kinematic_leaves_lod == v2::LodNone) {
+			std::snprintf(text_buffer, sizeof(text_buffer), "%-24s none", "Kinematic leaves");
+		}
+		else {
+			std::snprintf(text_buffer, sizeof(text_buffer), "%-24s from LOD %u", "Kinematic leaves", world_conf.kinematic_leaves_lod);
+		}
+		text_profiler.setString(text_buffer);
 		text_profiler.setPosition(10.0f, text_y);
 		window.draw(text_profiler);
+		text_y += text_offset;
+
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %u / %u (%u recycled)", "Falling leaves",
+			falling_leaves.getCount(), falling_leaves.getCapacity(), static_cast<uint32_t>(falling_leaves.getRecycledCount()));
+		text_profiler.setString(text_buffer);
+		text_profiler.setPosition(10.0f, text_y);
+		window.draw(text_profiler);
+		text_y += text_offset;
+
+		std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %s %.1f / %.1f ms  leaves 1/%u  substeps %u  distant render 1/%u  active leaves %.0f%%", "Frame governor",
+			governed ? "on" : "off", governor.frame_time, governor.budget, governor.leaves_period, governor.branch_substeps, governor.distant_render_period, 100.0f * governor.active_leaves);
+		text_profiler.setString(text_buffer);
+		text_profiler.setPosition(10.0f, text_y);
+		window.draw(text_profiler);
+		text_y += text_offset;
+
+		if (alloc::AllocTracker::isEnabled()) {
+			const alloc::Counters physics_allocs = alloc::AllocTracker::getLastFrame(alloc::Physics);
+			const alloc::Counters render_allocs = alloc::AllocTracker::getLastFrame(alloc::Render);
+			const alloc::Counters frame_allocs = alloc::AllocTracker::getLastFrame();
+			std::snprintf(text_buffer, sizeof(text_buffer), "%-24s %u (%u KB)  physics %u  render %u", "Allocations per frame",
+				static_cast<uint32_t>(frame_allocs.count), static_cast<uint32_t>(frame_allocs.bytes / 1024), static_cast<uint32_t>(physics_allocs.count), static_cast<uint32_t>(render_allocs.count));
+			text_profiler.setString(text_buffer);
+			text_profiler.setPosition(10.0f, text_y);
+			window.draw(text_profiler);
+		}
+
+		window.setView(world_view);
 
-		TreeRenderer::generateRenderData(tree, branches_va, leaves_va);
-		if (draw_branches) {
-			for (const auto& va : branches_va) {
-				window.draw(va);
+		ALLOC_SCOPE(alloc::Render);
+		// The overlay is not part of the governed work
+		stage_clock.restart();
+		if (draw_background) {
+			TreeRenderer::generateRenderData(*background, background_instances, time, background_branches, background_leaves, view_bbox);
+			if (draw_branches) {
+				window.draw(background_branches);
+			}
+			if (draw_leaves) {
+				sf::RenderStates background_states;
+				background_states.texture = &texture;
+				window.draw(background_leaves, background_states);
+			}
+		}
+		if (batch_render) {
+			forest_renderer.clear();
+			forest_renderer.setDistantRefreshPeriod(governor.distant_render_period);
+			for (const auto& chunk : world->getChunks()) {
+				for (const v2::LodTree& lod_tree : chunk.second.trees) {
+					forest_renderer.addTree(lod_tree.getTree(), lod_tree.active >= governor.distant_lod);
+				}
 			}
+			forest_renderer.update(view_bbox);
+			forest_renderer.draw(window, draw_branches, draw_leaves);
+			draw_calls = forest_renderer.getDrawCalls();
+			drawn_vertices = forest_renderer.getVertexCount();
 		}
+		else {
+			sf::RenderStates leaves_states;
+			leaves_states.texture = &texture;
+			draw_calls = 0;
+			drawn_vertices = 0;
+			uint32_t drawn_tree_id = 0;
+			for (const auto& chunk : world->getChunks()) {
+				for (const v2::LodTree& lod_tree : chunk.second.trees) {
+					if (drawn_tree_id == leaves_generators.size()) {
+						leaves_generators.emplace_back();
+					}
+					LeafVertexGenerator& leaves_generator = leaves_generators[drawn_tree_id++];
+					TreeRenderer::generateRenderData(lod_tree.getTree(), branches_va, leaves_generator, view_bbox);
+					if (draw_branches) {
+						for (const auto& va : branches_va) {
+							window.draw(va);
+							draw_calls += va.getVertexCount() ? 1 : 0;
+							drawn_vertices += va.getVertexCount();
+						}
+					}
+					if (draw_leaves) {
+						window.draw(leaves_generator.getVertices(), leaves_generator.getVertexCount(), sf::Quads, leaves_states);
+						++draw_calls;
+						drawn_vertices += leaves_generator.getVertexCount();
+					}
+				}
+			}
+		}
+
 		if (draw_leaves) {
-			sf::RenderStates states;
-			states.texture = &texture;
-			window.draw(leaves_va, states);
+			falling_leaves.generateRenderData(view_bbox);
+			falling_leaves.draw(window);
 		}
 
 		if (draw_debug) {
-			sf::VertexArray va_debug(sf::Lines, 2 * tree.branches.size());
-			uint32_t i = 0;
-			for (const v2::Branch& b : tree.branches) {
-				va_debug[2 * i + 0].position = sf::Vector2f(b.segment.attach_point.x, b.segment.attach_point.y);
-				va_debug[2 * i + 1].position = sf::Vector2f(b.segment.moving_point.position.x, b.segment.moving_point.position.y);
-				va_debug[2 * i + 0].color = sf::Color::Red;
-				va_debug[2 * i + 1].color = sf::Color::Red;
-				++i;
+			for (const auto& chunk : world->getChunks()) {
+				for (const v2::LodTree& lod_tree : chunk.second.trees) {
+					const v2::Tree& tree = lod_tree.getTree();
+					va_debug.resize(2 * tree.branches.size());
+					uint32_t i = 0;
+					for (const v2::Branch& b : tree.branches) {
+						va_debug[2 * i + 0].position = sf::Vector2f(b.segment.attach_point.x, b.segment.attach_point.y);
+						va_debug[2 * i + 1].position = sf::Vector2f(b.segment.moving_point.position.x, b.segment.moving_point.position.y);
+						va_debug[2 * i + 0].color = sf::Color::Red;
+						va_debug[2 * i + 1].color = sf::Color::Red;
+						++i;
+					}
+					window.draw(va_debug);
+
+					i = 0;
+					for (const v2::Branch& b : tree.branches) {
+						const float joint_strength(4000.0f * std::powf(0.4f, float(b.level)));
+						const float length = joint_strength * 0.03f;
+						sf::Vector2f bot(b.segment.moving_point.position.x, b.segment.moving_point.position.y);
+						const Vec2& dir = b.segment.direction.getNormalized();
+						sf::Vector2f top(bot + length * sf::Vector2f(dir.x, dir.y));
+						va_debug[2 * i + 0].position = bot;
+						va_debug[2 * i + 1].position = top;
+						va_debug[2 * i + 0].color = sf::Color::Green;
+						va_debug[2 * i + 1].color = sf::Color::Green;
+						++i;
+					}
+					window.draw(va_debug);
+				}
 			}
-			window.draw(va_debug);
-
-			i = 0;
-			for (const v2::Branch& b : tree.branches) {
-				const float joint_strength(4000.0f * std::powf(0.4f, float(b.level)));
-				const float length = joint_strength * 0.03f;
-				sf::Vector2f bot(b.segment.moving_point.position.x, b.segment.moving_point.position.y);
-				const Vec2& dir = b.segment.direction.getNormalized();
-				sf::Vector2f top(bot + length * sf::Vector2f(dir.x, dir.y));
-				va_debug[2 * i + 0].position = bot;
-				va_debug[2 * i + 1].position = top;
-				va_debug[2 * i + 0].color = sf::Color::Green;
-				va_debug[2 * i + 1].color = sf::Color::Green;
-				++i;
+
+			// Segment picked by the mouse
+			SpatialIndex::SegmentHit hit;
+			if (spatial_index.findNearestSegment(Vec2(mouse_world.x, mouse_world.y), 50.0f * zoom, hit)) {
+				const v2::Branch& b = spatial_index.getTree(hit.tree_id).branches[hit.branch_id];
+				const Vec2 a = b.nodes[hit.node_id].position;
+				const Vec2 c = b.nodes[hit.node_id + 1].position;
+				const sf::Vertex picked[] = {
+					sf::Vertex(sf::Vector2f(a.x, a.y), sf::Color::Yellow),
+					sf::Vertex(sf::Vector2f(c.x, c.y), sf::Color::Yellow),
+				};
+				window.draw(picked, 2, sf::Lines);
 			}
-			window.draw(va_debug);
 		}
 
 		if (draw_wind_debug) {
@@ -241,10 +580,16 @@ int main()
 			}
 		}
 
-		img_count += 1.0f;
+		governor.setStageTime(FrameGovernor::Render, stage_clock.restart().asMicroseconds() * 0.001f);
+		if (governed) {
+			governor.update();
+		}
 
         window.display();
+		alloc::AllocTracker::nextFrame();
     }
 
+	profiler.exportChromeTrace("trace.json");
+
     return 0;
 }
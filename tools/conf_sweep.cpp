@@ -0,0 +1,298 @@
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "conf_watcher.hpp"
+#include "swarm.hpp"
+#include "tree_builder.hpp"
+#include "wind.hpp"
+
+
+// Values taken by a parameter, from min to max included
+struct Range
+{
+	std::string name;
+	float min;
+	float max;
+	float step;
+
+	uint32_t getCount() const
+	{
+		// The margin keeps max when the step doesn't divide the range exactly in floats
+		return step > 0.0f && max > min ? static_cast<uint32_t>((max - min) / step + 0.001f) + 1 : 1;
+	}
+
+	float getValue(uint32_t i) const
+	{
+		return min + i * step;
+	}
+};
+
+struct Result
+{
+	std::vector<float> values;
+	uint64_t branches;
+	uint64_t nodes;
+	uint64_t leaves;
+	uint32_t levels;
+	uint64_t memory;
+	double build_ms;
+	// Wind and update of one frame
+	float frame_us_p50;
+	float frame_us_p95;
+	float frame_us_max;
+};
+
+
+float getPercentile(std::vector<float>& values, float percentile)
+{
+	if (values.empty()) {
+		return 0.0f;
+	}
+	const uint64_t rank = std::min(values.size() - 1, static_cast<uint64_t>(percentile * values.size()));
+	std::nth_element(values.begin(), values.begin() + rank, values.end());
+	return values[rank];
+}
+
+double getElapsedUs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// Builds and simulates a tree for each combination of parameter values, prints a table of their size and costs
+// Usage: Tree2DSweep [--range name min max step]... [--conf file] [--frames N] [--warmup N] [--seed S] [--threads N]
+//                    [--budget-us US] [--format csv|json] [--out file]
+// Parameters have the names of tree.conf, the others keep the value of --conf or the demo's
+// Combinations run in parallel, one per thread, --threads 1 gives timings free of contention between them
+int main(int argc, char** argv)
+{
+	uint32_t frames = 300;
+	uint32_t warmup = 60;
+	uint64_t seed = 0;
+	uint32_t threads = std::max(1U, std::thread::hardware_concurrency());
+	// Combinations whose p95 frame goes over it are flagged, 0 to skip
+	float budget_us = 0.0f;
+	bool json = false;
+	std::string conf_file;
+	std::string out_file;
+	std::vector<Range> ranges;
+	for (int i(1); i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--range") && i + 4 < argc) {
+			Range range;
+			range.name = argv[++i];
+			range.min = static_cast<float>(std::atof(argv[++i]));
+			range.max = static_cast<float>(std::atof(argv[++i]));
+			range.step = static_cast<float>(std::atof(argv[++i]));
+			ranges.push_back(range);
+		}
+		else if (!std::strcmp(argv[i], "--conf") && has_value) {
+			conf_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--frames") && has_value) {
+			frames = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--warmup") && has_value) {
+			warmup = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--seed") && has_value) {
+			seed = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (!std::strcmp(argv[i], "--threads") && has_value) {
+			threads = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--budget-us") && has_value) {
+			budget_us = static_cast<float>(std::atof(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--format") && has_value) {
+			const char* format = argv[++i];
+			if (std::strcmp(format, "csv") && std::strcmp(format, "json")) {
+				std::fprintf(stderr, "Unknown format %s\n", format);
+				return 1;
+			}
+			json = !std::strcmp(format, "json");
+		}
+		else if (!std::strcmp(argv[i], "--out") && has_value) {
+			out_file = argv[++i];
+		}
+		else {
+			std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	v2::TreeConf base_conf{
+		80.0f, // branch_width
+		0.95f, // branch_width_ratio
+		0.75f, // split_width_ratio
+		0.5f, // deviation
+		PI * 0.25f, // split angle
+		0.1f, // branch_split_var;
+		40.0f, // branch_length;
+		0.96f, // branch_length_ratio;
+		0.5f, // branch_split_proba;
+		0.0f, // double split
+		Vec2(0.0f, -0.5f), // Attraction
+		8
+	};
+	if (!conf_file.empty()) {
+		TreeConfWatcher reader(conf_file);
+		reader.log = stderr;
+		if (!reader.read(base_conf)) {
+			std::fprintf(stderr, "Cannot read %s\n", conf_file.c_str());
+			return 1;
+		}
+	}
+	uint64_t combinations_count = 1;
+	for (const Range& range : ranges) {
+		v2::TreeConf conf = base_conf;
+		if (!TreeConfWatcher::set(conf, range.name.c_str(), &range.min, 1)) {
+			std::fprintf(stderr, "Cannot sweep %s\n", range.name.c_str());
+			return 1;
+		}
+		combinations_count *= range.getCount();
+	}
+
+	// The first range varies the slowest
+	std::vector<Result> results(combinations_count);
+	for (uint64_t i(0); i < combinations_count; ++i) {
+		uint64_t index = i;
+		results[i].values.resize(ranges.size());
+		for (uint64_t k(ranges.size()); k--;) {
+			const uint32_t count = ranges[k].getCount();
+			results[i].values[k] = ranges[k].getValue(static_cast<uint32_t>(index % count));
+			index /= count;
+		}
+	}
+
+	const float world_width = 1920.0f;
+	const float dt = 0.016f;
+	const std::vector<Wind> base_wind{
+		Wind(100.0f, 3.f, 700.0f),
+		Wind(300.0f, 2.f, 1050.0f),
+		Wind(400.0f, 3.f, 1208.0f),
+		Wind(500.0f, 4.f, 1400.0f),
+	};
+
+	struct Context
+	{
+		std::vector<Result>& results;
+		const std::vector<Range>& ranges;
+		const v2::TreeConf& base_conf;
+		const std::vector<Wind>& base_wind;
+		uint64_t seed;
+		uint32_t frames;
+		uint32_t warmup;
+		float world_width;
+		float dt;
+		std::atomic<uint32_t> next_result;
+		std::atomic<uint32_t> done_count;
+	};
+	Context context{results, ranges, base_conf, base_wind, seed, frames, warmup, world_width, dt, {0}, {0}};
+	swrm::Swarm swarm(threads);
+	swarm.execute([&context](uint32_t, uint32_t) {
+		const uint32_t results_count = static_cast<uint32_t>(context.results.size());
+		std::vector<float> frame_times;
+		for (uint32_t i(context.next_result++); i < results_count; i = context.next_result++) {
+			Result& result = context.results[i];
+			v2::TreeConf conf = context.base_conf;
+			for (uint64_t k(0); k < context.ranges.size(); ++k) {
+				TreeConfWatcher::set(conf, context.ranges[k].name.c_str(), &result.values[k], 1);
+			}
+
+			const std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+			v2::Tree tree = v2::TreeBuilder::build(Vec2(context.world_width * 0.5f, 1080.0f), conf, context.seed);
+			result.build_ms = getElapsedUs(build_start) * 0.001;
+			result.branches = tree.branches.size();
+			result.nodes = tree.getNodesCount();
+			result.leaves = tree.getLeavesCount();
+			result.levels = 0;
+			for (const v2::Branch& b : tree.branches) {
+				result.levels = std::max(result.levels, b.level + 1);
+			}
+			result.memory = tree.memoryFootprint().getTotal();
+
+			// Every combination sees the same wind
+			std::vector<Wind> wind = context.base_wind;
+			RNGf::setSeed(context.seed);
+			frame_times.clear();
+			for (uint32_t frame(0); frame < context.warmup + context.frames; ++frame) {
+				const std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+				for (Wind& w : wind) {
+					w.update(context.dt, context.world_width);
+				}
+				tree.applyWind(wind);
+				tree.updateFused(context.dt);
+				if (frame >= context.warmup) {
+					frame_times.push_back(static_cast<float>(getElapsedUs(frame_start)));
+				}
+			}
+			result.frame_us_p50 = getPercentile(frame_times, 0.5f);
+			result.frame_us_p95 = getPercentile(frame_times, 0.95f);
+			result.frame_us_max = frame_times.empty() ? 0.0f : *std::max_element(frame_times.begin(), frame_times.end());
+			std::fprintf(stderr, "[%u/%u] %llu nodes, build %.1f ms, frame p50 %.1f us\n", ++context.done_count, results_count,
+				static_cast<unsigned long long>(result.nodes), result.build_ms, result.frame_us_p50);
+		}
+	}).waitExecutionDone();
+
+	std::FILE* out = out_file.empty() ? stdout : std::fopen(out_file.c_str(), "w");
+	if (!out) {
+		std::fprintf(stderr, "Cannot write %s\n", out_file.c_str());
+		return 1;
+	}
+	if (json) {
+		std::fprintf(out, "{\n");
+		std::fprintf(out, "  \"seed\": %llu,\n", static_cast<unsigned long long>(seed));
+		std::fprintf(out, "  \"frames\": %u,\n", frames);
+		std::fprintf(out, "  \"threads\": %u,\n", threads);
+		std::fprintf(out, "  \"budget_us\": %.2f,\n", budget_us);
+		std::fprintf(out, "  \"results\": [\n");
+		for (uint64_t i(0); i < results.size(); ++i) {
+			const Result& result = results[i];
+			std::fprintf(out, "    {");
+			for (uint64_t k(0); k < ranges.size(); ++k) {
+				std::fprintf(out, "\"%s\": %g, ", ranges[k].name.c_str(), result.values[k]);
+			}
+			std::fprintf(out, "\"branches\": %llu, \"nodes\": %llu, \"leaves\": %llu, \"levels\": %u, \"memory\": %llu, \"build_ms\": %.3f, \"frame_us\": {\"p50\": %.2f, \"p95\": %.2f, \"max\": %.2f}",
+				static_cast<unsigned long long>(result.branches), static_cast<unsigned long long>(result.nodes), static_cast<unsigned long long>(result.leaves),
+				result.levels, static_cast<unsigned long long>(result.memory), result.build_ms, result.frame_us_p50, result.frame_us_p95, result.frame_us_max);
+			if (budget_us > 0.0f) {
+				std::fprintf(out, ", \"within_budget\": %s", result.frame_us_p95 <= budget_us ? "true" : "false");
+			}
+			std::fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+		}
+		std::fprintf(out, "  ]\n");
+		std::fprintf(out, "}\n");
+	}
+	else {
+		for (const Range& range : ranges) {
+			std::fprintf(out, "%s,", range.name.c_str());
+		}
+		std::fprintf(out, "branches,nodes,leaves,levels,memory,build_ms,frame_us_p50,frame_us_p95,frame_us_max%s\n", budget_us > 0.0f ? ",within_budget" : "");
+		for (const Result& result : results) {
+			for (float value : result.values) {
+				std::fprintf(out, "%g,", value);
+			}
+			std::fprintf(out, "%llu,%llu,%llu,%u,%llu,%.3f,%.2f,%.2f,%.2f",
+				static_cast<unsigned long long>(result.branches), static_cast<unsigned long long>(result.nodes), static_cast<unsigned long long>(result.leaves),
+				result.levels, static_cast<unsigned long long>(result.memory), result.build_ms, result.frame_us_p50, result.frame_us_p95, result.frame_us_max);
+			if (budget_us > 0.0f) {
+				std::fprintf(out, ",%d", result.frame_us_p95 <= budget_us ? 1 : 0);
+			}
+			std::fprintf(out, "\n");
+		}
+	}
+	if (out != stdout) {
+		std::fclose(out);
+	}
+
+	return 0;
+}
@@ -0,0 +1,319 @@
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parallel_tree_builder.hpp"
+#include "state_hash.hpp"
+#include "tree_builder.hpp"
+#include "vec2xn.hpp"
+#include "wind.hpp"
+
+
+// One way to build and update a tree, the harness compares two of them
+struct Variant
+{
+	std::string name;
+	// Tree::updateFused, or Tree::update if false
+	bool fused;
+	bool compact;
+	bool kinematic;
+	bool parallel_build;
+	simd::Backend backend;
+
+	Variant()
+		: fused(true)
+		, compact(false)
+		, kinematic(false)
+		, parallel_build(false)
+		, backend(simd::getBackend())
+	{}
+
+	// Comma separated options: fused|split, regular|compact|kinematic, serial|parallel and a SIMD backend
+	bool parse(const std::string& options)
+	{
+		name = options;
+		size_t start = 0;
+		while (start <= options.size()) {
+			const size_t end = std::min(options.find(',', start), options.size());
+			const std::string option = options.substr(start, end - start);
+			start = end + 1;
+			if (option == "fused" || option == "split") {
+				fused = option == "fused";
+			}
+			else if (option == "regular" || option == "compact" || option == "kinematic") {
+				compact = option != "regular";
+				kinematic = option == "kinematic";
+			}
+			else if (option == "serial" || option == "parallel") {
+				parallel_build = option == "parallel";
+			}
+			else if (!parseBackend(option)) {
+				std::fprintf(stderr, "Unknown option %s\n", option.c_str());
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool parseBackend(const std::string& option)
+	{
+		for (uint32_t i(0); i < simd::BackendsCount; ++i) {
+			const simd::Backend b = static_cast<simd::Backend>(i);
+			if (option == simd::getName(b)) {
+				if (!simd::isSupported(b)) {
+					std::fprintf(stderr, "SIMD backend %s not available\n", option.c_str());
+					return false;
+				}
+				backend = b;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+struct Settings
+{
+	uint64_t seed;
+	uint32_t seeds_count;
+	uint32_t frames;
+	float step;
+};
+
+// Hashes of each frame of each seed, frame 0 is the state right after the build
+std::vector<v2::StateHash> run(const Variant& variant, const Settings& settings, const v2::TreeConf& conf, swrm::Swarm& swarm)
+{
+	const float world_width = 1920.0f;
+	const float dt = 0.016f;
+	simd::setBackend(variant.backend);
+	std::vector<v2::StateHash> hashes;
+	hashes.reserve(static_cast<uint64_t>(settings.seeds_count) * (settings.frames + 1));
+	for (uint32_t s(0); s < settings.seeds_count; ++s) {
+		const uint64_t seed = settings.seed + s;
+		const Vec2 position(world_width * 0.5f, 1080.0f);
+		v2::Tree tree = variant.parallel_build ? v2::ParallelTreeBuilder::build(position, conf, seed, swarm) : v2::TreeBuilder::build(position, conf, seed);
+		if ((variant.compact && !tree.compactLeaves()) || !tree.setKinematicLeaves(variant.kinematic)) {
+			std::fprintf(stderr, "Tree of seed %llu too large for compact leaves\n", static_cast<unsigned long long>(seed));
+		}
+		// Same wind and same draws for every variant
+		std::vector<Wind> wind{
+			Wind(100.0f, 3.f, 700.0f),
+			Wind(300.0f, 2.f, 1050.0f),
+			Wind(400.0f, 3.f, 1208.0f),
+			Wind(500.0f, 4.f, 1400.0f),
+		};
+		RNGf::setSeed(seed);
+		hashes.push_back(v2::StateHash::compute(tree, settings.step));
+		for (uint32_t frame(0); frame < settings.frames; ++frame) {
+			for (Wind& w : wind) {
+				w.update(dt, world_width);
+			}
+			tree.applyWind(wind);
+			if (variant.fused) {
+				tree.updateFused(dt);
+			}
+			else {
+				tree.update(dt);
+			}
+			hashes.push_back(v2::StateHash::compute(tree, settings.step));
+		}
+	}
+	return hashes;
+}
+
+bool writeHashes(const std::string& filename, const Settings& settings, const std::vector<v2::StateHash>& hashes)
+{
+	std::FILE* file = std::fopen(filename.c_str(), "w");
+	if (!file) {
+		return false;
+	}
+	std::fprintf(file, "%llu %u %u %.9g\n", static_cast<unsigned long long>(settings.seed), settings.seeds_count, settings.frames, settings.step);
+	for (const v2::StateHash& hash : hashes) {
+		for (uint32_t i(0); i < v2::StateHash::SubsystemsCount; ++i) {
+			std::fprintf(file, "%016llx %016llx ", static_cast<unsigned long long>(hash.exact[i]), static_cast<unsigned long long>(hash.quantized[i]));
+		}
+		std::fprintf(file, "\n");
+	}
+	std::fclose(file);
+	return true;
+}
+
+bool readHashes(const std::string& filename, Settings& settings, std::vector<v2::StateHash>& hashes)
+{
+	std::FILE* file = std::fopen(filename.c_str(), "r");
+	if (!file) {
+		return false;
+	}
+	unsigned long long seed;
+	bool valid = std::fscanf(file, "%llu %u %u %f", &seed, &settings.seeds_count, &settings.frames, &settings.step) == 4;
+	settings.seed = seed;
+	const uint64_t count = static_cast<uint64_t>(settings.seeds_count) * (settings.frames + 1);
+	hashes.resize(valid ? count : 0);
+	for (v2::StateHash& hash : hashes) {
+		for (uint32_t i(0); i < v2::StateHash::SubsystemsCount && valid; ++i) {
+			unsigned long long exact, quantized;
+			valid = std::fscanf(file, "%llx %llx", &exact, &quantized) == 2;
+			hash.exact[i] = exact;
+			hash.quantized[i] = quantized;
+		}
+	}
+	std::fclose(file);
+	return valid;
+}
+
+// Prints the first frame each subsystem diverges at for each seed, returns true if the checked hashes all match
+bool compare(const Settings& settings, const std::vector<v2::StateHash>& hashes_1, const std::vector<v2::StateHash>& hashes_2, bool exact)
+{
+	bool match = true;
+	for (uint32_t s(0); s < settings.seeds_count; ++s) {
+		const uint64_t first = static_cast<uint64_t>(s) * (settings.frames + 1);
+		for (uint32_t i(0); i < v2::StateHash::SubsystemsCount; ++i) {
+			int64_t exact_frame = -1;
+			int64_t quantized_frame = -1;
+			for (uint32_t frame(0); frame <= settings.frames; ++frame) {
+				const v2::StateHash& hash_1 = hashes_1[first + frame];
+				const v2::StateHash& hash_2 = hashes_2[first + frame];
+				if (exact_frame < 0 && hash_1.exact[i] != hash_2.exact[i]) {
+					exact_frame = frame;
+				}
+				if (quantized_frame < 0 && hash_1.quantized[i] != hash_2.quantized[i]) {
+					quantized_frame = frame;
+				}
+			}
+			const char* name = v2::StateHash::getName(static_cast<v2::StateHash::Subsystem>(i));
+			std::printf("seed %llu %-8s exact: ", static_cast<unsigned long long>(settings.seed + s), name);
+			if (exact_frame < 0) {
+				std::printf("identical");
+			}
+			else {
+				std::printf("diverges at frame %lld", static_cast<long long>(exact_frame));
+			}
+			std::printf(", quantized: ");
+			if (quantized_frame < 0) {
+				std::printf("identical\n");
+			}
+			else {
+				std::printf("diverges at frame %lld\n", static_cast<long long>(quantized_frame));
+			}
+			match = match && quantized_frame < 0 && (!exact || exact_frame < 0);
+		}
+	}
+	return match;
+}
+
+
+// Steps trees of fixed seeds under a deterministic wind and hashes their state each frame, to check that an
+// optimized update still simulates the same thing
+// Usage: Tree2DGolden [--a options] [--b options] [--frames N] [--seed S] [--seeds N] [--step Q] [--exact]
+//                     [--write file] [--check file] [--threads N]
+// Options are comma separated: fused|split, regular|compact|kinematic, serial|parallel and a SIMD backend name
+// By default variant a is compared to b frame by frame, --write saves the hashes of a, --check compares a to saved ones
+// Returns 1 if the quantized hashes differ, or the exact ones with --exact
+int main(int argc, char** argv)
+{
+	Settings settings;
+	settings.seed = 0;
+	settings.seeds_count = 3;
+	settings.frames = 300;
+	settings.step = 0.01f;
+	Variant variant_a;
+	Variant variant_b;
+	std::string options_a = "fused";
+	std::string options_b = "split";
+	bool exact = false;
+	std::string write_file;
+	std::string check_file;
+	uint32_t threads = std::max(1U, std::thread::hardware_concurrency());
+	for (int i(1); i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--a") && has_value) {
+			options_a = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--b") && has_value) {
+			options_b = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--frames") && has_value) {
+			settings.frames = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--seed") && has_value) {
+			settings.seed = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (!std::strcmp(argv[i], "--seeds") && has_value) {
+			settings.seeds_count = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+		}
+		else if (!std::strcmp(argv[i], "--step") && has_value) {
+			settings.step = static_cast<float>(std::atof(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--exact")) {
+			exact = true;
+		}
+		else if (!std::strcmp(argv[i], "--write") && has_value) {
+			write_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--check") && has_value) {
+			check_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--threads") && has_value) {
+			threads = std::max(1, std::atoi(argv[++i]));
+		}
+		else {
+			std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (settings.step <= 0.0f) {
+		std::fprintf(stderr, "The quantization step has to be positive\n");
+		return 1;
+	}
+	if (!variant_a.parse(options_a) || !variant_b.parse(options_b)) {
+		return 1;
+	}
+
+	const v2::TreeConf tree_conf{
+		80.0f, // branch_width
+		0.95f, // branch_width_ratio
+		0.75f, // split_width_ratio
+		0.5f, // deviation
+		PI * 0.25f, // split angle
+		0.1f, // branch_split_var;
+		40.0f, // branch_length;
+		0.96f, // branch_length_ratio;
+		0.5f, // branch_split_proba;
+		0.0f, // double split
+		Vec2(0.0f, -0.5f), // Attraction
+		8
+	};
+	// Only used by parallel builds
+	swrm::Swarm swarm(threads);
+
+	std::vector<v2::StateHash> reference;
+	std::string reference_name = variant_b.name;
+	if (!check_file.empty()) {
+		// The saved settings replace the command line's
+		if (!readHashes(check_file, settings, reference)) {
+			std::fprintf(stderr, "Cannot read %s\n", check_file.c_str());
+			return 1;
+		}
+		reference_name = check_file;
+	}
+	const std::vector<v2::StateHash> hashes = run(variant_a, settings, tree_conf, swarm);
+	if (!write_file.empty()) {
+		if (!writeHashes(write_file, settings, hashes)) {
+			std::fprintf(stderr, "Cannot write %s\n", write_file.c_str());
+			return 1;
+		}
+		std::printf("Wrote %u frames of %u seeds of %s to %s\n", settings.frames, settings.seeds_count, variant_a.name.c_str(), write_file.c_str());
+		return 0;
+	}
+	if (check_file.empty()) {
+		reference = run(variant_b, settings, tree_conf, swarm);
+	}
+
+	std::printf("%s against %s, %u frames, quantization step %g\n", variant_a.name.c_str(), reference_name.c_str(), settings.frames, settings.step);
+	return compare(settings, hashes, reference, exact) ? 0 : 1;
+}
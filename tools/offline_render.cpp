@@ -0,0 +1,190 @@
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "profiler.hpp"
+#include "tree_builder.hpp"
+#include "forest_renderer.hpp"
+#include "recording.hpp"
+#include "soft_rasterizer.hpp"
+#include "wind.hpp"
+
+
+// Renders an animated forest without display, frames are written as a PNG sequence
+// Usage: Tree2DOffline [--frames N] [--width W] [--height H] [--trees N] [--seed S] [--threads N] [--texture file.png] [--out-dir dir]
+//                      [--record file] [--replay file]
+// The output directory has to exist, no image is written if it is empty
+// A replayed recording replaces the simulation, its frames count caps --frames
+int main(int argc, char** argv)
+{
+	uint32_t frames = 120;
+	uint32_t width = 1920;
+	uint32_t height = 1080;
+	uint32_t trees_count = 3;
+	uint64_t seed = 0;
+	uint32_t threads = std::max(1U, std::thread::hardware_concurrency());
+	std::string texture_file = "res/leaf.png";
+	std::string out_dir;
+	std::string record_file;
+	std::string replay_file;
+	for (int i(1); i < argc; ++i) {
+		const bool has_value = i + 1 < argc;
+		if (!std::strcmp(argv[i], "--frames") && has_value) {
+			frames = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--width") && has_value) {
+			width = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--height") && has_value) {
+			height = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--trees") && has_value) {
+			trees_count = static_cast<uint32_t>(std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--seed") && has_value) {
+			seed = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (!std::strcmp(argv[i], "--threads") && has_value) {
+			threads = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (!std::strcmp(argv[i], "--texture") && has_value) {
+			texture_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--out-dir") && has_value) {
+			out_dir = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--record") && has_value) {
+			record_file = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--replay") && has_value) {
+			replay_file = argv[++i];
+		}
+		else {
+			std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	const v2::TreeConf tree_conf{
+		80.0f, // branch_width
+		0.95f, // branch_width_ratio
+		0.75f, // split_width_ratio
+		0.5f, // deviation
+		PI * 0.25f, // split angle
+		0.1f, // branch_split_var;
+		40.0f, // branch_length;
+		0.96f, // branch_length_ratio;
+		0.5f, // branch_split_proba;
+		0.0f, // double split
+		Vec2(0.0f, -0.5f), // Attraction
+		8
+	};
+
+	// Same framing as the demo's window, trees are spread over its width
+	const float world_width = 1920.0f;
+	const float world_height = 1080.0f;
+	float dt = 0.016f;
+	std::vector<Wind> wind{
+		Wind(100.0f, 3.f, 700.0f),
+		Wind(300.0f, 2.f, 1050.0f),
+		Wind(400.0f, 3.f, 1208.0f),
+		Wind(500.0f, 4.f, 1400.0f),
+	};
+	std::vector<v2::Tree> trees;
+	rec::Player player;
+	const bool replay = !replay_file.empty();
+	if (replay) {
+		if (!player.open(replay_file)) {
+			std::fprintf(stderr, "Cannot replay %s\n", replay_file.c_str());
+			return 1;
+		}
+		frames = std::min(frames, player.getFramesCount());
+		dt = player.getDt();
+	}
+	else {
+		for (uint32_t i(0); i < trees_count; ++i) {
+			const float x = world_width * (i + 0.5f) / trees_count;
+			trees.push_back(v2::TreeBuilder::build(Vec2(x, world_height), tree_conf, seed + i));
+		}
+	}
+
+	rec::Recorder recorder;
+	if (!record_file.empty()) {
+		std::vector<const v2::Tree*> recorded;
+		for (const v2::Tree& tree : replay ? player.getTrees() : trees) {
+			recorded.push_back(&tree);
+		}
+		if (!recorder.open(record_file, recorded, dt)) {
+			std::fprintf(stderr, "Cannot record to %s\n", record_file.c_str());
+			return 1;
+		}
+	}
+
+	LeafAtlas atlas;
+	if (!atlas.addFromFile(texture_file) || !atlas.build(false)) {
+		std::fprintf(stderr, "Cannot load %s, leaves are not textured\n", texture_file.c_str());
+	}
+
+	swrm::Swarm swarm(threads);
+	ForestRenderer forest_renderer(&swarm);
+	forest_renderer.setAtlas(&atlas);
+	for (const v2::Tree& tree : replay ? player.getTrees() : trees) {
+		forest_renderer.addTree(tree);
+	}
+	SoftRasterizer rasterizer(width, height);
+	rasterizer.setView(sf::Vector2f(0.5f * world_width, 0.5f * world_height), sf::Vector2f(world_width, world_height));
+	if (atlas.getVariantsCount()) {
+		rasterizer.setTexture(atlas.getImage());
+	}
+
+	prof::Profiler& profiler = prof::Profiler::get();
+	const BoundingBox view(Vec2(0.0f, 0.0f), Vec2(world_width, world_height));
+	const int64_t start = profiler.now();
+	int64_t raster_time = 0;
+	char filename[512];
+	for (uint32_t frame(0); frame < frames; ++frame) {
+		if (replay) {
+			// The player starts on the first frame
+			if (frame) {
+				player.next();
+			}
+		}
+		else {
+			for (Wind& w : wind) {
+				w.update(dt, world_width);
+			}
+			for (v2::Tree& tree : trees) {
+				tree.applyWind(wind);
+				tree.updateFused(dt);
+			}
+		}
+		recorder.recordFrame();
+		forest_renderer.update(view);
+		const int64_t raster_start = profiler.now();
+		rasterizer.render(forest_renderer.getData(), &swarm);
+		raster_time += profiler.now() - raster_start;
+
+		if (!out_dir.empty()) {
+			std::snprintf(filename, sizeof(filename), "%s/frame_%05u.png", out_dir.c_str(), frame);
+			if (!rasterizer.saveToFile(filename)) {
+				std::fprintf(stderr, "Cannot write %s\n", filename);
+				return 1;
+			}
+		}
+	}
+	const double total_s = (profiler.now() - start) * 0.000000001;
+	const double raster_s = raster_time * 0.000000001;
+	std::printf("%u frames %ux%u on %u threads, %.1f frames/s rasterized, %.1f frames/s total\n",
+		frames, width, height, threads, raster_s > 0.0 ? frames / raster_s : 0.0, total_s > 0.0 ? frames / total_s : 0.0);
+	if (recorder.isOpen()) {
+		recorder.close();
+		std::printf("Recorded %u frames to %s, %llu bytes\n", recorder.getFramesCount(), record_file.c_str(), static_cast<unsigned long long>(recorder.getBytesWritten()));
+	}
+
+	return 0;
+}